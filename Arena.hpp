@@ -0,0 +1,345 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <new>
+#include <cstddef>
+#include <cstdint>
+#include <Numa.hpp>
+
+
+namespace TSMap
+{
+
+namespace utility
+{
+
+/**
+ * a slab allocator for the arrays of one map
+ *
+ * memory is taken from the system in chunks that grow from 64KB to 8MB and
+ * carved into blocks of 52 size classes: multiples of 16 bytes up to 256,
+ * then four classes per power of two up to 128KB, so a block wastes at most
+ * a quarter of its size. freed blocks go to the free list of their class and
+ * are handed out again before the chunk is touched, which suits buckets that
+ * grow by 50%: their old arrays are reused by the neighbours instead of
+ * fragmenting the global heap. when a class runs dry and the chunk is full,
+ * a free block of a larger class is split, so arrays freed by shrinking
+ * buckets are reused as well. larger requests (the bucket array of a big
+ * table) go straight to operator new.
+ *
+ * chunks are only returned to the system when the arena is destroyed.
+ *
+ * thread safe through a single mutex: buckets only allocate when their arrays
+ * grow or shrink, rarely enough for the lock not to matter next to the
+ * bucket locks.
+ *
+ * an arena constructed with a numa node maps its chunks and large blocks
+ * with mapOnNode instead, so all memory it hands out lives on that node no
+ * matter which thread touches it first.
+ *
+ * scope: an arena saves heap calls and contention on the global allocator,
+ * and places memory on a node. it does not save memory: blocks are rounded
+ * up to their size class and chunks are kept until the end, so a map of 10M
+ * integers takes ~17% more resident memory than with std::allocator, and
+ * none of it is returned by erase or shrinkToFit (./bench arena). which is
+ * why no map uses it unless given an ArenaAllocator explicitly.
+ */
+class Arena
+{
+public:
+    //largest request served from the chunks
+    static const size_t maxBlockSize = (size_t)1 << 17;
+    //alignment of every block
+    static const size_t blockAlignment = 16;
+
+    Arena() : Arena(-1)
+    {}
+
+    /**
+     * param: numa node to bind the memory to, -1 for none
+     */
+    explicit Arena(int node) :
+        chunks(nullptr),
+        cursor(nullptr),
+        chunkEnd(nullptr),
+        nextChunkSize(minChunkSize),
+        reserved(0),
+        node(node)
+    {
+        for(size_t i=0;i<classCount;++i) freeLists[i] = nullptr;
+    }
+
+    Arena(const Arena &) = delete;
+    Arena & operator=(const Arena &) = delete;
+
+    ~Arena()
+    {
+        while(chunks)
+        {
+            auto next = chunks->next;
+            release(chunks, chunks->size);
+            chunks = next;
+        }
+    }
+
+    void * allocate(size_t bytes)
+    {
+        if(bytes > maxBlockSize)
+        {
+            auto p = reserve(bytes);
+            std::lock_guard<std::mutex> lock(mutex);
+            reserved += bytes;
+            return p;
+        }
+
+        auto index = classOf(bytes);
+        std::lock_guard<std::mutex> lock(mutex);
+        auto block = freeLists[index];
+        if(block)
+        {
+            freeLists[index] = block->next;
+            return block;
+        }
+        auto size = classSize(index);
+        if((size_t)(chunkEnd - cursor) < size)
+        {
+            for(auto larger=index+1;larger<classCount;++larger)
+            {
+                block = freeLists[larger];
+                if(!block) continue;
+                freeLists[larger] = block->next;
+                auto p = reinterpret_cast<unsigned char*>(block);
+                carve(p + size, classSize(larger) - size);
+                return p;
+            }
+            newChunk(size);
+        }
+        auto p = cursor;
+        cursor += size;
+        return p;
+    }
+
+    /**
+     * param: pointer from allocate and the size it was requested with
+     */
+    void deallocate(void *p, size_t bytes)
+    {
+        if(!p) return;
+        if(bytes > maxBlockSize)
+        {
+            release(p, bytes);
+            std::lock_guard<std::mutex> lock(mutex);
+            reserved -= bytes;
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        push(p, classOf(bytes));
+    }
+
+    /**
+     * bytes currently taken from the system: all chunks plus the large
+     * blocks in use
+     */
+    size_t reservedBytes()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return reserved;
+    }
+
+    /**
+     * the numa node of the memory, -1 if not bound
+     */
+    int getNode() const
+    {
+        return node;
+    }
+
+private:
+    static const size_t minChunkSize = (size_t)1 << 16;
+    static const size_t maxChunkSize = (size_t)1 << 23;
+    //16 classes up to 256 bytes, 4 per power of two from 2^8 to 2^17
+    static const size_t classCount = 16 + 9*4;
+
+    //a free block, linked through its first bytes
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    //header of a chunk, followed by its blocks
+    struct alignas(blockAlignment) Chunk
+    {
+        Chunk *next;
+        size_t size;
+    };
+
+    std::mutex mutex;
+    FreeBlock *freeLists[classCount];
+    Chunk *chunks;
+    //unused part of the newest chunk
+    unsigned char *cursor;
+    unsigned char *chunkEnd;
+    size_t nextChunkSize;
+    size_t reserved;
+    int node;
+
+    static unsigned log2(size_t n)
+    {
+        return 63 - __builtin_clzll(n);
+    }
+
+    static size_t classOf(size_t bytes)
+    {
+        if(bytes <= 256) return bytes == 0 ? 0 : (bytes-1) >> 4;
+        auto octave = log2(bytes-1);
+        auto step = ((bytes-1) >> (octave-2)) & 3;
+        return 16 + (octave-8)*4 + step;
+    }
+
+    static size_t classSize(size_t index)
+    {
+        if(index < 16) return (index+1) << 4;
+        auto octave = 8 + (index-16)/4;
+        auto step = (index-16) % 4;
+        return (5+step) << (octave-2);
+    }
+
+    /**
+     * memory from the system: operator new, or pages bound to node
+     */
+    void * reserve(size_t bytes)
+    {
+        if(node < 0) return ::operator new(bytes);
+        auto p = mapOnNode(pageAligned(bytes), node);
+        if(!p) throw std::bad_alloc();
+        return p;
+    }
+
+    void release(void *p, size_t bytes)
+    {
+        if(node < 0) ::operator delete(p);
+        else munmap(p, pageAligned(bytes));
+    }
+
+    static size_t pageAligned(size_t bytes)
+    {
+        static const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+        return (bytes + pageSize - 1) & ~(pageSize - 1);
+    }
+
+    void push(void *p, size_t index)
+    {
+        auto block = static_cast<FreeBlock*>(p);
+        block->next = freeLists[index];
+        freeLists[index] = block;
+    }
+
+    /**
+     * puts bytes of free memory on the free lists, as blocks of the largest
+     * classes that fit. bytes is a multiple of blockAlignment.
+     */
+    void carve(unsigned char *begin, size_t bytes)
+    {
+        while(bytes >= blockAlignment)
+        {
+            auto index = classOf(bytes);
+            if(classSize(index) > bytes) --index;
+            push(begin, index);
+            begin += classSize(index);
+            bytes -= classSize(index);
+        }
+    }
+
+    /**
+     * starts a new chunk with room for at least one block of size. the rest
+     * of the old chunk goes to the free lists.
+     */
+    void newChunk(size_t size)
+    {
+        carve(cursor, chunkEnd - cursor);
+
+        auto chunkSize = std::max(nextChunkSize, size + sizeof(Chunk));
+        auto chunk = static_cast<Chunk*>(reserve(chunkSize));
+        chunk->next = chunks;
+        chunk->size = chunkSize;
+        chunks = chunk;
+        reserved += chunkSize;
+        cursor = reinterpret_cast<unsigned char*>(chunk) + sizeof(Chunk);
+        chunkEnd = reinterpret_cast<unsigned char*>(chunk) + chunkSize;
+        if(nextChunkSize < maxChunkSize) nextChunkSize *= 2;
+    }
+};
+
+/**
+ * standard allocator interface on top of an Arena
+ *
+ * a default constructed ArenaAllocator creates a new arena; copies and
+ * rebound copies share it, and the last one destroys it. passing one to a
+ * TSMap thus gives the map its own arena:
+ *
+ *     typedef TSMap::pair<K, V> entry;
+ *     TSMap<K, V, hash<K>, std::equal_to<K>,
+ *           utility::ArenaAllocator<entry> > map;
+ */
+template <typename T>
+class ArenaAllocator
+{
+    static_assert(alignof(T) <= Arena::blockAlignment,
+                  "ArenaAllocator does not support over-aligned types");
+
+    std::shared_ptr<Arena> arena;
+
+    template <typename U>
+    friend class ArenaAllocator;
+
+public:
+    typedef T value_type;
+
+    ArenaAllocator() :
+        arena(std::make_shared<Arena>())
+    {}
+
+    /**
+     * a new arena whose memory is bound to a numa node
+     */
+    explicit ArenaAllocator(int node) :
+        arena(std::make_shared<Arena>(node))
+    {}
+
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U> &rhs) :
+        arena(rhs.arena)
+    {}
+
+    T * allocate(size_t n)
+    {
+        return static_cast<T*>(arena->allocate(n*sizeof(T)));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        arena->deallocate(p, n*sizeof(T));
+    }
+
+    Arena & getArena() const
+    {
+        return *arena;
+    }
+
+    template <typename U>
+    bool operator==(const ArenaAllocator<U> &rhs) const
+    {
+        return arena == rhs.arena;
+    }
+
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U> &rhs) const
+    {
+        return arena != rhs.arena;
+    }
+};
+
+}//end utility namespace
+
+}//end tsmap ns
@@ -0,0 +1,278 @@
+#pragma once
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <fstream>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/**
+ * minimal helpers for the benchmark binaries
+ */
+namespace bench
+{
+
+using clock = std::chrono::steady_clock;
+
+/**
+ * xorshift64* generator, cheap enough to not show up in the measurements
+ */
+struct Random
+{
+    uint64_t state;
+
+    Random(uint64_t seed) : state(seed*0x9E3779B97F4A7C15ULL+1)
+    {}
+
+    uint64_t next()
+    {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 0x2545F4914F6CDD1DULL;
+    }
+};
+
+/**
+ * zipfian distributed ranks in [0, n): rank r is drawn with probability
+ * proportional to 1/(r+1)^theta. Gray et al., "Quickly generating
+ * billion-record synthetic databases": O(n) setup, O(1) per draw, as in YCSB.
+ * theta 0.99 is the YCSB default skew.
+ */
+struct Zipf
+{
+    uint64_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+    double half;
+
+    Zipf(uint64_t n, double theta) : n(n), theta(theta)
+    {
+        zetan = 0;
+        for(uint64_t i=1;i<=n;++i) zetan += 1.0/std::pow((double)i, theta);
+        auto zeta2 = 1.0 + std::pow(0.5, theta);
+        alpha = 1.0/(1.0-theta);
+        eta = (1.0 - std::pow(2.0/n, 1.0-theta)) / (1.0 - zeta2/zetan);
+        half = 1.0 + std::pow(0.5, theta);
+    }
+
+    uint64_t next(Random &random) const
+    {
+        auto u = (random.next() >> 11) * (1.0/9007199254740992.0);
+        auto uz = u*zetan;
+        if(uz < 1.0) return 0;
+        if(uz < half) return 1;
+        auto rank = (uint64_t)(n * std::pow(eta*u - eta + 1.0, alpha));
+        return rank < n ? rank : n-1;
+    }
+};
+
+/**
+ * per-operation latencies in nanoseconds, one instance per thread
+ */
+struct Latencies
+{
+    std::vector<uint32_t> samples;
+
+    void add(clock::time_point start, clock::time_point end)
+    {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(end-start).count();
+        samples.push_back(ns < 0xffffffffLL ? (uint32_t)ns : 0xffffffffu);
+    }
+
+    void merge(const Latencies &other)
+    {
+        samples.insert(samples.end(), other.samples.begin(), other.samples.end());
+    }
+
+    /**
+     * param: fraction in [0, 1], e.g. 0.99 for p99. reorders the samples.
+     */
+    uint32_t percentile(double p)
+    {
+        if(samples.empty()) return 0;
+        auto i = std::min(samples.size()-1, (size_t)(p*samples.size()));
+        std::nth_element(samples.begin(), samples.begin()+i, samples.end());
+        return samples[i];
+    }
+};
+
+/**
+ * runs fn(threadId) on the given number of threads, released at the same time
+ *
+ * returns: wall time in seconds from release to the last thread finishing
+ */
+template <typename FuncT>
+double runThreads(size_t threads, FuncT fn)
+{
+    std::atomic<size_t> ready(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> pool;
+    for(size_t t=0;t<threads;++t)
+    {
+        pool.emplace_back([&, t]()
+        {
+            ++ready;
+            while(!go.load()) std::this_thread::yield();
+            fn(t);
+        });
+    }
+    while(ready.load() < threads) std::this_thread::yield();
+    auto start = clock::now();
+    go = true;
+    for(auto &t : pool) t.join();
+    return std::chrono::duration<double>(clock::now()-start).count();
+}
+
+/**
+ * a hardware event counter (perf_event_open) for this process, including the
+ * threads it starts after the counter was created. not every machine exposes
+ * hardware counters (virtual machines often do not, or perf_event_paranoid
+ * forbids it); available() tells.
+ */
+class PerfCounter
+{
+    int fd;
+
+public:
+    /**
+     * param: PERF_COUNT_HW_* event, e.g. PERF_COUNT_HW_CACHE_MISSES
+     */
+    PerfCounter(uint64_t event) : fd(-1)
+    {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = event;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~PerfCounter()
+    {
+        if(fd >= 0) close(fd);
+    }
+
+    PerfCounter(const PerfCounter &) = delete;
+    PerfCounter & operator=(const PerfCounter &) = delete;
+
+    bool available() const
+    {
+        return fd >= 0;
+    }
+
+    /**
+     * events counted so far, 0 if unavailable
+     */
+    uint64_t read() const
+    {
+        uint64_t value = 0;
+        if(fd < 0 || ::read(fd, &value, sizeof(value)) != sizeof(value)) return 0;
+        return value;
+    }
+};
+
+/**
+ * resident set size of this process in bytes, 0 without /proc
+ */
+inline size_t residentBytes()
+{
+    std::ifstream statm("/proc/self/statm");
+    size_t size = 0, resident = 0;
+    statm>>size>>resident;
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+/**
+ * runs fn in a forked child process and waits for it, so that memory
+ * measurements are not skewed by the heap earlier runs left behind.
+ * runs fn in this process if fork fails.
+ */
+template <typename FuncT>
+void inChildProcess(FuncT fn)
+{
+    std::cout.flush();
+    auto pid = fork();
+    if(pid == 0)
+    {
+        fn();
+        std::cout.flush();
+        _exit(0);
+    }
+    if(pid < 0) fn();
+    else waitpid(pid, nullptr, 0);
+}
+
+/**
+ * prints one result row: name, threads, throughput
+ */
+inline void report(const std::string &name, size_t threads, size_t ops,
+                   double seconds)
+{
+    std::cout<<std::left<<std::setw(48)<<name
+             <<std::right<<std::setw(4)<<threads<<" threads "
+             <<std::setw(10)<<std::fixed<<std::setprecision(2)
+             <<ops/seconds/1e6<<" Mops/s"<<std::endl;
+}
+
+/**
+ * prints one result row with latency percentiles
+ */
+inline void report(const std::string &name, size_t threads, size_t ops,
+                   double seconds, Latencies &latencies)
+{
+    std::cout<<std::left<<std::setw(48)<<name
+             <<std::right<<std::setw(4)<<threads<<" threads "
+             <<std::setw(10)<<std::fixed<<std::setprecision(2)
+             <<ops/seconds/1e6<<" Mops/s"
+             <<"  p50 "<<std::setw(6)<<latencies.percentile(0.5)
+             <<"  p99 "<<std::setw(7)<<latencies.percentile(0.99)
+             <<"  p999 "<<std::setw(8)<<latencies.percentile(0.999)<<" ns"<<std::endl;
+}
+
+/**
+ * prints one result row as the time per operation, for single calls too
+ * short to read as a throughput, or per unit of work, e.g. per input bit
+ */
+inline void reportPerCall(const std::string &name, size_t threads, size_t ops,
+                          double seconds, const std::string &unit = "call")
+{
+    std::cout<<std::left<<std::setw(48)<<name
+             <<std::right<<std::setw(4)<<threads<<" threads "
+             <<std::setw(10)<<std::fixed<<std::setprecision(2)
+             <<seconds*1e9/ops<<" ns/"<<unit<<std::endl;
+}
+
+/**
+ * true if the benchmark group should run given the command line filters:
+ * a filter selects a group if it is part of the group name, or starts with
+ * the group name (e.g. "read_scaling/mutex" selects "read_scaling")
+ */
+inline bool selected(const std::string &name, int argc, char **argv)
+{
+    if(argc < 2) return true;
+    for(int i=1;i<argc;++i)
+    {
+        std::string filter(argv[i]);
+        if(name.find(filter) != std::string::npos) return true;
+        if(filter.compare(0, name.size(), name) == 0) return true;
+    }
+    return false;
+}
+
+}//end namespace bench
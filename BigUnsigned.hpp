@@ -0,0 +1,186 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+
+/**
+ * an unsigned integer of any size, as 64 bit limbs, lowest first, without
+ * leading zero limbs (0 has none).
+ *
+ * only what the recursion evaluators need: addition, bit access, comparison
+ * and decimal conversion. additions run over the limbs of the shorter
+ * operand plus the carry, and swap() exchanges the limbs without copying, so
+ * that accumulators can trade places as the walk of evaluateBitWalk does.
+ */
+class BigUnsigned
+{
+public:
+    BigUnsigned()
+    {}
+
+    //any unsigned value up to 128 bits
+    BigUnsigned(unsigned __int128 value)
+    {
+        while(value)
+        {
+            limbs.push_back((uint64_t)value);
+            value >>= 64;
+        }
+    }
+
+    /**
+     * parses a decimal number, e.g. "340282366920938463463374607431768211456"
+     */
+    static BigUnsigned fromString(const std::string &digits)
+    {
+        if(digits.empty()) throw new std::invalid_argument("BigUnsigned: no digits");
+        BigUnsigned result;
+        //19 digits at a time, the most a limb holds
+        uint64_t chunk = 0, scale = 1;
+        for(auto digit : digits)
+        {
+            if(digit < '0' || digit > '9') throw new std::invalid_argument("BigUnsigned: not a decimal digit");
+            chunk = chunk*10 + (uint64_t)(digit - '0');
+            scale *= 10;
+            if(scale == 10000000000000000000ULL)
+            {
+                result.multiplyAdd(scale, chunk);
+                chunk = 0;
+                scale = 1;
+            }
+        }
+        if(scale > 1) result.multiplyAdd(scale, chunk);
+        return result;
+    }
+
+    std::string toString() const
+    {
+        if(limbs.empty()) return "0";
+        auto rest = *this;
+        std::string digits;
+        while(!rest.limbs.empty())
+        {
+            auto chunk = rest.divide(10000000000000000000ULL);
+            for(int i=0;i<19 && (chunk || !rest.limbs.empty());++i)
+            {
+                digits.push_back((char)('0' + chunk%10));
+                chunk /= 10;
+            }
+        }
+        std::reverse(digits.begin(), digits.end());
+        return digits;
+    }
+
+    /**
+     * number of bits up to the highest set one, 0 for 0
+     */
+    size_t bitLength() const
+    {
+        if(limbs.empty()) return 0;
+        return 64*limbs.size() - __builtin_clzll(limbs.back());
+    }
+
+    bool bit(size_t index) const
+    {
+        return index/64 < limbs.size() && (limbs[index/64] >> (index%64)) & 1;
+    }
+
+    const std::vector<uint64_t> & getLimbs() const
+    {
+        return limbs;
+    }
+
+    BigUnsigned & operator+=(const BigUnsigned &rhs)
+    {
+        if(limbs.size() < rhs.limbs.size()) limbs.resize(rhs.limbs.size(), 0);
+        unsigned long long carry = 0;
+        size_t i = 0;
+        for(;i<rhs.limbs.size();++i)
+        {
+            unsigned long long sum;
+            auto overflow = __builtin_uaddll_overflow(limbs[i], rhs.limbs[i], &sum);
+            overflow |= __builtin_uaddll_overflow(sum, carry, &sum);
+            limbs[i] = sum;
+            carry = overflow;
+        }
+        for(;carry && i<limbs.size();++i) carry = ++limbs[i] == 0;
+        if(carry) limbs.push_back(1);
+        return *this;
+    }
+
+    friend BigUnsigned operator+(BigUnsigned lhs, const BigUnsigned &rhs)
+    {
+        return lhs += rhs;
+    }
+
+    bool operator==(const BigUnsigned &rhs) const
+    {
+        return limbs == rhs.limbs;
+    }
+
+    bool operator!=(const BigUnsigned &rhs) const
+    {
+        return limbs != rhs.limbs;
+    }
+
+    bool operator<(const BigUnsigned &rhs) const
+    {
+        if(limbs.size() != rhs.limbs.size()) return limbs.size() < rhs.limbs.size();
+        return std::lexicographical_compare(limbs.rbegin(), limbs.rend(), rhs.limbs.rbegin(), rhs.limbs.rend());
+    }
+
+    void swap(BigUnsigned &rhs)
+    {
+        limbs.swap(rhs.limbs);
+    }
+
+    friend void swap(BigUnsigned &lhs, BigUnsigned &rhs)
+    {
+        lhs.swap(rhs);
+    }
+
+    friend std::ostream& operator<<(std::ostream &stream, const BigUnsigned &rhs)
+    {
+        return stream<<rhs.toString();
+    }
+
+private:
+    std::vector<uint64_t> limbs;
+
+    /**
+     * *this = *this * factor + addend
+     */
+    void multiplyAdd(uint64_t factor, uint64_t addend)
+    {
+        unsigned __int128 carry = addend;
+        for(auto &limb : limbs)
+        {
+            carry += (unsigned __int128)limb * factor;
+            limb = (uint64_t)carry;
+            carry >>= 64;
+        }
+        if(carry) limbs.push_back((uint64_t)carry);
+    }
+
+    /**
+     * *this /= divisor, returns the remainder
+     */
+    uint64_t divide(uint64_t divisor)
+    {
+        unsigned __int128 remainder = 0;
+        for(auto i=limbs.size();i>0;--i)
+        {
+            remainder = remainder << 64 | limbs[i-1];
+            limbs[i-1] = (uint64_t)(remainder / divisor);
+            remainder %= divisor;
+        }
+        while(!limbs.empty() && limbs.back() == 0) limbs.pop_back();
+        return (uint64_t)remainder;
+    }
+};
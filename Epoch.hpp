@@ -0,0 +1,272 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+
+
+namespace TSMap
+{
+
+namespace utility
+{
+
+/**
+ * epoch based memory reclamation
+ *
+ * lock-free readers may still hold a pointer to an object that a writer just
+ * unlinked, so the writer cannot delete it right away. instead it retires the
+ * object; the object is deleted once every thread that could have seen it has
+ * left its critical section.
+ *
+ * a thread marks its critical sections with Epoch::Guard, which records the
+ * global epoch the thread is running in. the global epoch only advances when
+ * every thread inside a critical section has observed the current one, so an
+ * object retired in epoch e is unreachable for everybody once the global epoch
+ * reached e+2.
+ *
+ * there is one process-wide domain. per-thread records are allocated on first
+ * use and reused after the thread exits; objects a thread retired but could
+ * not free yet are handed over to the next thread that collects.
+ */
+class Epoch
+{
+    //an object waiting to be deleted
+    struct Retired
+    {
+        void *object;
+        void (*deleter)(void *);
+        uint64_t epoch;
+        Retired *next;
+    };
+
+    //per-thread state
+    struct Record
+    {
+        //(epoch << 1) | 1 while inside a critical section, 0 otherwise
+        std::atomic<uint64_t> state;
+        //owned by a live thread
+        std::atomic<bool> inUse;
+        //nesting depth of guards, only touched by the owner
+        unsigned nesting;
+        //retired objects of the owner, newest first
+        Retired *retired;
+        size_t retiredCount;
+        Record *next;
+
+        Record() : state(0), inUse(true), nesting(0), retired(nullptr),
+                   retiredCount(0), next(nullptr)
+        {}
+    };
+
+    struct Domain
+    {
+        std::atomic<uint64_t> epoch;
+        //list of all records ever created, never shrinks
+        std::atomic<Record*> records;
+        //retired objects of exited threads
+        std::mutex orphanMutex;
+        Retired *orphans;
+
+        Domain() : epoch(1), records(nullptr), orphans(nullptr)
+        {}
+    };
+
+    //collect every this many retires
+    static const size_t collectThreshold = 64;
+
+    /**
+     * the domain is intentionally leaked: thread_local records are released
+     * at thread exit, which may run after static destructors
+     */
+    static Domain & domain()
+    {
+        static Domain *d = new Domain();
+        return *d;
+    }
+
+    /**
+     * releases the record of an exiting thread
+     */
+    struct Owner
+    {
+        Record *record;
+
+        Owner() : record(nullptr)
+        {}
+
+        ~Owner()
+        {
+            if(!record) return;
+            //hand the leftovers to the other threads
+            if(record->retired)
+            {
+                auto &d = domain();
+                std::lock_guard<std::mutex> lock(d.orphanMutex);
+                auto last = record->retired;
+                while(last->next) last = last->next;
+                last->next = d.orphans;
+                d.orphans = record->retired;
+            }
+            record->retired = nullptr;
+            record->retiredCount = 0;
+            record->state = 0;
+            record->inUse = false;
+        }
+    };
+
+    static Record & local()
+    {
+        static thread_local Owner owner;
+        if(!owner.record) owner.record = acquireRecord();
+        return *owner.record;
+    }
+
+    static Record * acquireRecord()
+    {
+        auto &d = domain();
+        //reuse the record of an exited thread
+        for(auto r = d.records.load(); r; r = r->next)
+        {
+            bool expected = false;
+            if(!r->inUse.load() && r->inUse.compare_exchange_strong(expected, true))
+            {
+                r->nesting = 0;
+                return r;
+            }
+        }
+        auto r = new Record();
+        auto head = d.records.load();
+        do
+        {
+            r->next = head;
+        } while(!d.records.compare_exchange_weak(head, r));
+        return r;
+    }
+
+    /**
+     * advances the global epoch if every thread in a critical section runs in
+     * the current one
+     *
+     * returns the global epoch after the attempt
+     */
+    static uint64_t tryAdvance()
+    {
+        auto &d = domain();
+        auto epoch = d.epoch.load();
+        for(auto r = d.records.load(); r; r = r->next)
+        {
+            auto state = r->state.load();
+            if((state & 1) && (state >> 1) != epoch) return epoch;
+        }
+        d.epoch.compare_exchange_strong(epoch, epoch+1);
+        return d.epoch.load();
+    }
+
+    /**
+     * deletes the objects of list retired before safeEpoch
+     *
+     * returns the remaining list, count is decremented by the number deleted
+     */
+    static Retired * freeBefore(Retired *list, uint64_t safeEpoch, size_t &count)
+    {
+        Retired *keep = nullptr;
+        while(list)
+        {
+            auto next = list->next;
+            if(list->epoch < safeEpoch)
+            {
+                list->deleter(list->object);
+                delete list;
+                --count;
+            }
+            else
+            {
+                list->next = keep;
+                keep = list;
+            }
+            list = next;
+        }
+        return keep;
+    }
+
+    static void collect(Record &record)
+    {
+        auto epoch = tryAdvance();
+        if(epoch < 2) return;
+        record.retired = freeBefore(record.retired, epoch-1, record.retiredCount);
+
+        auto &d = domain();
+        std::unique_lock<std::mutex> lock(d.orphanMutex, std::try_to_lock);
+        if(lock.owns_lock() && d.orphans)
+        {
+            size_t unused = 0;
+            d.orphans = freeBefore(d.orphans, epoch-1, unused);
+        }
+    }
+
+public:
+    /**
+     * RAII critical section. pointers loaded from shared lock-free structures
+     * stay valid while the guard is alive. guards nest.
+     */
+    class Guard
+    {
+        Record &record;
+
+    public:
+        Guard() : record(local())
+        {
+            if(record.nesting++ == 0)
+            {
+                //seq_cst store: the epoch must be visible before any shared
+                //pointer is loaded
+                record.state.store((domain().epoch.load() << 1) | 1);
+            }
+        }
+
+        ~Guard()
+        {
+            if(--record.nesting == 0)
+            {
+                record.state.store(0, std::memory_order_release);
+            }
+        }
+
+        Guard(const Guard &) = delete;
+        Guard & operator=(const Guard &) = delete;
+    };
+
+    /**
+     * schedules deleter(object) for when no thread can hold a pointer to it
+     *
+     * object must already be unreachable for threads that start a critical
+     * section from now on.
+     */
+    static void retire(void *object, void (*deleter)(void *))
+    {
+        auto &record = local();
+        auto retired = new Retired();
+        retired->object = object;
+        retired->deleter = deleter;
+        retired->epoch = domain().epoch.load();
+        retired->next = record.retired;
+        record.retired = retired;
+        if(++record.retiredCount % collectThreshold == 0)
+        {
+            collect(record);
+        }
+    }
+
+    /**
+     * retire for objects allocated with new
+     */
+    template <typename T>
+    static void retire(T *object)
+    {
+        retire(object, [](void *p){ delete static_cast<T*>(p); });
+    }
+};
+
+}//end utility namespace
+
+}//end tsmap ns
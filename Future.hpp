@@ -0,0 +1,169 @@
+#pragma once
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <exception>
+#include <stdexcept>
+#include <utility>
+
+
+namespace TSMap
+{
+
+template <typename T>
+class future;
+
+namespace utility
+{
+
+/**
+ * the state shared by a future and the thread that produces its result: the
+ * result or an exception, a ready flag, and the number of owners. the last
+ * owner deletes it, so a derived class (e.g. a queued write of TSMap) can
+ * carry the work along with its result.
+ */
+template <typename T>
+class FutureState
+{
+    std::atomic<bool> ready;
+    std::atomic<int> owners;
+    T value;
+    std::exception_ptr exception;
+
+    template <typename U>
+    friend class ::TSMap::future;
+
+public:
+    /**
+     * param: number of owners, 2 for a future and its producer
+     */
+    explicit FutureState(int owners) :
+        ready(false),
+        owners(owners),
+        value()
+    {}
+
+    virtual ~FutureState()
+    {}
+
+    void setValue(T result)
+    {
+        value = std::move(result);
+        ready.store(true, std::memory_order_release);
+    }
+
+    void setException(std::exception_ptr error)
+    {
+        exception = error;
+        ready.store(true, std::memory_order_release);
+    }
+
+    void release()
+    {
+        if(owners.fetch_sub(1, std::memory_order_acq_rel) == 1) delete this;
+    }
+};
+
+}//end utility namespace
+
+/**
+ * std::future allocates a state with a mutex and a condition variable and
+ * takes the mutex on both ends, several times the cost of a short map
+ * operation, so implement our own for results that are expected soon.
+ *
+ * move only. wait() spins, then yields, then sleeps in growing steps up to
+ * 100us: there is no condition variable, so a producer never needs a lock
+ * to publish a result.
+ */
+template <typename T>
+class future
+{
+    utility::FutureState<T> *state;
+
+public:
+    future() : state(nullptr)
+    {}
+
+    explicit future(utility::FutureState<T> *state) : state(state)
+    {}
+
+    future(future<T> &&rhs) noexcept : state(rhs.state)
+    {
+        rhs.state = nullptr;
+    }
+
+    future<T> & operator=(future<T> &&rhs) noexcept
+    {
+        if(this == &rhs) return *this;
+        if(state) state->release();
+        state = rhs.state;
+        rhs.state = nullptr;
+        return *this;
+    }
+
+    future(const future<T> &) = delete;
+    future<T> & operator=(const future<T> &) = delete;
+
+    ~future()
+    {
+        if(state) state->release();
+    }
+
+    /**
+     * false for a default constructed or moved from future, and after get()
+     */
+    bool valid() const
+    {
+        return state != nullptr;
+    }
+
+    /**
+     * true once the result is there, does not block
+     */
+    bool ready() const
+    {
+        return state->ready.load(std::memory_order_acquire);
+    }
+
+    void wait() const
+    {
+        for(int spin=0;spin<64;++spin)
+        {
+            if(ready()) return;
+        }
+        for(int yield=0;yield<256;++yield)
+        {
+            if(ready()) return;
+            std::this_thread::yield();
+        }
+        auto pause = std::chrono::microseconds(1);
+        while(!ready())
+        {
+            std::this_thread::sleep_for(pause);
+            if(pause < std::chrono::microseconds(100)) pause *= 2;
+        }
+    }
+
+    /**
+     * waits for the result and returns it, or rethrows the exception of the
+     * producer. the future is no longer valid afterwards.
+     */
+    T get()
+    {
+        if(!state) throw new std::logic_error("get() on an invalid TSMap::future");
+        wait();
+        auto done = state;
+        state = nullptr;
+        if(done->exception)
+        {
+            auto error = done->exception;
+            done->release();
+            std::rethrow_exception(error);
+        }
+        T result = std::move(done->value);
+        done->release();
+        return result;
+    }
+};
+
+}//end tsmap ns
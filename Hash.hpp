@@ -0,0 +1,155 @@
+#pragma once
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+
+
+namespace TSMap
+{
+
+namespace utility
+{
+
+/**
+ * murmur3 64 bit finalizer: every input bit affects every output bit.
+ *
+ * std::hash is the identity for integers in libstdc++, so sequential ids
+ * differ only in their low bits; this spreads them over the whole word.
+ */
+inline uint64_t mix64(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * 64x64 -> 128 bit multiplication, low half to a, high half to b
+ */
+inline void mum(uint64_t &a, uint64_t &b)
+{
+    auto r = (unsigned __int128)a * b;
+    a = (uint64_t)r;
+    b = (uint64_t)(r >> 64);
+}
+
+/**
+ * same, folded back to 64 bits
+ */
+inline uint64_t mumFold(uint64_t a, uint64_t b)
+{
+    mum(a, b);
+    return a ^ b;
+}
+
+inline uint64_t read64(const unsigned char *p)
+{
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/**
+ * hash of a byte string, following wyhash: 16 bytes per step, each step one
+ * 128 bit multiplication, and two more multiplications to finish. up to 16
+ * bytes take no loop at all. faster than the murmur2 std::hash<std::string>
+ * uses, which multiplies once per 8 bytes plus a longer finalizer.
+ */
+inline uint64_t hashBytes(const void *data, size_t length)
+{
+    const uint64_t k0 = 0xa0761d6478bd642fULL;
+    const uint64_t k1 = 0xe7037ed1a0b428dbULL;
+    const uint64_t k2 = 0x8ebc6af09c88c6e3ULL;
+
+    auto p = static_cast<const unsigned char *>(data);
+    uint64_t h = k0;
+    uint64_t a = 0, b = 0;
+    if(length <= 16)
+    {
+        //4..16 bytes: four possibly overlapping 4 byte reads cover them
+        if(length >= 4)
+        {
+            auto middle = (length >> 3) << 2;
+            a = (read32(p) << 32) | read32(p+middle);
+            b = (read32(p+length-4) << 32) | read32(p+length-4-middle);
+        }
+        else if(length > 0)
+        {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length-1];
+        }
+    }
+    else
+    {
+        auto remaining = length;
+        for(;remaining > 16;remaining -= 16, p += 16)
+        {
+            h = mumFold(read64(p) ^ k1, read64(p+8) ^ h);
+        }
+        //last 16 bytes, may overlap the last step
+        a = read64(p+remaining-16);
+        b = read64(p+remaining-8);
+    }
+    a ^= k1;
+    b ^= h;
+    mum(a, b);
+    return mumFold(a ^ k0 ^ length, b ^ k2);
+}
+
+/**
+ * default: std::hash, remixed
+ */
+template <typename KeyT, typename Enable = void>
+struct HashBase
+{
+    size_t operator()(const KeyT &key) const
+    {
+        return (size_t)mix64(std::hash<KeyT>()(key));
+    }
+};
+
+template <typename KeyT>
+struct HashBase<KeyT, typename std::enable_if<std::is_integral<KeyT>::value ||
+                                              std::is_enum<KeyT>::value>::type>
+{
+    size_t operator()(KeyT key) const
+    {
+        return (size_t)mix64((uint64_t)key);
+    }
+};
+
+}//end utility namespace
+
+/**
+ * the default hash function of the maps
+ *
+ * integers and enums are run through a 64 bit finalizer, strings through
+ * utility::hashBytes, everything else through std::hash and the finalizer.
+ * all bits of the result are well distributed, so tables can take the bucket
+ * index from any bits of it.
+ */
+template <typename KeyT>
+struct hash : utility::HashBase<KeyT>
+{};
+
+template <>
+struct hash<std::string>
+{
+    size_t operator()(const std::string &key) const
+    {
+        return (size_t)utility::hashBytes(key.data(), key.size());
+    }
+};
+
+}//end tsmap ns
@@ -0,0 +1,419 @@
+#pragma once
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <stdexcept>
+#include <algorithm>
+#include <type_traits>
+#include <KVPairList.hpp>
+#include <SimdScan.hpp>
+
+
+namespace TSMap
+{
+
+namespace utility
+{
+
+/**
+ * a KVPairList for integral (and enum) keys compared with ==, in a
+ * structure-of-arrays layout: the keys in one array, the values in another.
+ *
+ * the live entries are kept dense at the front of both arrays: erase moves
+ * the last entry into the hole. there are no tombstones, so no validity
+ * array and nothing to compact, and a lookup only reads the keys array,
+ * with the SSE2 or AVX2 kernels of SimdScan.hpp for 4 and 8 byte keys: 4 to
+ * 16 keys per step. a slot takes sizeof(KeyT) + sizeof(ValueT) bytes, without the
+ * padding of a pair and the validity flag: 16 instead of 17 bytes for
+ * uint64_t keys and values, 12 instead of 17 for uint32_t keys.
+ *
+ * TSMap uses it by default for such keys, see DefaultBucket. unlike
+ * KVPairList, erase reorders the entries of a bucket.
+ *
+ * there are no stored pairs: forEachUnlocked hands out a
+ * pair<const KeyT&, ValueT&> referring to the key and the value in their
+ * arrays, so callers take the entry as auto&.
+ */
+template <typename KeyT, typename ValueT, typename MutexT = std::mutex,
+          typename Allocator = std::allocator<pair<KeyT, ValueT> > >
+class IntegralKVPairList
+{
+    static_assert(std::is_integral<KeyT>::value || std::is_enum<KeyT>::value,
+                  "IntegralKVPairList compares keys with ==");
+
+public:
+    typedef typename BucketMutex<MutexT>::type mutex_type;
+    typedef typename ReadLock<mutex_type>::type read_lock;
+    typedef Allocator allocator_type;
+
+private:
+    //bucket-specific lock
+    mutable mutex_type mutex;
+    //keys of the entries, the first validSize are live
+    KeyT *keys;
+    //values of the entries, same order
+    ValueT *values;
+    //number of entries
+    size_t validSize;
+    //allocated bucket size
+    size_t capacity;
+    //set once the entries have been migrated to another table by TSMap
+    bool sealed;
+    Allocator allocator;
+    TSMAP_STATS(BucketCounters counters;)
+
+public:
+    IntegralKVPairList(size_t capacity, const Allocator &allocator = Allocator()) :
+        keys(nullptr),
+        values(nullptr),
+        validSize(0),
+        capacity(capacity > 0 ? capacity : 1),
+        sealed(false),
+        allocator(allocator)
+    {}
+
+    /**
+     * default constructor: bucket size = 32
+     */
+    IntegralKVPairList() :
+        IntegralKVPairList(32)
+    {}
+
+    explicit IntegralKVPairList(const Allocator &allocator) :
+        IntegralKVPairList(32, allocator)
+    {}
+
+    ~IntegralKVPairList()
+    {
+        clearUnlocked();
+    }
+
+    /**
+     * copies the entries of rhs
+     */
+    IntegralKVPairList & operator=(const IntegralKVPairList &rhs)
+    {
+        if(this == &rhs) return *this;
+        std::unique_lock<mutex_type> rlock(rhs.mutex, std::defer_lock);
+        std::unique_lock<mutex_type> lock(mutex, std::defer_lock);
+        std::lock(rlock, lock);
+
+        clearUnlocked();
+        capacity = std::max(rhs.capacity, rhs.validSize);
+        if(rhs.validSize == 0) return *this;
+        allocate(capacity);
+        for(size_t i=0;i<rhs.validSize;++i)
+        {
+            keys[i] = rhs.keys[i];
+            values[i] = rhs.values[i];
+        }
+        validSize = rhs.validSize;
+        return *this;
+    }
+
+    size_t size()
+    {
+        read_lock lock(mutex);
+        return validSize;
+    }
+
+    void upsert(const pair<KeyT, ValueT> &kv)
+    {
+        std::lock_guard<mutex_type> lock(mutex);
+        upsertUnlocked(kv, 0);
+    }
+
+    void upsert(pair<KeyT, ValueT> &&kv)
+    {
+        std::lock_guard<mutex_type> lock(mutex);
+        upsertUnlocked(std::move(kv), 0);
+    }
+
+    /**
+     * thread safety is not guaranteed, for debugging purposes mostly.
+     */
+    friend std::ostream& operator<<(std::ostream &stream, const IntegralKVPairList& rhs)
+    {
+        for(size_t i=0;i<rhs.validSize;++i)
+        {
+            stream<<rhs.keys[i]<<":"<<rhs.values[i]<<", ";
+        }
+        return stream;
+    }
+
+    void erase(const KeyT &key)
+    {
+        std::lock_guard<mutex_type> lock(mutex);
+        eraseUnlocked(key, 0);
+    }
+
+    size_t count(const KeyT &key)
+    {
+        read_lock lock(mutex);
+        return indexOf(key) == npos ? 0 : 1;
+    }
+
+    ValueT & operator[](const KeyT &key)
+    {
+        read_lock lock(mutex);
+        auto value = findUnlocked(key, 0);
+        if(value) return *value;
+        //this is why one should check for validity first using .count()
+        throw new std::invalid_argument("invalid key given in IntegralKVPairList");
+    }
+
+    /*
+     * unsynchronized interface, see KVPairList. the hash is not used.
+     */
+
+    mutex_type & getMutex()
+    {
+        return mutex;
+    }
+
+    bool isSealed() const
+    {
+        return sealed;
+    }
+
+    void seal()
+    {
+        sealed = true;
+    }
+
+    size_t sizeUnlocked() const
+    {
+        return validSize;
+    }
+
+    size_t capacityUnlocked() const
+    {
+        return keys ? capacity : 0;
+    }
+
+    BucketStats statsUnlocked() const
+    {
+        BucketStats stats;
+        stats.size = validSize;
+        stats.capacity = capacityUnlocked();
+        TSMAP_STATS(stats.setCounters(mutex, &counters);)
+        return stats;
+    }
+
+    void reserveUnlocked(size_t initialCapacity)
+    {
+        if(!keys && initialCapacity > 0) capacity = initialCapacity;
+    }
+
+    /**
+     * makes room for count more entries, see KVPairList
+     */
+    void reserveMoreUnlocked(size_t count)
+    {
+        if(count == 0) return;
+        if(!keys) resize(std::max(capacity, count));
+        else if(validSize + count > capacity) resize(std::max((size_t)(capacity*1.5), validSize + count));
+    }
+
+    ValueT * findUnlocked(const KeyT &key, size_t)
+    {
+        auto i = indexOf(key);
+        return i == npos ? nullptr : &values[i];
+    }
+
+    template <typename PairT>
+    bool upsertUnlocked(PairT &&kv, size_t hash)
+    {
+        auto value = findUnlocked(kv.first, hash);
+        if(value)
+        {
+            *value = std::forward<PairT>(kv).second;
+            return false;
+        }
+        insertUnlocked(std::forward<PairT>(kv), hash);
+        return true;
+    }
+
+    template <typename PairT>
+    ValueT * insertUnlocked(PairT &&kv, size_t)
+    {
+        if(!keys)
+        {
+            resize(capacity);
+        }
+        else if(validSize >= capacity)
+        {
+            //increase array size by 50%
+            resize(std::max((size_t)(capacity*1.5), capacity+1));
+        }
+        auto i = validSize;
+        keys[i] = kv.first;
+        values[i] = std::forward<PairT>(kv).second;
+        ++validSize;
+        return &values[i];
+    }
+
+    /**
+     * moves the last entry into the slot of key. shrinks the arrays to twice
+     * the valid size once less than a quarter of the capacity is used.
+     */
+    bool eraseUnlocked(const KeyT &key, size_t)
+    {
+        auto i = indexOf(key);
+        if(i == npos) return false;
+        auto last = validSize-1;
+        if(i != last)
+        {
+            keys[i] = keys[last];
+            values[i] = std::move(values[last]);
+        }
+        values[last] = ValueT();
+        --validSize;
+
+        if(validSize*4 < capacity && capacity > minShrinkCapacity)
+        {
+            resize(std::max(validSize*2, minShrinkCapacity));
+        }
+        return true;
+    }
+
+    /**
+     * nothing to do, the entries are always dense
+     */
+    void compactUnlocked()
+    {}
+
+    void shrinkToFitUnlocked()
+    {
+        if(!keys) return;
+        if(validSize == 0)
+        {
+            clearUnlocked();
+            capacity = minShrinkCapacity;
+            return;
+        }
+        resize(validSize);
+    }
+
+    /**
+     * calls fn(pair<const KeyT&, ValueT&>&) on every entry. nothing is moved
+     * or written, so readers holding a shared lock may run it concurrently.
+     */
+    template <typename FuncT>
+    void forEachUnlocked(FuncT fn)
+    {
+        for(size_t i=0;i<validSize;++i)
+        {
+            pair<const KeyT&, ValueT&> kv(keys[i], values[i]);
+            fn(kv);
+        }
+    }
+
+    void clearUnlocked()
+    {
+        deallocateArray(allocator, keys, capacity);
+        deallocateArray(allocator, values, capacity);
+        keys = nullptr;
+        values = nullptr;
+        validSize = 0;
+    }
+
+private:
+    static const size_t npos = (size_t)-1;
+    //capacity below which erase does not shrink the arrays
+    static const size_t minShrinkCapacity = 8;
+
+    /**
+     * index of key, npos if absent. scans with simd::findKey.
+     */
+    size_t indexOf(const KeyT &key)
+    {
+        auto i = simd::findKey(keys, validSize, key);
+        TSMAP_STATS(
+            counters.lookups.fetch_add(1, std::memory_order_relaxed);
+            counters.probes.fetch_add(i == validSize ? validSize : i+1,
+                                      std::memory_order_relaxed);
+        )
+        return i == validSize ? npos : i;
+    }
+
+    /**
+     * allocates both arrays at the given capacity. the previous ones must
+     * have been released.
+     */
+    void allocate(size_t newCapacity)
+    {
+        keys = allocateArray<KeyT>(allocator, newCapacity);
+        try
+        {
+            values = allocateArray<ValueT>(allocator, newCapacity);
+        }
+        catch(...)
+        {
+            deallocateArray(allocator, keys, newCapacity);
+            keys = nullptr;
+            throw;
+        }
+    }
+
+    /**
+     * moves the entries to arrays of the new capacity
+     */
+    void resize(size_t newCapacity)
+    {
+        if(newCapacity == capacity && keys) return;
+        if(newCapacity < validSize)
+        {
+            throw new std::invalid_argument(
+                    "new capacity in IntegralKVPairList::resize is smaller than the valid size");
+        }
+        auto oldKeys = keys;
+        auto oldValues = values;
+        auto oldCapacity = capacity;
+        try
+        {
+            allocate(newCapacity);
+        }
+        catch(...)
+        {
+            keys = oldKeys;
+            values = oldValues;
+            throw;
+        }
+        for(size_t i=0;i<validSize;++i)
+        {
+            keys[i] = oldKeys[i];
+            values[i] = std::move(oldValues[i]);
+        }
+        deallocateArray(allocator, oldKeys, oldCapacity);
+        deallocateArray(allocator, oldValues, oldCapacity);
+        capacity = newCapacity;
+        TSMAP_STATS(counters.resizes.fetch_add(1, std::memory_order_relaxed);)
+    }
+};
+
+/**
+ * the bucket type TSMap uses unless told otherwise: IntegralKVPairList for
+ * integral and enum keys compared with std::equal_to, KVPairList for all
+ * other keys
+ */
+template <typename KeyT, typename ValueT, typename MutexT, typename KeyEqual,
+          typename Allocator,
+          bool integral = (std::is_integral<KeyT>::value || std::is_enum<KeyT>::value) &&
+                          std::is_same<KeyEqual, std::equal_to<KeyT> >::value>
+struct DefaultBucket
+{
+    typedef KVPairList<KeyT, ValueT, MutexT, KeyEqual, Allocator> type;
+};
+
+template <typename KeyT, typename ValueT, typename MutexT, typename KeyEqual,
+          typename Allocator>
+struct DefaultBucket<KeyT, ValueT, MutexT, KeyEqual, Allocator, true>
+{
+    typedef IntegralKVPairList<KeyT, ValueT, MutexT, Allocator> type;
+};
+
+}//end utility namespace
+
+}//end tsmap ns
@@ -3,8 +3,13 @@
 #include <memory>
 #include <algorithm>
 #include <mutex>
+#include <shared_mutex>
 #include <functional>
 #include <stdexcept>
+#include <new>
+#include <utility>
+#include <type_traits>
+#include <Stats.hpp>
 
 
 namespace TSMap
@@ -12,6 +17,10 @@ namespace TSMap
 /**
  * since stl containers are disabled
  * implement our own pair
+ *
+ * copy and move are the defaulted memberwise ones, so that a pair of
+ * trivially copyable types is trivially copyable and a pair of e.g. strings is
+ * moved instead of copied when a bucket relocates its entries.
  */
 template <typename FirstT, typename SecondT>
 struct pair
@@ -27,68 +36,255 @@ struct pair
     {}
 
     /**
-     * copy constructor
+     * constructs first and second from anything they are constructible from,
+     * forwarding rvalues
      */
-    pair(const pair<FirstT, SecondT> & rhs)
+    template <typename F, typename S>
+    pair(F &&first, S &&second)
+        : first(std::forward<F>(first)),
+          second(std::forward<S>(second))
+    {}
+
+    pair(const pair<FirstT, SecondT> &rhs) = default;
+    pair(pair<FirstT, SecondT> &&rhs) = default;
+    pair<FirstT, SecondT> & operator=(const pair<FirstT, SecondT> &rhs) = default;
+    pair<FirstT, SecondT> & operator=(pair<FirstT, SecondT> &&rhs) = default;
+};
+
+/**
+ * similar to std::make_pair
+ */
+template <typename FirstT, typename SecondT>
+pair<typename std::decay<FirstT>::type, typename std::decay<SecondT>::type>
+make_pair(FirstT &&first, SecondT &&second)
+{
+    return pair<typename std::decay<FirstT>::type, typename std::decay<SecondT>::type>(
+            std::forward<FirstT>(first), std::forward<SecondT>(second));
+}
+
+/**
+ * std::optional is c++17, so implement our own
+ *
+ * holds either nothing or a copy of a value, e.g. the result of a lookup that
+ * may miss.
+ */
+template <typename T>
+class optional
+{
+    alignas(T) unsigned char storage[sizeof(T)];
+    bool engaged;
+
+public:
+    optional() : engaged(false)
+    {}
+
+    optional(const T &value) : engaged(true)
+    {
+        new (storage) T(value);
+    }
+
+    optional(const optional<T> &rhs) : engaged(rhs.engaged)
     {
-        this->first = rhs.first;
-        this->second = rhs.second;
+        if(engaged) new (storage) T(*rhs);
     }
 
-    pair<FirstT, SecondT> & operator=(const pair<FirstT, SecondT>& rhs)
+    optional<T> & operator=(const optional<T> &rhs)
     {
-        this->first = rhs.first;
-        this->second = rhs.second;
+        if(this == &rhs) return *this;
+        reset();
+        if(rhs.engaged)
+        {
+            new (storage) T(*rhs);
+            engaged = true;
+        }
         return *this;
     }
+
+    ~optional()
+    {
+        reset();
+    }
+
+    void reset()
+    {
+        if(engaged) reinterpret_cast<T*>(storage)->~T();
+        engaged = false;
+    }
+
+    bool has_value() const
+    {
+        return engaged;
+    }
+
+    explicit operator bool() const
+    {
+        return engaged;
+    }
+
+    /**
+     * no check, only valid if has_value()
+     */
+    T & operator*()
+    {
+        return *reinterpret_cast<T*>(storage);
+    }
+
+    const T & operator*() const
+    {
+        return *reinterpret_cast<const T*>(storage);
+    }
+
+    T * operator->()
+    {
+        return reinterpret_cast<T*>(storage);
+    }
+
+    const T * operator->() const
+    {
+        return reinterpret_cast<const T*>(storage);
+    }
+
+    /**
+     * returns the value, or fallback if empty
+     */
+    T value_or(const T &fallback) const
+    {
+        return engaged ? **this : fallback;
+    }
 };
 
+namespace utility
+{
+
 /**
- * similar to std::make_pair
+ * lock type for the read-only operations of a bucket (size, count, lookup).
+ *
+ * exclusive for plain mutexes, shared for reader-writer mutexes, so that a
+ * bucket declared with std::shared_timed_mutex lets readers run concurrently
+ * while writers keep exclusive access.
  */
-template <typename FirstT, typename SecondT>
-const pair<FirstT, SecondT> make_pair(
-        const FirstT &first,
-        const SecondT &second)
+template <typename MutexT>
+struct ReadLock
+{
+    typedef std::unique_lock<MutexT> type;
+};
+
+template <>
+struct ReadLock<std::shared_timed_mutex>
+{
+    typedef std::shared_lock<std::shared_timed_mutex> type;
+};
+
+template <>
+struct ReadLock<CountingMutex<std::shared_timed_mutex> >
 {
-    return pair<FirstT, SecondT>(first, second);
+    typedef std::shared_lock<CountingMutex<std::shared_timed_mutex> > type;
+};
+
+/**
+ * allocates an array of n value-initialized T through alloc, rebound to T.
+ * the array must be released with deallocateArray and the same n.
+ */
+template <typename T, typename AllocT>
+T * allocateArray(const AllocT &alloc, size_t n)
+{
+    typedef typename std::allocator_traits<AllocT>::template rebind_alloc<T> rebound_type;
+    typedef std::allocator_traits<rebound_type> traits;
+    rebound_type rebound(alloc);
+    T *array = traits::allocate(rebound, n);
+    size_t i = 0;
+    try
+    {
+        for(;i<n;++i) traits::construct(rebound, array+i);
+    }
+    catch(...)
+    {
+        while(i > 0) traits::destroy(rebound, array+(--i));
+        traits::deallocate(rebound, array, n);
+        throw;
+    }
+    return array;
 }
 
-namespace utility
+/**
+ * destroys and releases an array from allocateArray. no-op on nullptr.
+ */
+template <typename T, typename AllocT>
+void deallocateArray(const AllocT &alloc, T *array, size_t n)
 {
+    if(!array) return;
+    typedef typename std::allocator_traits<AllocT>::template rebind_alloc<T> rebound_type;
+    typedef std::allocator_traits<rebound_type> traits;
+    rebound_type rebound(alloc);
+    for(size_t i=0;i<n;++i) traits::destroy(rebound, array+i);
+    traits::deallocate(rebound, array, n);
+}
 
 /**
  * a "bucket" in map for hash function level collision
  * needs to be thread-safe at this level.
  *
  * underlying datastructure: two dynamically allocated arrays, one for key-value
- * pair and the other for key-value pair validity (for quick deletion)
+ * pair and the other for key-value pair validity (for quick deletion). the
+ * arrays are allocated on first insert, so that empty buckets are cheap.
  *
  * the invalid elements are removed at resizing
+ *
+ * besides the locked public interface, the bucket exposes an unsynchronized
+ * interface (*Unlocked methods) for TSMap, which takes the bucket lock itself
+ * and may combine several operations under one acquisition.
+ *
+ * MutexT is the bucket lock. with std::shared_timed_mutex the read-only
+ * operations take it shared, see ReadLock, and with TSMAP_ENABLE_STATS it is
+ * wrapped in a CountingMutex, see mutex_type. KeyEqual compares keys. both
+ * arrays are allocated through Allocator (rebound to the element type), e.g.
+ * a utility::ArenaAllocator shared by all buckets of a map.
  */
-template <typename KeyT, typename ValueT>
+template <typename KeyT, typename ValueT, typename MutexT = std::mutex,
+          typename KeyEqual = std::equal_to<KeyT>,
+          typename Allocator = std::allocator<pair<KeyT, ValueT> > >
 class KVPairList
 {
+public:
+    typedef typename BucketMutex<MutexT>::type mutex_type;
+    typedef typename ReadLock<mutex_type>::type read_lock;
+    typedef Allocator allocator_type;
+
+private:
+    /*
+     * the members a lookup reads (lock, arrays, length) come first: with
+     * std::mutex they fill exactly one cache line, see utility::Padded.
+     * the arrays are owned directly, a shared_ptr would add a control block
+     * and atomic reference counting for nothing. both have capacity elements.
+     */
+
     //bucket-specific lock
-    std::mutex mutex;
+    mutable mutex_type mutex;
     //key-value pair array
-    std::shared_ptr<pair<KeyT, ValueT> > list;
+    pair<KeyT, ValueT> *list;
     //mark stored value as valid/invalid. for fast erase.
-    std::shared_ptr<bool> validity;
-    //allocated bucket size
-    size_t capacity;
+    bool *validity;
     //pointer at last element written to array
     size_t lastElementPtr;
     //number of ``actual'' or valid entries
     size_t validSize;
+    //allocated bucket size
+    size_t capacity;
+    //set once the entries have been migrated to another table by TSMap
+    bool sealed;
+    KeyEqual keyEqual;
+    Allocator allocator;
+    TSMAP_STATS(BucketCounters counters;)
     //defaults capacity to 32
 public:
-    KVPairList(size_t capacity) :
-        list(new pair<KeyT, ValueT>[capacity], std::default_delete<pair<KeyT, ValueT>[]>()),
-        validity(new bool[capacity], std::default_delete<bool[]>()),
-        capacity(capacity),
+    KVPairList(size_t capacity, const Allocator &allocator = Allocator()) :
+        list(nullptr),
+        validity(nullptr),
         lastElementPtr(0),
-        validSize(0)
+        validSize(0),
+        capacity(capacity > 0 ? capacity : 1),
+        sealed(false),
+        allocator(allocator)
     {}
 
     /**
@@ -98,21 +294,33 @@ public:
         KVPairList(32)
     {}
 
+    explicit KVPairList(const Allocator &allocator) :
+        KVPairList(32, allocator)
+    {}
+
+    ~KVPairList()
+    {
+        clearUnlocked();
+    }
+
     /**
-     * operator= for assignment from right hand side (rhs)
+     * operator= for assignment from right hand side (rhs), copies the entries
      *
      */
-    KVPairList & operator=(const KVPairList<KeyT, ValueT> rhs)
+    KVPairList & operator=(const KVPairList &rhs)
     {
+        if(this == &rhs) return *this;
         //need to guard both lists for mutex access
-        std::lock_guard<std::mutex> rlock(rhs.mutex);
-        std::lock_guard<std::mutex> lock(mutex);
+        std::unique_lock<mutex_type> rlock(rhs.mutex, std::defer_lock);
+        std::unique_lock<mutex_type> lock(mutex, std::defer_lock);
+        std::lock(rlock, lock);
 
-        list = rhs.list;
-        validity = rhs.validity;
+        clearUnlocked();
         capacity = rhs.capacity;
-        lastElementPtr = rhs.lastElementPtr;
-        validSize = rhs.validSize;
+        for(size_t i=0;i<rhs.lastElementPtr;++i)
+        {
+            if(rhs.validity[i]) insertUnlocked(rhs.list[i], 0);
+        }
 
         return *this;
     }
@@ -124,7 +332,7 @@ public:
     size_t size()
     {
         //acquire lock:
-        std::lock_guard<std::mutex> lock(mutex);
+        read_lock lock(mutex);
         auto retVal = validSize;
         return retVal;
     }
@@ -138,28 +346,19 @@ public:
     void upsert(const pair<KeyT, ValueT> &kv)
     {
         //acquire lock:
-        std::lock_guard<std::mutex> lock(mutex);
+        std::lock_guard<mutex_type> lock(mutex);
+        upsertUnlocked(kv, 0);
+    }
 
-        //if array full, increase array size by 50%
-        if(lastElementPtr >= capacity)
-        {
-            resize((size_t)(capacity*1.5));
-        }
-        //if key exists in list, update
-        auto i = indexOf(kv.first);
-        if(i != -1)
-        {
-            list.get()[i].second = kv.second;
-            validity.get()[i] = true;
-        }
-        else
-        {
-            //insert new
-            this->list.get()[lastElementPtr] = kv;
-            this->validity.get()[lastElementPtr] = true;
-            lastElementPtr++;
-            validSize++;
-        }
+    /**
+     * upsert moving key and value into the list
+     *
+     * param: pair of key-value
+     */
+    void upsert(pair<KeyT, ValueT> &&kv)
+    {
+        std::lock_guard<mutex_type> lock(mutex);
+        upsertUnlocked(std::move(kv), 0);
     }
 
     /**
@@ -175,8 +374,8 @@ public:
     {
         //stream<<"{";
         for(auto i=0;i<rhs.lastElementPtr;++i){
-            if(rhs.validity.get()[i])
-            stream<<rhs.list.get()[i].first<<":"<<rhs.list.get()[i].second<<", ";
+            if(rhs.validity[i])
+            stream<<rhs.list[i].first<<":"<<rhs.list[i].second<<", ";
         }
         //stream<<"}";
         return stream;
@@ -185,7 +384,10 @@ public:
     /**
      * removes an element by key
      *
-     * only marking the element to be removed as invalid for fast operation
+     * only marking the element to be removed as invalid for fast operation.
+     * the dead slots (tombstones) are compacted away once they make up half
+     * of the used slots, and the arrays shrink once less than a quarter of
+     * the capacity is valid, see eraseUnlocked.
      *
      * if element not found in list, it is considered to be ``removed''
      * param: key of object to be removed
@@ -193,16 +395,9 @@ public:
     void erase(const KeyT &key)
     {
         //erase object with given key by marking validity as invalid
-        std::lock_guard<std::mutex> lock(mutex);
-        //linear search
-        auto i = indexOf(key);
-        if(i != -1)
-        {
-            validity.get()[i] = false;
-
-            --validSize;
-        }
+        std::lock_guard<mutex_type> lock(mutex);
         //if element not found in list, it is considered to be ``removed''
+        eraseUnlocked(key, 0);
     }
 
     /**
@@ -213,7 +408,7 @@ public:
      */
     size_t count(const KeyT &key)
     {
-        std::lock_guard<std::mutex> lock(mutex);
+        read_lock lock(mutex);
         auto count = indexOf(key) == -1 ? 0 : 1;
         return count;
     }
@@ -226,11 +421,11 @@ public:
      */
     ValueT & operator[](const KeyT & key)
     {
-        std::lock_guard<std::mutex> lock(mutex);
-        auto i = indexOf(key);
-        if(i != -1)
+        read_lock lock(mutex);
+        auto value = findUnlocked(key, 0);
+        if(value)
         {
-            return list.get()[i].second;
+            return *value;
         }
         //else:
         //throw error:
@@ -238,10 +433,251 @@ public:
         throw new std::invalid_argument("invalid key given in KVList");
     }
 
+    /*
+     * unsynchronized interface.
+     *
+     * the caller must hold getMutex(), at least shared for the const-like
+     * findUnlocked and sizeUnlocked. the hash parameter is the hash of the
+     * key as computed by the owner of the bucket; KVPairList does not use it.
+     */
+
+    mutex_type & getMutex()
+    {
+        return mutex;
+    }
+
+    /**
+     * true once TSMap moved the entries of this bucket to a bigger table.
+     * a sealed bucket must not be read or written anymore.
+     */
+    bool isSealed() const
+    {
+        return sealed;
+    }
+
+    void seal()
+    {
+        sealed = true;
+    }
+
+    size_t sizeUnlocked() const
+    {
+        return validSize;
+    }
+
+    /**
+     * number of allocated slots, 0 while the arrays are not allocated
+     */
+    size_t capacityUnlocked() const
+    {
+        return list ? capacity : 0;
+    }
+
+    /**
+     * occupancy of the list, and its counters with TSMAP_ENABLE_STATS
+     */
+    BucketStats statsUnlocked() const
+    {
+        BucketStats stats;
+        stats.size = validSize;
+        stats.capacity = capacityUnlocked();
+        stats.tombstones = lastElementPtr-validSize;
+        TSMAP_STATS(stats.setCounters(mutex, &counters);)
+        return stats;
+    }
+
+    /**
+     * sets the capacity the arrays are first allocated with.
+     * no effect once the bucket has been written to.
+     */
+    void reserveUnlocked(size_t initialCapacity)
+    {
+        if(!list && initialCapacity > 0) capacity = initialCapacity;
+    }
+
+    /**
+     * makes room for count more entries: the next count inserts of new keys
+     * do not allocate. TSMap calls it before it moves entries in, which must
+     * not be lost to a failed allocation halfway.
+     */
+    void reserveMoreUnlocked(size_t count)
+    {
+        if(count == 0) return;
+        if(!list)
+        {
+            resize(std::max(capacity, count));
+        }
+        else if(lastElementPtr + count > capacity)
+        {
+            if(validSize + count <= capacity) compactUnlocked();
+            else resize(std::max((size_t)(capacity*1.5), validSize + count));
+        }
+    }
+
+    /**
+     * returns pointer to the value stored with key, nullptr if key is absent
+     */
+    ValueT * findUnlocked(const KeyT &key, size_t)
+    {
+        auto i = indexOf(key);
+        return i == -1 ? nullptr : &list[i].second;
+    }
+
+    /**
+     * upsert without locking. PairT is a (const) pair<KeyT, ValueT>
+     * reference, moved from if it is an rvalue.
+     *
+     * returns true if the key was not in the list before
+     */
+    template <typename PairT>
+    bool upsertUnlocked(PairT &&kv, size_t hash)
+    {
+        //if key exists in list, update
+        auto value = findUnlocked(kv.first, hash);
+        if(value)
+        {
+            *value = std::forward<PairT>(kv).second;
+            return false;
+        }
+        insertUnlocked(std::forward<PairT>(kv), hash);
+        return true;
+    }
+
+    /**
+     * appends an entry whose key is known to be absent
+     *
+     * returns pointer to the stored value, valid until the next write
+     */
+    template <typename PairT>
+    ValueT * insertUnlocked(PairT &&kv, size_t)
+    {
+        if(!list)
+        {
+            resize(capacity);
+        }
+        else if(lastElementPtr >= capacity)
+        {
+            //a quarter of the slots are tombstones: reuse them
+            if((lastElementPtr-validSize)*4 >= capacity)
+            {
+                compactUnlocked();
+            }
+            //otherwise increase array size by 50%
+            else
+            {
+                resize(std::max((size_t)(capacity*1.5), capacity+1));
+            }
+        }
+        //insert new
+        auto i = lastElementPtr;
+        this->list[i] = std::forward<PairT>(kv);
+        this->validity[i] = true;
+        lastElementPtr++;
+        validSize++;
+        return &list[i].second;
+    }
+
+    /**
+     * erase without locking
+     *
+     * the key and value of the erased slot are released right away. trailing
+     * tombstones are dropped, the list is compacted in place once half of the
+     * used slots are tombstones, and shrunk to twice its valid size once less
+     * than a quarter of the capacity is valid.
+     *
+     * returns true if an element was removed
+     */
+    bool eraseUnlocked(const KeyT &key, size_t)
+    {
+        //linear search
+        auto i = indexOf(key);
+        if(i == -1) return false;
+        validity[i] = false;
+        list[i] = pair<KeyT, ValueT>();
+        --validSize;
+
+        while(lastElementPtr > 0 && !validity[lastElementPtr-1]) --lastElementPtr;
+        if(validSize*4 < capacity && capacity > minShrinkCapacity)
+        {
+            resize(std::max(validSize*2, minShrinkCapacity));
+        }
+        else if((lastElementPtr-validSize)*2 > lastElementPtr &&
+                lastElementPtr-validSize >= minCompactTombstones)
+        {
+            compactUnlocked();
+        }
+        return true;
+    }
+
+    /**
+     * moves the valid entries to the front of the arrays, in order, dropping
+     * all tombstones. keeps the capacity.
+     */
+    void compactUnlocked()
+    {
+        size_t j = 0;
+        for(size_t i=0;i<lastElementPtr;++i)
+        {
+            if(!validity[i]) continue;
+            if(i != j)
+            {
+                list[j] = std::move(list[i]);
+                list[i] = pair<KeyT, ValueT>();
+                validity[j] = true;
+                validity[i] = false;
+            }
+            ++j;
+        }
+        lastElementPtr = j;
+    }
+
+    /**
+     * drops all tombstones and reallocates the arrays to the valid size;
+     * releases them if the list is empty
+     */
+    void shrinkToFitUnlocked()
+    {
+        if(!list) return;
+        if(validSize == 0)
+        {
+            clearUnlocked();
+            capacity = minShrinkCapacity;
+            return;
+        }
+        resize(validSize);
+    }
+
+    /**
+     * calls fn(pair<KeyT, ValueT>&) on every valid entry
+     */
+    template <typename FuncT>
+    void forEachUnlocked(FuncT fn)
+    {
+        for(size_t i=0;i<lastElementPtr;++i)
+        {
+            if(validity[i]) fn(list[i]);
+        }
+    }
+
+    /**
+     * drops all entries and releases the arrays
+     */
+    void clearUnlocked()
+    {
+        releaseArrays();
+        lastElementPtr = 0;
+        validSize = 0;
+    }
+
     //allows access from TSMap class
     friend class TSMap;
 
 private:
+    //capacity below which erase does not shrink the arrays
+    static const size_t minShrinkCapacity = 8;
+    //tombstones needed before erase compacts
+    static const size_t minCompactTombstones = 4;
+
     /**
      * return index of key-value pair if key exists in list
      * -1 otherwise
@@ -256,53 +692,76 @@ private:
         auto index = -1;
         for(auto i=0;i<lastElementPtr;++i)
         {
-            if(list.get()[i].first == key && validity.get()[i])
+            if(validity[i] && keyEqual(list[i].first, key))
             {
                 index = i;
                 break;
             }
         }
+        TSMAP_STATS(
+            counters.lookups.fetch_add(1, std::memory_order_relaxed);
+            counters.probes.fetch_add(index == -1 ? lastElementPtr : index+1,
+                                      std::memory_order_relaxed);
+        )
         return index;
     }
 
+    /**
+     * destroys and frees both arrays, leaves the counters alone
+     */
+    void releaseArrays()
+    {
+        deallocateArray(allocator, list, capacity);
+        deallocateArray(allocator, validity, capacity);
+        list = nullptr;
+        validity = nullptr;
+    }
+
     /**
      * resizes both validity list and key-value pair list to new size according
-     * to parameter, copies element over.
+     * to parameter, moves element over.
      *
      * param: new capacity to be resized
      */
     void resize(size_t newCapacity)
     {
         //do nothing
-        if(newCapacity == capacity) return;
+        if(newCapacity == capacity && list) return;
 
-        if(newCapacity >= lastElementPtr)
+        if(newCapacity >= validSize)
         {
-            std::shared_ptr<pair<KeyT, ValueT> >
-                newList(new pair<KeyT, ValueT>[(size_t)(newCapacity)],
-                        std::default_delete<pair<KeyT, ValueT>[]>());
-            std::shared_ptr<bool>
-                newValidity(new bool[(size_t)newCapacity](),
-                            std::default_delete<bool[]>());
+            auto newList = allocateArray<pair<KeyT, ValueT> >(allocator, newCapacity);
+            bool *newValidity;
+            try
+            {
+                newValidity = allocateArray<bool>(allocator, newCapacity);
+            }
+            catch(...)
+            {
+                deallocateArray(allocator, newList, newCapacity);
+                throw;
+            }
             //copy to newlist only the valid entries:
             auto newListPtr = 0;
             for(auto i=0;i<this->lastElementPtr;++i){
-                if (validity.get()[i]){
-                    newList.get()[newListPtr] = list.get()[i];
-                    newValidity.get()[newListPtr] = true;
+                if (validity[i]){
+                    newList[newListPtr] = std::move(list[i]);
+                    newValidity[newListPtr] = true;
                     newListPtr++;
                 }
             }
+            releaseArrays();
             list = newList;
             validity = newValidity;
             lastElementPtr = newListPtr;
             this->capacity = newCapacity;
+            TSMAP_STATS(counters.resizes.fetch_add(1, std::memory_order_relaxed);)
         }
         else
         {
             //throw error
             throw new std::invalid_argument(
-                    "new capacity in KVPairList::resize is smaller than current length");
+                    "new capacity in KVPairList::resize is smaller than the valid size");
         }
     }
 };
@@ -0,0 +1,437 @@
+#pragma once
+#include <iostream>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <stdexcept>
+#include <cstdint>
+#include <KVPairList.hpp>
+#include <Hash.hpp>
+#include <Epoch.hpp>
+
+namespace TSMap
+{
+
+/**
+ * a lock-free thread safe hashmap, sibling of TSMap with the same
+ * insert/lookup/deleteByKey/count interface
+ *
+ * implemented as a split-ordered list (Shalev & Shavit): all entries live in
+ * one lock-free linked list (Harris/Michael, deletion marks the next pointer
+ * of a node before unlinking it), sorted by the bit-reversed hash of their
+ * key. a bucket is a pointer to a dummy node in that list, and since the
+ * order is by reversed hash, doubling the number of buckets never moves an
+ * entry: a new bucket just gets a dummy node inserted in the middle of its
+ * parent bucket. buckets are initialized lazily on first use.
+ *
+ * the bucket directory is a fixed array of segments of doubling size, so it
+ * never has to be copied either.
+ *
+ * values are stored out of line and replaced atomically on upsert, which is
+ * why lookup returns a copy rather than a reference. unlinked nodes and
+ * replaced values are freed through utility::Epoch once no reader can still
+ * see them.
+ *
+ * Hash and KeyEqual as in TSMap. the bucket index is the low bits of the
+ * hash, so a custom Hash must not leave them constant.
+ */
+template <typename KeyT, typename ValueT,
+          typename Hash = ::TSMap::hash<KeyT>,
+          typename KeyEqual = std::equal_to<KeyT> >
+class LockFreeTSMap
+{
+private:
+    struct Node
+    {
+        //bit-reversed hash. odd for entries, even for bucket dummies
+        uint64_t sortKey;
+        KeyT key;
+        //nullptr for dummies
+        std::atomic<ValueT*> value;
+        //next node, low bit set once this node is logically deleted
+        std::atomic<uintptr_t> next;
+
+        Node(uint64_t sortKey) :
+            sortKey(sortKey), key(), value(nullptr), next(0)
+        {}
+
+        Node(uint64_t sortKey, const KeyT &key) :
+            sortKey(sortKey), key(key), value(nullptr), next(0)
+        {}
+    };
+
+    static const size_t segmentCount = 64;
+
+    //segment 0 holds buckets 0..1, segment s > 0 holds buckets 2^s..2^(s+1)-1
+    std::atomic<std::atomic<Node*>*> segments[segmentCount];
+    //number of buckets, a power of two
+    std::atomic<size_t> bucketCount;
+    //number of entries in the map
+    std::atomic<size_t> elementCount;
+    //entries per bucket that trigger doubling the bucket count
+    float maxLoadFactor;
+    Hash hashFunc;
+    KeyEqual keyEqual;
+
+public:
+    /**
+     * default constructor: start with 128 buckets
+     */
+    LockFreeTSMap() : LockFreeTSMap(128)
+    {}
+
+    LockFreeTSMap(size_t tableSize) :
+        bucketCount(1),
+        elementCount(0),
+        maxLoadFactor(2.0f)
+    {
+        for(size_t i=0;i<segmentCount;++i) segments[i] = nullptr;
+        while(bucketCount.load() < tableSize) bucketCount = bucketCount.load()*2;
+        //bucket 0 holds the head of the list
+        setBucket(0, new Node(0));
+    }
+
+    /**
+     * not thread safe: no other thread may use the map anymore
+     */
+    ~LockFreeTSMap()
+    {
+        auto node = getBucket(0);
+        while(node)
+        {
+            auto next = unmarked(node->next.load());
+            delete node->value.load();
+            delete node;
+            node = next;
+        }
+        for(size_t i=0;i<segmentCount;++i)
+        {
+            delete [] segments[i].load();
+        }
+    }
+
+    /**
+     * delete element by key
+     *
+     * param: key of element to be deleted
+     */
+    void deleteByKey(const KeyT &key)
+    {
+        utility::Epoch::Guard guard;
+        auto hash = hashFunc(key);
+        auto start = bucketFor(hash);
+        auto sortKey = regularKey(hash);
+        Node *prev, *curr;
+        for(;;)
+        {
+            if(!search(start, sortKey, &key, prev, curr)) return;
+            auto succ = curr->next.load();
+            if(isMarked(succ)) continue;
+            //logical deletion
+            if(!curr->next.compare_exchange_strong(succ, succ | 1)) continue;
+            --elementCount;
+            //physical deletion, or let search clean up
+            auto expected = (uintptr_t)curr;
+            if(prev->next.compare_exchange_strong(expected, succ))
+            {
+                utility::Epoch::retire(curr, deleteNode);
+            }
+            else
+            {
+                search(start, sortKey, &key, prev, curr);
+            }
+            return;
+        }
+    }
+
+    /**
+     * returns 1 if key exists in map, otherwise 0
+     *
+     * param: key of element
+     */
+    size_t count(const KeyT &key)
+    {
+        utility::Epoch::Guard guard;
+        auto hash = hashFunc(key);
+        Node *prev, *curr;
+        return search(bucketFor(hash), regularKey(hash), &key, prev, curr) ? 1 : 0;
+    }
+
+    /**
+     * insert an entry by key to map, or replace the value of an existing one
+     *
+     * params: key and value
+     */
+    void insert(const KeyT &key, const ValueT &value)
+    {
+        utility::Epoch::Guard guard;
+        auto hash = hashFunc(key);
+        auto start = bucketFor(hash);
+        auto sortKey = regularKey(hash);
+        auto newValue = new ValueT(value);
+        Node *node = nullptr;
+        Node *prev, *curr;
+        for(;;)
+        {
+            if(search(start, sortKey, &key, prev, curr))
+            {
+                auto old = curr->value.exchange(newValue);
+                utility::Epoch::retire(old);
+                //not deleted meanwhile: the update took effect
+                if(!isMarked(curr->next.load()))
+                {
+                    delete node;
+                    return;
+                }
+                //newValue now belongs to the dead node, insert a fresh copy
+                newValue = new ValueT(value);
+                continue;
+            }
+            if(!node) node = new Node(sortKey, key);
+            node->value = newValue;
+            node->next = (uintptr_t)curr;
+            auto expected = (uintptr_t)curr;
+            if(prev->next.compare_exchange_strong(expected, (uintptr_t)node))
+            {
+                break;
+            }
+        }
+
+        //double the bucket count if the load factor is exceeded
+        auto size = ++elementCount;
+        auto buckets = bucketCount.load();
+        if(size > maxLoadFactor*buckets && buckets < ((size_t)1 << (segmentCount-1)))
+        {
+            bucketCount.compare_exchange_strong(buckets, buckets*2);
+        }
+    }
+
+    /**
+     * lookup(access) an element in map
+     *
+     * param: key of element to be looked up
+     * returns a copy of the element if exists, otherwise throw an exception.
+     */
+    ValueT lookup(const KeyT &key)
+    {
+        utility::Epoch::Guard guard;
+        auto hash = hashFunc(key);
+        Node *prev, *curr;
+        if(search(bucketFor(hash), regularKey(hash), &key, prev, curr))
+        {
+            return *curr->value.load();
+        }
+        //this is why one should check for validity first using .count()
+        throw new std::invalid_argument("invalid key given in LockFreeTSMap");
+    }
+
+    /**
+     * retrieves a copy of an element in map
+     *
+     * param: key of element to be looked up
+     *
+     * returns element if exists, otherwise throw an exception.
+     */
+    ValueT operator[](const KeyT &key)
+    {
+        return lookup(key);
+    }
+
+    /**
+     * non-throwing lookup
+     *
+     * param: key of element to be looked up
+     * returns a copy of the element, or an empty optional if the key is not
+     * in the map.
+     */
+    optional<ValueT> find(const KeyT &key)
+    {
+        utility::Epoch::Guard guard;
+        auto hash = hashFunc(key);
+        Node *prev, *curr;
+        if(search(bucketFor(hash), regularKey(hash), &key, prev, curr))
+        {
+            return optional<ValueT>(*curr->value.load());
+        }
+        return optional<ValueT>();
+    }
+
+    /**
+     * number of entries in map
+     */
+    size_t size() const
+    {
+        return elementCount.load();
+    }
+
+private:
+    static bool isMarked(uintptr_t next)
+    {
+        return next & 1;
+    }
+
+    static Node * unmarked(uintptr_t next)
+    {
+        return (Node*)(next & ~(uintptr_t)1);
+    }
+
+    static void deleteNode(void *object)
+    {
+        auto node = static_cast<Node*>(object);
+        delete node->value.load();
+        delete node;
+    }
+
+    static uint64_t reverseBits(uint64_t x)
+    {
+        x = ((x >> 1) & 0x5555555555555555ULL) | ((x & 0x5555555555555555ULL) << 1);
+        x = ((x >> 2) & 0x3333333333333333ULL) | ((x & 0x3333333333333333ULL) << 2);
+        x = ((x >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((x & 0x0F0F0F0F0F0F0F0FULL) << 4);
+        return __builtin_bswap64(x);
+    }
+
+    /**
+     * sort key of an entry: the top bit set before reversing makes it odd and
+     * places it after the dummy of its bucket
+     */
+    static uint64_t regularKey(size_t hash)
+    {
+        return reverseBits((uint64_t)hash | (1ULL << 63));
+    }
+
+    static uint64_t dummyKey(size_t bucket)
+    {
+        return reverseBits((uint64_t)bucket);
+    }
+
+    static size_t segmentOf(size_t bucket)
+    {
+        return bucket < 2 ? 0 : 63 - __builtin_clzll(bucket);
+    }
+
+    static size_t segmentBase(size_t segment)
+    {
+        return segment == 0 ? 0 : (size_t)1 << segment;
+    }
+
+    static size_t segmentSize(size_t segment)
+    {
+        return segment == 0 ? 2 : (size_t)1 << segment;
+    }
+
+    Node * getBucket(size_t bucket)
+    {
+        auto segment = segmentOf(bucket);
+        auto slots = segments[segment].load();
+        if(!slots) return nullptr;
+        return slots[bucket - segmentBase(segment)].load();
+    }
+
+    void setBucket(size_t bucket, Node *dummy)
+    {
+        auto segment = segmentOf(bucket);
+        auto slots = segments[segment].load();
+        if(!slots)
+        {
+            auto size = segmentSize(segment);
+            auto fresh = new std::atomic<Node*>[size];
+            for(size_t i=0;i<size;++i) fresh[i] = nullptr;
+            if(segments[segment].compare_exchange_strong(slots, fresh))
+            {
+                slots = fresh;
+            }
+            else
+            {
+                delete [] fresh;
+            }
+        }
+        //racing initializers found the same dummy in the list
+        slots[bucket - segmentBase(segment)].store(dummy);
+    }
+
+    /**
+     * dummy node of the bucket of hash, initialized if necessary
+     */
+    Node * bucketFor(size_t hash)
+    {
+        auto bucket = hash & (bucketCount.load()-1);
+        auto dummy = getBucket(bucket);
+        return dummy ? dummy : initializeBucket(bucket);
+    }
+
+    /**
+     * inserts the dummy node of bucket into the list, starting from its parent
+     * bucket (bucket without its highest set bit)
+     */
+    Node * initializeBucket(size_t bucket)
+    {
+        auto parent = bucket & ~((size_t)1 << (63 - __builtin_clzll(bucket)));
+        auto start = getBucket(parent);
+        if(!start) start = initializeBucket(parent);
+
+        auto sortKey = dummyKey(bucket);
+        auto dummy = new Node(sortKey);
+        Node *prev, *curr;
+        for(;;)
+        {
+            if(search(start, sortKey, nullptr, prev, curr))
+            {
+                //someone else inserted it
+                delete dummy;
+                dummy = curr;
+                break;
+            }
+            dummy->next = (uintptr_t)curr;
+            auto expected = (uintptr_t)curr;
+            if(prev->next.compare_exchange_strong(expected, (uintptr_t)dummy))
+            {
+                break;
+            }
+        }
+        setBucket(bucket, dummy);
+        return dummy;
+    }
+
+    /**
+     * searches the list from start (a dummy node, never deleted) for the node
+     * with sortKey and key, or for the dummy with sortKey if key is nullptr.
+     * unlinks and retires marked nodes on the way.
+     *
+     * returns true if found, curr then points to the node. otherwise curr is
+     * the first node ordered after the searched one, or nullptr. prev is the
+     * node before curr in both cases.
+     */
+    bool search(Node *start, uint64_t sortKey, const KeyT *key,
+              Node *&prev, Node *&curr)
+    {
+    retry:
+        prev = start;
+        curr = unmarked(prev->next.load());
+        for(;;)
+        {
+            if(!curr) return false;
+            auto succ = curr->next.load();
+            if(isMarked(succ))
+            {
+                auto expected = (uintptr_t)curr;
+                if(!prev->next.compare_exchange_strong(expected, (uintptr_t)unmarked(succ)))
+                {
+                    goto retry;
+                }
+                utility::Epoch::retire(curr, deleteNode);
+                curr = unmarked(succ);
+                continue;
+            }
+            if(curr->sortKey > sortKey) return false;
+            //entries with colliding hashes share a sort key, compare keys
+            if(curr->sortKey == sortKey && (!key || keyEqual(curr->key, *key)))
+            {
+                return true;
+            }
+            prev = curr;
+            curr = unmarked(succ);
+        }
+    }
+};
+
+}//end namespace TSMap
@@ -0,0 +1,211 @@
+#pragma once
+#include <string>
+#include <fstream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+
+namespace TSMap
+{
+
+namespace utility
+{
+
+/**
+ * numa placement without libnuma: the node layout is read from sysfs, memory
+ * is bound to a node with the mbind system call and threads are pinned to the
+ * cpus of a node with sched_setaffinity. linux only.
+ */
+
+//nodes a NumaTopology and a node mask can describe
+static const int maxNumaNodes = 64;
+
+/**
+ * maps bytes of anonymous memory, bound to node if node >= 0: its pages are
+ * taken from that node when first touched, whichever cpu touches them. a
+ * node the kernel rejects (it does not exist) leaves the default first touch
+ * policy. release with munmap.
+ *
+ * returns nullptr if the mapping fails
+ */
+inline void * mapOnNode(size_t bytes, int node)
+{
+    auto p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(p == MAP_FAILED) return nullptr;
+    if(node >= 0 && node < maxNumaNodes)
+    {
+        //MPOL_BIND of <linux/mempolicy.h>. maxnode counts one past the
+        //highest bit of the mask, as numa_alloc_onnode passes it
+        const int bind = 2;
+        unsigned long mask = 1UL << node;
+        syscall(SYS_mbind, p, bytes, bind, &mask, (unsigned long)maxNumaNodes+1, 0);
+    }
+    return p;
+}
+
+/**
+ * the numa nodes of the machine and the cpus of each node.
+ *
+ * system() reads the layout of the machine, simulated(n) splits its cpus into
+ * n made-up nodes, e.g. to exercise node-aware code on a single node machine.
+ * memory is only bound to the nodes of a real layout.
+ */
+class NumaTopology
+{
+    int nodes;
+    bool real;
+    cpu_set_t cpus[maxNumaNodes];
+
+    NumaTopology(int nodes, bool real) :
+        nodes(nodes),
+        real(real)
+    {
+        for(int i=0;i<maxNumaNodes;++i) CPU_ZERO(&cpus[i]);
+    }
+
+    /**
+     * calls fn(n) for every number of a sysfs list such as "0-3,8,10-11"
+     */
+    template <typename FuncT>
+    static void parseList(const std::string &list, FuncT fn)
+    {
+        auto p = list.c_str();
+        while(*p)
+        {
+            char *end;
+            auto first = std::strtol(p, &end, 10);
+            if(end == p) break;
+            auto last = first;
+            p = end;
+            if(*p == '-')
+            {
+                last = std::strtol(p+1, &end, 10);
+                p = end;
+            }
+            for(auto n=first;n<=last;++n) fn((int)n);
+            while(*p == ',' || *p == '\n') ++p;
+        }
+    }
+
+    static std::string readLine(const std::string &path)
+    {
+        std::ifstream file(path);
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+
+public:
+    /**
+     * the layout of this machine: one node holding every cpu if sysfs does
+     * not have it
+     */
+    static NumaTopology system()
+    {
+        NumaTopology topology(0, true);
+        const std::string root = "/sys/devices/system/node/";
+        parseList(readLine(root + "online"), [&](int node)
+        {
+            if(node >= maxNumaNodes) return;
+            topology.nodes = std::max(topology.nodes, node+1);
+            parseList(readLine(root + "node" + std::to_string(node) + "/cpulist"), [&](int cpu)
+            {
+                if(cpu < CPU_SETSIZE) CPU_SET(cpu, &topology.cpus[node]);
+            });
+        });
+        if(topology.nodes == 0)
+        {
+            topology.nodes = 1;
+            sched_getaffinity(0, sizeof(cpu_set_t), &topology.cpus[0]);
+        }
+        return topology;
+    }
+
+    /**
+     * nodes made-up nodes, each taking an equal share of the cpus this
+     * process may run on, in order. with fewer cpus than nodes the cpus are
+     * shared round robin.
+     */
+    static NumaTopology simulated(int nodes)
+    {
+        nodes = std::max(1, std::min(nodes, maxNumaNodes));
+        NumaTopology topology(nodes, false);
+        cpu_set_t allowed;
+        sched_getaffinity(0, sizeof(cpu_set_t), &allowed);
+        int count = std::max(CPU_COUNT(&allowed), 1);
+        int seen = 0;
+        for(int cpu=0;cpu<CPU_SETSIZE && seen<count;++cpu)
+        {
+            if(!CPU_ISSET(cpu, &allowed)) continue;
+            CPU_SET(cpu, &topology.cpus[seen*nodes/count]);
+            for(int node=count+seen;node<nodes;node+=count)
+            {
+                CPU_SET(cpu, &topology.cpus[node]);
+            }
+            ++seen;
+        }
+        return topology;
+    }
+
+    int nodeCount() const
+    {
+        return nodes;
+    }
+
+    /**
+     * true if the nodes are those of the machine, so memory can be bound
+     * to them
+     */
+    bool bindsMemory() const
+    {
+        return real;
+    }
+
+    const cpu_set_t & cpusOf(int node) const
+    {
+        return cpus[node];
+    }
+
+    /**
+     * the first node holding cpu, 0 if none does
+     */
+    int nodeOfCpu(int cpu) const
+    {
+        if(cpu < 0 || cpu >= CPU_SETSIZE) return 0;
+        for(int node=0;node<nodes;++node)
+        {
+            if(CPU_ISSET(cpu, &cpus[node])) return node;
+        }
+        return 0;
+    }
+
+    /**
+     * the node of the cpu the calling thread runs on. only stable once the
+     * thread is pinned, see pinThread.
+     */
+    int currentNode() const
+    {
+        return nodeOfCpu(sched_getcpu());
+    }
+
+    /**
+     * restricts the calling thread to the cpus of node
+     *
+     * returns false if the node has no cpus or the kernel refuses
+     */
+    bool pinThread(int node) const
+    {
+        if(node < 0 || node >= nodes || CPU_COUNT(&cpus[node]) == 0) return false;
+        return sched_setaffinity(0, sizeof(cpu_set_t), &cpus[node]) == 0;
+    }
+};
+
+}//end utility namespace
+
+}//end tsmap ns
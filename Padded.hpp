@@ -0,0 +1,50 @@
+#pragma once
+#include <cstddef>
+
+
+namespace TSMap
+{
+
+namespace utility
+{
+
+//size of a cache line on x86-64 and most arm64 cores
+static const size_t cacheLineSize = 64;
+
+/**
+ * a bucket that starts on a cache line boundary and is padded to a multiple
+ * of the cache line size, so that no two buckets share a line.
+ *
+ * in a plain bucket array, two threads working on neighbouring buckets write
+ * the same cache line (the bucket lock, the element count) and keep stealing
+ * it from each other although they never touch the same data. wrapping the
+ * bucket type removes that false sharing at the price of memory: a
+ * KVPairList<K, V> with std::mutex grows from 88 to 128 bytes.
+ *
+ * opt-in, no default bucket is padded: whether it pays off depends on the
+ * number of cores writing neighbouring buckets, measure with
+ * ./bench false_sharing on the target machine first.
+ *
+ *     TSMap<K, V, hash<K>, std::equal_to<K>, std::allocator<pair<K, V> >,
+ *           utility::Padded<utility::KVPairList<K, V> > >
+ *
+ * TSMap allocates its bucket arrays with the alignment of the bucket type.
+ */
+template <typename BucketT>
+struct alignas(cacheLineSize) Padded : BucketT
+{
+    Padded()
+    {}
+
+    Padded(size_t capacity) :
+        BucketT(capacity)
+    {}
+
+    explicit Padded(const typename BucketT::allocator_type &allocator) :
+        BucketT(allocator)
+    {}
+};
+
+}//end utility namespace
+
+}//end tsmap ns
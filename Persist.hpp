@@ -0,0 +1,95 @@
+#pragma once
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+namespace TSMap
+{
+
+namespace utility
+{
+
+/**
+ * layout of a file written by TSMap::save:
+ *
+ *  - ImageHeader
+ *  - bucket directory: bucketCount+1 uint64_t, entries of bucket i are
+ *    [directory[i], directory[i+1])
+ *  - at entriesOffset: entryCount packed pair<KeyT, ValueT>, grouped by bucket
+ *
+ * in native byte order, so files are only portable between machines of the
+ * same architecture.
+ */
+struct ImageHeader
+{
+    char magic[8];
+    uint64_t keySize;
+    uint64_t valueSize;
+    uint64_t entrySize;
+    //a power of two, the bucket index is that of a TSMap table of this size
+    uint64_t bucketCount;
+    uint64_t entryCount;
+    //hash of a value initialized key, catches a different hash function
+    uint64_t hashCheck;
+    uint64_t entriesOffset;
+};
+
+static const char imageMagic[8] = {'T', 'S', 'M', 'A', 'P', 'v', '0', '1'};
+
+/**
+ * a whole file mapped into memory, private and writable: pages are read from
+ * the file when first touched, and a write copies the page instead of
+ * changing the file.
+ */
+class MappedFile
+{
+    void *address;
+    size_t length;
+
+public:
+    MappedFile(const std::string &path) :
+        address(MAP_FAILED),
+        length(0)
+    {
+        auto fd = open(path.c_str(), O_RDONLY);
+        if(fd < 0) throw new std::runtime_error("cannot open " + path);
+        struct stat status;
+        if(fstat(fd, &status) == 0 && status.st_size > 0)
+        {
+            length = (size_t)status.st_size;
+            address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        }
+        close(fd);
+        if(address == MAP_FAILED) throw new std::runtime_error("cannot map " + path);
+        //lookups touch the file at random
+        madvise(address, length, MADV_RANDOM);
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile & operator=(const MappedFile &) = delete;
+
+    ~MappedFile()
+    {
+        munmap(address, length);
+    }
+
+    unsigned char * data() const
+    {
+        return static_cast<unsigned char*>(address);
+    }
+
+    size_t size() const
+    {
+        return length;
+    }
+};
+
+}//end utility namespace
+
+}//end tsmap ns
@@ -0,0 +1,330 @@
+#pragma once
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <new>
+#include <cstdint>
+#include <TSMap.hpp>
+#include <Arena.hpp>
+#include <Numa.hpp>
+
+
+namespace TSMap
+{
+
+namespace utility
+{
+
+/**
+ * an allocator for a shard on a numa node: ArenaAllocator gets an arena bound
+ * to the node (node -1: not bound), other allocators are default constructed
+ * and leave placement to first touch
+ */
+template <typename Allocator>
+struct AllocatorOnNode
+{
+    static Allocator make(int)
+    {
+        return Allocator();
+    }
+};
+
+template <typename T>
+struct AllocatorOnNode<ArenaAllocator<T> >
+{
+    static ArenaAllocator<T> make(int node)
+    {
+        return ArenaAllocator<T>(node);
+    }
+};
+
+}//end utility namespace
+
+/**
+ * a TSMap split into shards by key: every shard is a TSMap of its own, with
+ * its own table, element count and growth, so a shard that fills up doubles
+ * its table without touching the others.
+ *
+ * every shard is placed on a numa node of the given topology, round robin
+ * by index. with utility::ArenaAllocator as Allocator, the shard, its bucket
+ * arrays and its entry arrays come from an arena bound to that node (see
+ * utility::Arena), instead of from whichever node the thread that first
+ * touched them ran on. the default std::allocator leaves them to first
+ * touch, like a plain TSMap. a simulated topology, or a single node machine,
+ * places shards on nodes for routing only.
+ *
+ * the routing methods let callers keep work on the node that holds the
+ * data, e.g. one worker pool per node, pinned with
+ * topology.pinThread(node), and each key handed to the pool of
+ * homeNode(key):
+ *
+ *     ShardedTSMap<K, V, hash<K>, std::equal_to<K>,
+ *                  utility::ArenaAllocator<pair<K, V> > > map;
+ *     auto &topology = map.getTopology();
+ *     //in a worker of node n
+ *     topology.pinThread(n);
+ *     map.forEachShardOn(n, [](decltype(map)::shard_type &shard){ ... });
+ *
+ * the shard of a key is taken from the top bits of hash * a constant other
+ * than the one the tables use for their bucket index, so the keys of one
+ * shard still spread over all of its buckets. the key is hashed once for the
+ * shard and once more by the shard.
+ */
+template <typename KeyT, typename ValueT,
+          typename Hash = ::TSMap::hash<KeyT>,
+          typename KeyEqual = std::equal_to<KeyT>,
+          typename Allocator = std::allocator<pair<KeyT, ValueT> >,
+          typename BucketT = typename utility::DefaultBucket<KeyT, ValueT, std::mutex, KeyEqual, Allocator>::type>
+class ShardedTSMap
+{
+public:
+    typedef TSMap<KeyT, ValueT, Hash, KeyEqual, Allocator, BucketT> shard_type;
+
+    /**
+     * params: number of shards (rounded up to a power of two, at least the
+     * number of nodes; 0 picks four per node), initial table size of every
+     * shard, numa layout to place the shards on
+     */
+    ShardedTSMap(size_t shardCount = 0, size_t tableSize = 128,
+                 const utility::NumaTopology &topology = utility::NumaTopology::system()) :
+        topology(topology),
+        shardCount(roundUpShardCount(std::max(shardCount > 0 ? shardCount : 4*(size_t)topology.nodeCount(),
+                                              (size_t)topology.nodeCount()))),
+        shift(64 - log2(this->shardCount)),
+        shards(new Shard[this->shardCount])
+    {
+        size_t constructed = 0;
+        try
+        {
+            for(;constructed<this->shardCount;++constructed)
+            {
+                auto node = (int)(constructed % topology.nodeCount());
+                auto allocator = utility::AllocatorOnNode<Allocator>::make(
+                        topology.bindsMemory() ? node : -1);
+                shard_allocator shardAllocator(allocator);
+                auto map = shardAllocator.allocate(1);
+                try
+                {
+                    new (map) shard_type(tableSize, allocator);
+                }
+                catch(...)
+                {
+                    shardAllocator.deallocate(map, 1);
+                    throw;
+                }
+                shards[constructed].map = map;
+                shards[constructed].node = node;
+            }
+        }
+        catch(...)
+        {
+            while(constructed > 0) destroy(shards[--constructed].map);
+            throw;
+        }
+    }
+
+    ShardedTSMap(const ShardedTSMap &) = delete;
+    ShardedTSMap & operator=(const ShardedTSMap &) = delete;
+
+    ~ShardedTSMap()
+    {
+        for(size_t i=0;i<shardCount;++i) destroy(shards[i].map);
+    }
+
+    /*
+     * the operations of TSMap, on the shard of the key
+     */
+
+    void insert(const KeyT &key, const ValueT &value)
+    {
+        shardFor(key).insert(key, value);
+    }
+
+    void insert(KeyT &&key, ValueT &&value)
+    {
+        auto &shard = shardFor(key);
+        shard.insert(std::move(key), std::move(value));
+    }
+
+    void deleteByKey(const KeyT &key)
+    {
+        shardFor(key).deleteByKey(key);
+    }
+
+    size_t count(const KeyT &key)
+    {
+        return shardFor(key).count(key);
+    }
+
+    ValueT& lookup(const KeyT &key)
+    {
+        return shardFor(key).lookup(key);
+    }
+
+    ValueT& operator[](const KeyT &key)
+    {
+        return lookup(key);
+    }
+
+    optional<ValueT> find(const KeyT &key)
+    {
+        return shardFor(key).find(key);
+    }
+
+    template <typename FuncT>
+    bool update(const KeyT &key, FuncT fn)
+    {
+        return shardFor(key).update(key, fn);
+    }
+
+    template <typename FuncT>
+    bool upsertWith(const KeyT &key, FuncT fn)
+    {
+        return shardFor(key).upsertWith(key, fn);
+    }
+
+    /**
+     * number of entries, summed over the shards without stopping writers
+     */
+    size_t size() const
+    {
+        size_t entries = 0;
+        for(size_t i=0;i<shardCount;++i) entries += shards[i].map->size();
+        return entries;
+    }
+
+    size_t capacity()
+    {
+        size_t slots = 0;
+        for(size_t i=0;i<shardCount;++i) slots += shards[i].map->capacity();
+        return slots;
+    }
+
+    void setMaxLoadFactor(float loadFactor)
+    {
+        for(size_t i=0;i<shardCount;++i) shards[i].map->setMaxLoadFactor(loadFactor);
+    }
+
+    /**
+     * TSMap::stats of all shards added up
+     */
+    utility::MapStats stats()
+    {
+        utility::MapStats stats;
+        for(size_t i=0;i<shardCount;++i) stats.add(shards[i].map->stats());
+        return stats;
+    }
+
+    /**
+     * calls fn(const KeyT&, const ValueT&) for every entry, shard by shard,
+     * as TSMap::forEach does
+     */
+    template <typename FuncT>
+    void forEach(FuncT fn)
+    {
+        for(size_t i=0;i<shardCount;++i) shards[i].map->forEach(fn);
+    }
+
+    /*
+     * routing
+     */
+
+    size_t getShardCount() const
+    {
+        return shardCount;
+    }
+
+    size_t shardOf(const KeyT &key) const
+    {
+        return shardOfHash(hashFunc(key));
+    }
+
+    shard_type & shard(size_t index)
+    {
+        return *shards[index].map;
+    }
+
+    int nodeOfShard(size_t index) const
+    {
+        return shards[index].node;
+    }
+
+    /**
+     * the node holding the entry of key
+     */
+    int homeNode(const KeyT &key) const
+    {
+        return nodeOfShard(shardOf(key));
+    }
+
+    const utility::NumaTopology & getTopology() const
+    {
+        return topology;
+    }
+
+    /**
+     * calls fn(shard_type&) for every shard placed on node
+     */
+    template <typename FuncT>
+    void forEachShardOn(int node, FuncT fn)
+    {
+        for(size_t i=0;i<shardCount;++i)
+        {
+            if(shards[i].node == node) fn(*shards[i].map);
+        }
+    }
+
+private:
+    struct Shard
+    {
+        shard_type *map;
+        int node;
+    };
+
+    typedef typename std::allocator_traits<Allocator>::template rebind_alloc<shard_type> shard_allocator;
+
+    utility::NumaTopology topology;
+    size_t shardCount;
+    unsigned shift;
+    Hash hashFunc;
+    std::unique_ptr<Shard[]> shards;
+
+    static unsigned log2(size_t n)
+    {
+        return 63 - __builtin_clzll(n);
+    }
+
+    static size_t roundUpShardCount(size_t count)
+    {
+        size_t rounded = 1;
+        while(rounded < count) rounded *= 2;
+        return rounded;
+    }
+
+    /**
+     * the top bits of hash * an odd constant, see above. the tables use
+     * 2^64/phi for their buckets.
+     */
+    size_t shardOfHash(size_t hash) const
+    {
+        if(shardCount == 1) return 0;
+        return (size_t)(((uint64_t)hash * 0xc4ceb9fe1a85ec53ULL) >> shift);
+    }
+
+    shard_type & shardFor(const KeyT &key)
+    {
+        return *shards[shardOf(key)].map;
+    }
+
+    /**
+     * destroys a shard and returns its memory to its own allocator
+     */
+    static void destroy(shard_type *map)
+    {
+        shard_allocator shardAllocator(map->getAllocator());
+        map->~shard_type();
+        shardAllocator.deallocate(map, 1);
+    }
+};
+
+}//end tsmap ns
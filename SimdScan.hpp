@@ -0,0 +1,249 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__) && !defined(TSMAP_NO_SIMD)
+#define TSMAP_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+
+namespace TSMap
+{
+
+namespace utility
+{
+
+/**
+ * scan kernels for the buckets: the first of n integral keys equal to a key
+ * (IntegralKVPairList), and the bytes of a group of tags equal to a tag
+ * (TaggedKVPairList), many slots per instruction.
+ *
+ * on x86 SSE2 is part of the base instruction set and is used inline. AVX2
+ * is used for key scans of at least one AVX2 step (dispatchBytes of keys)
+ * if the cpu supports it: checked once at runtime, so the same binary runs on
+ * cpus without it.
+ * elsewhere, or with TSMAP_NO_SIMD defined, plain loops.
+ */
+namespace simd
+{
+
+enum class Level
+{
+    scalar,
+    sse2,
+    avx2
+};
+
+//bytes matched by one matchBytes call
+static const size_t byteGroupSize = 16;
+//bytes of keys from which findKey uses AVX2: two 32 byte compares per step
+static const size_t dispatchBytes = 64;
+
+/*
+ * kernels. keys are passed as bytes and loaded with memcpy, so that any
+ * integral or enum type of the right size can be scanned. each returns the
+ * index of the first match, n if there is none.
+ */
+
+template <typename WordT>
+size_t findScalar(const void *keys, size_t n, WordT key)
+{
+    auto bytes = static_cast<const unsigned char*>(keys);
+    for(size_t i=0;i<n;++i)
+    {
+        WordT word;
+        std::memcpy(&word, bytes + i*sizeof(WordT), sizeof(WordT));
+        if(word == key) return i;
+    }
+    return n;
+}
+
+#ifdef TSMAP_SIMD_X86
+
+inline size_t find64Sse2(const void *keys, size_t n, uint64_t key)
+{
+    auto p = static_cast<const uint64_t*>(keys);
+    auto needle = _mm_set1_epi64x((long long)key);
+    size_t i = 0;
+    for(;i+4<=n;i+=4)
+    {
+        auto a = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p+i)), needle);
+        auto b = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p+i+2)), needle);
+        //no 64 bit compare before SSE4.1: a lane matches if both halves do
+        a = _mm_and_si128(a, _mm_shuffle_epi32(a, _MM_SHUFFLE(2, 3, 0, 1)));
+        b = _mm_and_si128(b, _mm_shuffle_epi32(b, _MM_SHUFFLE(2, 3, 0, 1)));
+        auto mask = (unsigned)_mm_movemask_pd(_mm_castsi128_pd(a)) |
+                    (unsigned)_mm_movemask_pd(_mm_castsi128_pd(b)) << 2;
+        if(mask) return i + __builtin_ctz(mask);
+    }
+    return i + findScalar<uint64_t>(p+i, n-i, key);
+}
+
+inline size_t find32Sse2(const void *keys, size_t n, uint32_t key)
+{
+    auto p = static_cast<const uint32_t*>(keys);
+    auto needle = _mm_set1_epi32((int)key);
+    size_t i = 0;
+    for(;i+8<=n;i+=8)
+    {
+        auto a = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p+i)), needle);
+        auto b = _mm_cmpeq_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p+i+4)), needle);
+        auto mask = (unsigned)_mm_movemask_ps(_mm_castsi128_ps(a)) |
+                    (unsigned)_mm_movemask_ps(_mm_castsi128_ps(b)) << 4;
+        if(mask) return i + __builtin_ctz(mask);
+    }
+    return i + findScalar<uint32_t>(p+i, n-i, key);
+}
+
+__attribute__((target("avx2")))
+inline size_t find64Avx2(const void *keys, size_t n, uint64_t key)
+{
+    auto p = static_cast<const uint64_t*>(keys);
+    auto needle = _mm256_set1_epi64x((long long)key);
+    size_t i = 0;
+    for(;i+8<=n;i+=8)
+    {
+        auto a = _mm256_cmpeq_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p+i)), needle);
+        auto b = _mm256_cmpeq_epi64(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p+i+4)), needle);
+        auto mask = (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(a)) |
+                    (unsigned)_mm256_movemask_pd(_mm256_castsi256_pd(b)) << 4;
+        if(mask) return i + __builtin_ctz(mask);
+    }
+    return i + findScalar<uint64_t>(p+i, n-i, key);
+}
+
+__attribute__((target("avx2")))
+inline size_t find32Avx2(const void *keys, size_t n, uint32_t key)
+{
+    auto p = static_cast<const uint32_t*>(keys);
+    auto needle = _mm256_set1_epi32((int)key);
+    size_t i = 0;
+    for(;i+16<=n;i+=16)
+    {
+        auto a = _mm256_cmpeq_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p+i)), needle);
+        auto b = _mm256_cmpeq_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p+i+8)), needle);
+        auto mask = (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(a)) |
+                    (unsigned)_mm256_movemask_ps(_mm256_castsi256_ps(b)) << 8;
+        if(mask) return i + __builtin_ctz(mask);
+    }
+    return i + findScalar<uint32_t>(p+i, n-i, key);
+}
+
+#endif
+
+/**
+ * the best level the cpu supports, determined once
+ */
+inline Level supportedLevel()
+{
+#ifdef TSMAP_SIMD_X86
+    static const Level level = __builtin_cpu_supports("avx2") ? Level::avx2 : Level::sse2;
+    return level;
+#else
+    return Level::scalar;
+#endif
+}
+
+/**
+ * key scans by key size: 8 and 4 byte keys have kernels, others are
+ * scanned with a plain loop
+ */
+template <size_t size>
+struct KeyScan
+{
+    template <typename KeyT>
+    static size_t find(const KeyT *keys, size_t n, KeyT key, Level)
+    {
+        for(size_t i=0;i<n;++i)
+        {
+            if(keys[i] == key) return i;
+        }
+        return n;
+    }
+};
+
+template <>
+struct KeyScan<8>
+{
+    template <typename KeyT>
+    static size_t find(const KeyT *keys, size_t n, KeyT key, Level level)
+    {
+        uint64_t word;
+        std::memcpy(&word, &key, sizeof(word));
+#ifdef TSMAP_SIMD_X86
+        if(level == Level::avx2) return find64Avx2(keys, n, word);
+        if(level == Level::sse2) return find64Sse2(keys, n, word);
+#endif
+        return findScalar<uint64_t>(keys, n, word);
+    }
+};
+
+template <>
+struct KeyScan<4>
+{
+    template <typename KeyT>
+    static size_t find(const KeyT *keys, size_t n, KeyT key, Level level)
+    {
+        uint32_t word;
+        std::memcpy(&word, &key, sizeof(word));
+#ifdef TSMAP_SIMD_X86
+        if(level == Level::avx2) return find32Avx2(keys, n, word);
+        if(level == Level::sse2) return find32Sse2(keys, n, word);
+#endif
+        return findScalar<uint32_t>(keys, n, word);
+    }
+};
+
+/**
+ * a key scan at the given level, which must be supported. for tests and
+ * benchmarks, the buckets use findKey without a level.
+ */
+template <typename KeyT>
+size_t findKey(const KeyT *keys, size_t n, KeyT key, Level level)
+{
+    return KeyScan<sizeof(KeyT)>::find(keys, n, key, level);
+}
+
+/**
+ * index of the first of the n keys equal to key, n if there is none.
+ * KeyT is integral or an enum, compared bitwise.
+ */
+template <typename KeyT>
+size_t findKey(const KeyT *keys, size_t n, KeyT key)
+{
+    static_assert(std::is_integral<KeyT>::value || std::is_enum<KeyT>::value,
+                  "findKey compares keys bitwise");
+#ifdef TSMAP_SIMD_X86
+    if(n*sizeof(KeyT) >= dispatchBytes) return findKey(keys, n, key, supportedLevel());
+    return findKey(keys, n, key, Level::sse2);
+#else
+    return findKey(keys, n, key, Level::scalar);
+#endif
+}
+
+/**
+ * bit i set if bytes[i] == value, for the byteGroupSize bytes at bytes
+ */
+inline uint32_t matchBytes(const uint8_t *bytes, uint8_t value)
+{
+#ifdef TSMAP_SIMD_X86
+    auto group = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes));
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)value)));
+#else
+    uint32_t mask = 0;
+    for(size_t i=0;i<byteGroupSize;++i)
+    {
+        mask |= (uint32_t)(bytes[i] == value) << i;
+    }
+    return mask;
+#endif
+}
+
+}//end simd namespace
+
+}//end utility namespace
+
+}//end tsmap ns
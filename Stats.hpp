@@ -0,0 +1,313 @@
+#pragma once
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+
+/**
+ * instrumentation of the buckets, off by default.
+ *
+ * compiled with TSMAP_ENABLE_STATS defined (-DTSMAP_ENABLE_STATS, the same
+ * for every translation unit), every bucket counts its lock acquisitions,
+ * the acquisitions that had to wait and for how long, its key searches and
+ * the slots they probed, and the reallocations of its arrays. without it the
+ * counters do not exist and the buckets are unchanged.
+ *
+ * TSMap::stats() sums them up, together with a histogram of bucket sizes,
+ * which is available either way.
+ */
+#ifdef TSMAP_ENABLE_STATS
+#define TSMAP_STATS(...) __VA_ARGS__
+#else
+#define TSMAP_STATS(...)
+#endif
+
+
+namespace TSMap
+{
+
+namespace utility
+{
+
+/**
+ * lock counters of a CountingMutex. relaxed atomics: readers holding a
+ * shared lock count concurrently.
+ */
+struct LockCounters
+{
+    std::atomic<uint64_t> acquisitions{0};
+    //acquisitions that found the lock taken
+    std::atomic<uint64_t> contended{0};
+    //time spent waiting by those
+    std::atomic<uint64_t> waitNanos{0};
+};
+
+/**
+ * wraps a mutex and counts its acquisitions. an acquisition first tries the
+ * lock, and only takes the time if it has to wait, so an uncontended lock
+ * costs one relaxed increment extra.
+ *
+ * lock_shared and friends are only usable if MutexT has them.
+ */
+template <typename MutexT>
+class CountingMutex
+{
+    MutexT mutex;
+    LockCounters lockCounters;
+
+    typedef std::chrono::steady_clock clock;
+
+    void counted(bool waited, clock::time_point start)
+    {
+        lockCounters.acquisitions.fetch_add(1, std::memory_order_relaxed);
+        if(!waited) return;
+        auto nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now()-start);
+        lockCounters.contended.fetch_add(1, std::memory_order_relaxed);
+        lockCounters.waitNanos.fetch_add((uint64_t)nanos.count(), std::memory_order_relaxed);
+    }
+
+public:
+    void lock()
+    {
+        if(mutex.try_lock()) return counted(false, clock::time_point());
+        auto start = clock::now();
+        mutex.lock();
+        counted(true, start);
+    }
+
+    bool try_lock()
+    {
+        if(!mutex.try_lock()) return false;
+        counted(false, clock::time_point());
+        return true;
+    }
+
+    void unlock()
+    {
+        mutex.unlock();
+    }
+
+    void lock_shared()
+    {
+        if(mutex.try_lock_shared()) return counted(false, clock::time_point());
+        auto start = clock::now();
+        mutex.lock_shared();
+        counted(true, start);
+    }
+
+    bool try_lock_shared()
+    {
+        if(!mutex.try_lock_shared()) return false;
+        counted(false, clock::time_point());
+        return true;
+    }
+
+    void unlock_shared()
+    {
+        mutex.unlock_shared();
+    }
+
+    const LockCounters & counters() const
+    {
+        return lockCounters;
+    }
+};
+
+/**
+ * the lock type of a bucket declared with MutexT: MutexT itself, or a
+ * CountingMutex<MutexT> with TSMAP_ENABLE_STATS
+ */
+template <typename MutexT>
+struct BucketMutex
+{
+#ifdef TSMAP_ENABLE_STATS
+    typedef CountingMutex<MutexT> type;
+#else
+    typedef MutexT type;
+#endif
+};
+
+/**
+ * search and resize counters of a bucket, relaxed atomics like LockCounters
+ */
+struct BucketCounters
+{
+    //key searches: finds, and the search before an upsert or erase
+    std::atomic<uint64_t> lookups{0};
+    //entries or slots inspected by those
+    std::atomic<uint64_t> probes{0};
+    //reallocations of the arrays: growth, shrinking, rehashing
+    std::atomic<uint64_t> resizes{0};
+};
+
+/**
+ * occupancy and counters of one bucket, or their sum over many. the
+ * counters stay 0 without TSMAP_ENABLE_STATS.
+ */
+struct BucketStats
+{
+    size_t size;
+    size_t capacity;
+    //erased slots not reclaimed yet
+    size_t tombstones;
+    uint64_t lockAcquisitions;
+    uint64_t contendedAcquisitions;
+    uint64_t lockWaitNanos;
+    uint64_t lookups;
+    uint64_t probes;
+    uint64_t resizes;
+
+    BucketStats() :
+        size(0),
+        capacity(0),
+        tombstones(0),
+        lockAcquisitions(0),
+        contendedAcquisitions(0),
+        lockWaitNanos(0),
+        lookups(0),
+        probes(0),
+        resizes(0)
+    {}
+
+    /**
+     * reads the counters of a bucket
+     */
+    template <typename MutexT>
+    void setCounters(const MutexT &, const BucketCounters *)
+    {}
+
+    template <typename MutexT>
+    void setCounters(const CountingMutex<MutexT> &mutex, const BucketCounters *counters)
+    {
+        lockAcquisitions = mutex.counters().acquisitions.load(std::memory_order_relaxed);
+        contendedAcquisitions = mutex.counters().contended.load(std::memory_order_relaxed);
+        lockWaitNanos = mutex.counters().waitNanos.load(std::memory_order_relaxed);
+        lookups = counters->lookups.load(std::memory_order_relaxed);
+        probes = counters->probes.load(std::memory_order_relaxed);
+        resizes = counters->resizes.load(std::memory_order_relaxed);
+    }
+
+    void addCounters(const BucketStats &rhs)
+    {
+        lockAcquisitions += rhs.lockAcquisitions;
+        contendedAcquisitions += rhs.contendedAcquisitions;
+        lockWaitNanos += rhs.lockWaitNanos;
+        lookups += rhs.lookups;
+        probes += rhs.probes;
+        resizes += rhs.resizes;
+    }
+
+    void add(const BucketStats &rhs)
+    {
+        size += rhs.size;
+        capacity += rhs.capacity;
+        tombstones += rhs.tombstones;
+        addCounters(rhs);
+    }
+};
+
+/**
+ * result of TSMap::stats(): the distribution of entries over the buckets of
+ * the current table, and the counters of all buckets the map ever had.
+ *
+ * a table of n buckets holding m entries at uniform hashing has about
+ * m/n entries per bucket with a Poisson spread; a histogram with a long tail
+ * or a high maxBucketSize points at the hash function, a high mean instead
+ * at a table that is too small for the load.
+ */
+struct MapStats
+{
+    //bins of loadHistogram
+    static const size_t histogramSize = 64;
+
+    size_t buckets;
+    size_t maxBucketSize;
+    //loadHistogram[i]: buckets holding i entries. the last bin counts the
+    //buckets holding histogramSize-1 entries or more
+    size_t loadHistogram[histogramSize];
+    //times the table doubled, 0 without TSMAP_ENABLE_STATS
+    size_t growths;
+    //entries, capacity and tombstones of the current table, counters of
+    //all tables
+    BucketStats totals;
+
+    MapStats() :
+        buckets(0),
+        maxBucketSize(0),
+        growths(0)
+    {
+        for(size_t i=0;i<histogramSize;++i) loadHistogram[i] = 0;
+    }
+
+    /**
+     * adds a bucket of the current table
+     */
+    void addBucket(const BucketStats &bucket)
+    {
+        ++buckets;
+        maxBucketSize = std::max(maxBucketSize, bucket.size);
+        ++loadHistogram[std::min(bucket.size, histogramSize-1)];
+        totals.add(bucket);
+    }
+
+    /**
+     * adds the buckets and counters of another map, e.g. a shard
+     */
+    void add(const MapStats &rhs)
+    {
+        buckets += rhs.buckets;
+        maxBucketSize = std::max(maxBucketSize, rhs.maxBucketSize);
+        for(size_t i=0;i<histogramSize;++i) loadHistogram[i] += rhs.loadHistogram[i];
+        growths += rhs.growths;
+        totals.add(rhs.totals);
+    }
+
+    double meanLoad() const
+    {
+        return buckets ? (double)totals.size/buckets : 0;
+    }
+
+    double probesPerLookup() const
+    {
+        return totals.lookups ? (double)totals.probes/totals.lookups : 0;
+    }
+
+    double contentionRate() const
+    {
+        return totals.lockAcquisitions ?
+            (double)totals.contendedAcquisitions/totals.lockAcquisitions : 0;
+    }
+
+    /**
+     * prints the totals and the non-empty bins of the histogram
+     */
+    friend std::ostream& operator<<(std::ostream &stream, const MapStats &rhs)
+    {
+        stream<<"buckets: "<<rhs.buckets<<", entries: "<<rhs.totals.size
+              <<", mean load: "<<rhs.meanLoad()<<", max load: "<<rhs.maxBucketSize
+              <<", capacity: "<<rhs.totals.capacity<<", tombstones: "<<rhs.totals.tombstones
+              <<std::endl;
+        stream<<"lock acquisitions: "<<rhs.totals.lockAcquisitions
+              <<", contended: "<<rhs.totals.contendedAcquisitions
+              <<", wait: "<<rhs.totals.lockWaitNanos/1000<<"us"
+              <<", lookups: "<<rhs.totals.lookups
+              <<", probes per lookup: "<<rhs.probesPerLookup()
+              <<", bucket resizes: "<<rhs.totals.resizes
+              <<", table growths: "<<rhs.growths<<std::endl;
+        for(size_t i=0;i<histogramSize;++i)
+        {
+            if(!rhs.loadHistogram[i]) continue;
+            stream<<std::setw(4)<<i<<(i == histogramSize-1 ? "+" : " ")
+                  <<std::setw(12)<<rhs.loadHistogram[i]<<std::endl;
+        }
+        return stream;
+    }
+};
+
+}//end utility namespace
+
+}//end tsmap ns
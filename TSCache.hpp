@@ -0,0 +1,431 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <new>
+#include <cstdint>
+#include <KVPairList.hpp>
+#include <TaggedKVPairList.hpp>
+#include <Padded.hpp>
+#include <Hash.hpp>
+
+
+namespace TSMap
+{
+
+/**
+ * counters of a TSCache, see TSCache::stats()
+ */
+struct CacheStats
+{
+    //finds and loads that found the key
+    uint64_t hits;
+    //finds and loads that did not, including expired keys
+    uint64_t misses;
+    //new keys stored
+    uint64_t insertions;
+    //entries dropped to make room
+    uint64_t evictions;
+    //entries dropped because their time to live ran out
+    uint64_t expirations;
+
+    CacheStats() :
+        hits(0),
+        misses(0),
+        insertions(0),
+        evictions(0),
+        expirations(0)
+    {}
+
+    double hitRatio() const
+    {
+        return hits+misses ? (double)hits/(hits+misses) : 0;
+    }
+
+    void add(const CacheStats &rhs)
+    {
+        hits += rhs.hits;
+        misses += rhs.misses;
+        insertions += rhs.insertions;
+        evictions += rhs.evictions;
+        expirations += rhs.expirations;
+    }
+};
+
+/**
+ * a thread-safe cache of bounded capacity, for use in front of a slow store:
+ *
+ *     TSCache<K, V> cache(100000, std::chrono::seconds(30));
+ *     auto value = cache.findOrLoad(key, [&](const K &key){ return store.get(key); });
+ *
+ * the keys are spread over a fixed number of shards by hash, each with its
+ * own lock and a fixed share of the capacity, so no operation takes a
+ * global lock. a shard keeps its entries in an array of slots and finds
+ * them through a utility::TaggedKVPairList from key to slot, whose lock is
+ * the shard lock.
+ *
+ * eviction is CLOCK, an approximation of LRU: a hit sets the reference bit
+ * of the entry. to make room, the hand of the shard sweeps the slots,
+ * clearing reference bits, and evicts the first entry without one. an entry
+ * that is hit again before the hand comes round survives, so a hot key is
+ * never evicted by a scan of cold ones. new entries start without the bit.
+ *
+ * entries may get a time to live, by default the one given to the
+ * constructor. an expired entry is dropped when it is found, or when the
+ * hand passes it; until then it takes up a slot.
+ *
+ * keys and values are copied into preallocated slots, so both must be
+ * default constructible and copy assignable.
+ */
+template <typename KeyT, typename ValueT,
+          typename Hash = ::TSMap::hash<KeyT>,
+          typename KeyEqual = std::equal_to<KeyT> >
+class TSCache
+{
+public:
+    typedef std::chrono::steady_clock clock;
+
+    /**
+     * params: number of entries the cache holds at most (rounded up to a
+     * multiple of the shard count), default time to live (zero: entries do
+     * not expire), number of shards (rounded up to a power of two, 0 picks
+     * one from the capacity)
+     */
+    TSCache(size_t capacity, clock::duration ttl = clock::duration::zero(),
+            size_t shardCount = 0) :
+        shardCount(roundUpShardCount(shardCount > 0 ? shardCount : defaultShardCount(capacity))),
+        shift(64 - log2(this->shardCount)),
+        shardCapacity(std::max((capacity + this->shardCount - 1)/this->shardCount, (size_t)1)),
+        defaultTTL(ttl),
+        storage(new unsigned char[this->shardCount*sizeof(Shard) + alignof(Shard)])
+    {
+        auto address = reinterpret_cast<uintptr_t>(storage.get());
+        address = (address + alignof(Shard) - 1) & ~(uintptr_t)(alignof(Shard) - 1);
+        shards = reinterpret_cast<Shard*>(address);
+        size_t constructed = 0;
+        try
+        {
+            for(;constructed<this->shardCount;++constructed)
+            {
+                new (&shards[constructed]) Shard(shardCapacity);
+            }
+        }
+        catch(...)
+        {
+            while(constructed > 0) shards[--constructed].~Shard();
+            throw;
+        }
+    }
+
+    TSCache(const TSCache &) = delete;
+    TSCache & operator=(const TSCache &) = delete;
+
+    ~TSCache()
+    {
+        for(size_t i=0;i<shardCount;++i) shards[i].~Shard();
+    }
+
+    /**
+     * returns a copy of the value of key and marks the entry as recently
+     * used, or an empty optional if the key is absent or expired
+     */
+    optional<ValueT> find(const KeyT &key)
+    {
+        auto hash = hashFunc(key);
+        auto &shard = shardOf(hash);
+        std::lock_guard<shard_mutex> lock(shard.index.getMutex());
+        auto slot = findUnlocked(shard, key, hash);
+        if(slot == npos)
+        {
+            ++shard.stats.misses;
+            return optional<ValueT>();
+        }
+        ++shard.stats.hits;
+        shard.states[slot] = referencedSlot;
+        return optional<ValueT>(shard.entries[slot].second);
+    }
+
+    /**
+     * inserts or overwrites key with the default time to live. a new key
+     * evicts an entry if its shard is full.
+     */
+    void insert(const KeyT &key, const ValueT &value)
+    {
+        insert(key, value, defaultTTL);
+    }
+
+    /**
+     * insert with the given time to live, zero for none
+     */
+    void insert(const KeyT &key, const ValueT &value, clock::duration ttl)
+    {
+        auto hash = hashFunc(key);
+        auto &shard = shardOf(hash);
+        clock::rep expiry = 0;
+        if(ttl > clock::duration::zero()) expiry = (clock::now() + ttl).time_since_epoch().count();
+
+        std::lock_guard<shard_mutex> lock(shard.index.getMutex());
+        auto slot = findUnlocked(shard, key, hash);
+        if(slot != npos)
+        {
+            shard.entries[slot].second = value;
+            shard.expiries[slot] = expiry;
+            shard.states[slot] = referencedSlot;
+            return;
+        }
+        slot = freeSlotUnlocked(shard);
+        shard.entries[slot].first = key;
+        shard.entries[slot].second = value;
+        shard.expiries[slot] = expiry;
+        shard.states[slot] = coldSlot;
+        if(expiry) shard.expiring = true;
+        shard.index.insertUnlocked(pair<KeyT, uint32_t>(key, (uint32_t)slot), hash);
+        ++shard.size;
+        ++shard.stats.insertions;
+    }
+
+    /**
+     * returns the value of key, calling load(key) and inserting its result
+     * on a miss. load runs without any lock held, so concurrent misses on
+     * the same key may each call it; the last insert wins.
+     */
+    template <typename LoadT>
+    ValueT findOrLoad(const KeyT &key, LoadT load)
+    {
+        auto cached = find(key);
+        if(cached) return *cached;
+        ValueT value = load(key);
+        insert(key, value);
+        return value;
+    }
+
+    /**
+     * removes key, returns true if it was cached (expired or not)
+     */
+    bool deleteByKey(const KeyT &key)
+    {
+        auto hash = hashFunc(key);
+        auto &shard = shardOf(hash);
+        std::lock_guard<shard_mutex> lock(shard.index.getMutex());
+        auto slot = shard.index.findUnlocked(key, hash);
+        if(!slot) return false;
+        removeUnlocked(shard, *slot, hash);
+        return true;
+    }
+
+    /**
+     * number of cached entries, expired ones that were not dropped yet
+     * included. a sum over the shards, not a snapshot.
+     */
+    size_t size()
+    {
+        size_t total = 0;
+        for(size_t i=0;i<shardCount;++i)
+        {
+            std::lock_guard<shard_mutex> lock(shards[i].index.getMutex());
+            total += shards[i].size;
+        }
+        return total;
+    }
+
+    /**
+     * maximal number of entries
+     */
+    size_t capacity() const
+    {
+        return shardCount*shardCapacity;
+    }
+
+    /**
+     * drops all entries, keeps the counters
+     */
+    void clear()
+    {
+        for(size_t i=0;i<shardCount;++i)
+        {
+            auto &shard = shards[i];
+            std::lock_guard<shard_mutex> lock(shard.index.getMutex());
+            for(size_t slot=0;slot<shard.used;++slot)
+            {
+                if(shard.states[slot] == freeSlot) continue;
+                removeUnlocked(shard, slot, hashFunc(shard.entries[slot].first));
+            }
+        }
+    }
+
+    /**
+     * the counters summed over the shards
+     */
+    CacheStats stats()
+    {
+        CacheStats total;
+        for(size_t i=0;i<shardCount;++i)
+        {
+            std::lock_guard<shard_mutex> lock(shards[i].index.getMutex());
+            total.add(shards[i].stats);
+        }
+        return total;
+    }
+
+private:
+    typedef utility::TaggedKVPairList<KeyT, uint32_t, std::mutex, Hash, KeyEqual> index_type;
+    typedef typename index_type::mutex_type shard_mutex;
+
+    //slot states
+    static const uint8_t freeSlot = 0;
+    static const uint8_t coldSlot = 1;
+    static const uint8_t referencedSlot = 2;
+    static const size_t npos = (size_t)-1;
+
+    /*
+     * a shard: capacity slots, the first used of which have been filled at
+     * some point, and the index from key to slot. padded to cache lines, so
+     * that the locks of neighbouring shards do not share one.
+     */
+    struct alignas(utility::cacheLineSize) Shard
+    {
+        //key to slot, its lock guards the shard
+        index_type index;
+        std::unique_ptr<pair<KeyT, ValueT>[]> entries;
+        //expiry per slot, steady clock ticks, 0 = none
+        std::unique_ptr<clock::rep[]> expiries;
+        std::unique_ptr<uint8_t[]> states;
+        size_t capacity;
+        //slots below used have been filled before
+        size_t used;
+        size_t size;
+        //next slot the clock looks at
+        size_t hand;
+        //any entry was inserted with a time to live
+        bool expiring;
+        CacheStats stats;
+
+        Shard(size_t capacity) :
+            entries(new pair<KeyT, ValueT>[capacity]),
+            expiries(new clock::rep[capacity]()),
+            states(new uint8_t[capacity]()),
+            capacity(capacity),
+            used(0),
+            size(0),
+            hand(0),
+            expiring(false)
+        {
+            //room for all slots below the load at which the index rehashes
+            index.reserveUnlocked(capacity + capacity/7 + 2);
+        }
+    };
+
+    size_t shardCount;
+    unsigned shift;
+    size_t shardCapacity;
+    clock::duration defaultTTL;
+    Hash hashFunc;
+    std::unique_ptr<unsigned char[]> storage;
+    //array of shardCount shards in storage, aligned as Shard requires
+    Shard *shards;
+
+    static unsigned log2(size_t n)
+    {
+        return 63 - __builtin_clzll(n);
+    }
+
+    static size_t roundUpShardCount(size_t count)
+    {
+        size_t rounded = 1;
+        while(rounded < count) rounded *= 2;
+        return rounded;
+    }
+
+    /**
+     * a shard per 256 entries, up to 64: small shards make the clock a
+     * poorer approximation of LRU, a few dozen locks are enough to keep
+     * contention low
+     */
+    static size_t defaultShardCount(size_t capacity)
+    {
+        return std::min(std::max(capacity/256, (size_t)1), (size_t)64);
+    }
+
+    /**
+     * fibonacci hashing on the top bits, like TSMap's tables. the index of a
+     * shard remixes the hash, so it does not matter that these bits are
+     * the same for all keys of a shard.
+     */
+    Shard & shardOf(size_t hash)
+    {
+        if(shardCount == 1) return shards[0];
+        return shards[((uint64_t)hash * 0x9e3779b97f4a7c15ULL) >> shift];
+    }
+
+    static bool expired(Shard &shard, size_t slot, clock::rep now)
+    {
+        return shard.expiries[slot] != 0 && shard.expiries[slot] <= now;
+    }
+
+    /**
+     * slot of key, npos if it is absent. drops the entry if it expired.
+     * caller holds the shard lock.
+     */
+    size_t findUnlocked(Shard &shard, const KeyT &key, size_t hash)
+    {
+        auto slot = shard.index.findUnlocked(key, hash);
+        if(!slot) return npos;
+        if(shard.expiries[*slot] != 0 &&
+           expired(shard, *slot, clock::now().time_since_epoch().count()))
+        {
+            removeUnlocked(shard, *slot, hash);
+            ++shard.stats.expirations;
+            return npos;
+        }
+        return *slot;
+    }
+
+    void removeUnlocked(Shard &shard, size_t slot, size_t hash)
+    {
+        shard.index.eraseUnlocked(shard.entries[slot].first, hash);
+        shard.entries[slot] = pair<KeyT, ValueT>();
+        shard.expiries[slot] = 0;
+        shard.states[slot] = freeSlot;
+        --shard.size;
+    }
+
+    /**
+     * a free slot for a new entry: a slot never filled, or the one the
+     * clock hand stops at. the hand takes free slots and drops expired
+     * entries on its way; if the shard is full it clears reference bits
+     * until it finds an entry without one and evicts it. takes at most two
+     * rounds. caller holds the shard lock.
+     */
+    size_t freeSlotUnlocked(Shard &shard)
+    {
+        if(shard.used < shard.capacity) return shard.used++;
+        clock::rep now = shard.expiring ? clock::now().time_since_epoch().count() : 0;
+        while(true)
+        {
+            auto slot = shard.hand;
+            shard.hand = slot+1 == shard.capacity ? 0 : slot+1;
+            auto state = shard.states[slot];
+            if(state == freeSlot) return slot;
+            if(shard.expiring && expired(shard, slot, now))
+            {
+                removeUnlocked(shard, slot, hashFunc(shard.entries[slot].first));
+                ++shard.stats.expirations;
+                return slot;
+            }
+            //there is a free slot further on
+            if(shard.size < shard.capacity) continue;
+            if(state == referencedSlot)
+            {
+                shard.states[slot] = coldSlot;
+                continue;
+            }
+            removeUnlocked(shard, slot, hashFunc(shard.entries[slot].first));
+            ++shard.stats.evictions;
+            return slot;
+        }
+    }
+};
+
+}//end tsmap ns
@@ -1,17 +1,34 @@
 #include <iostream>
 #include <string>
 #include <thread>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <cstddef>
+#include <unistd.h>
 #include <TSMap.hpp>
+#include <LockFreeTSMap.hpp>
+#include <TSCache.hpp>
+#include <ShardedTSMap.hpp>
 
 #if 1
 
 #define BOOST_TEST_MAIN
 #include <boost/test/included/unit_test.hpp>
+#include <boost/mpl/list.hpp>
 
 #define BOOST_TEST_MODULE threadsafe_map_test
 
 BOOST_AUTO_TEST_SUITE(threadsafe_map_test)
 
+//the multithreaded map tests run against both map implementations
+typedef boost::mpl::list<TSMap::TSMap<int, int>,
+                         TSMap::LockFreeTSMap<int, int> > map_types;
+
 BOOST_AUTO_TEST_CASE(test_single_thread_kvlist_no_resize)
 {
     using namespace TSMap;
@@ -138,6 +155,225 @@ BOOST_AUTO_TEST_CASE(test_multiple_threads_kvlist_erase_with_resize_validity)
     BOOST_TEST(pl["four"] == 4);
 }
 
+BOOST_AUTO_TEST_CASE(test_single_thread_tagged_kvlist_with_rehash)
+{
+    using namespace TSMap;
+    using string = std::string;
+    utility::TaggedKVPairList<string, int> pl(2);
+    for(auto i=0;i<1000;++i)
+    {
+        pl.upsert(::TSMap::make_pair(std::to_string(i), i));
+    }
+    BOOST_TEST(pl.size() == 1000);
+
+    //update in place, no new entries
+    pl.upsert(::TSMap::make_pair(string("500"), -1));
+    BOOST_TEST(pl.size() == 1000);
+    BOOST_TEST(pl["500"] == -1);
+    BOOST_TEST(pl["999"] == 999);
+    BOOST_TEST(pl.count("1000") == 0);
+}
+
+BOOST_AUTO_TEST_CASE(test_multiple_threads_tagged_kvlist_erase)
+{
+    using namespace TSMap;
+    utility::TaggedKVPairList<int, int> pl;
+
+    std::thread tr[4];
+    for(int j=0;j<4;++j)
+    {
+        tr[j] = std::thread([&](const int val)
+        {
+            for(auto i=0;i<256;++i)
+            {
+                pl.upsert(::TSMap::make_pair(val*256+i, i));
+            }
+            //erase every other key, leaving tombstones in the probe chains
+            for(auto i=0;i<256;i+=2)
+            {
+                pl.erase(val*256+i);
+            }
+        }, j);
+    }
+    for(int j=0;j<4;++j)
+    {
+        tr[j].join();
+    }
+
+    BOOST_TEST(pl.size() == 4*128);
+    for(auto i=0;i<4*256;++i)
+    {
+        BOOST_TEST(pl.count(i) == (size_t)(i%2));
+    }
+
+    //reinsert over the tombstones
+    for(auto i=0;i<4*256;i+=2)
+    {
+        pl.upsert(::TSMap::make_pair(i, -i));
+    }
+    BOOST_TEST(pl.size() == 4*256);
+    BOOST_TEST(pl[512] == -512);
+}
+
+BOOST_AUTO_TEST_CASE(test_kvlist_shrinks_and_compacts_on_erase)
+{
+    using namespace TSMap;
+    utility::KVPairList<int, int> pl(8);
+    for(auto i=0;i<1000;++i)
+    {
+        pl.upsert(::TSMap::make_pair(i, i));
+    }
+    auto grown = pl.capacityUnlocked();
+    BOOST_TEST(grown >= 1000u);
+
+    //erase from the front: no trailing tombstones, so erase has to shrink
+    for(auto i=0;i<990;++i)
+    {
+        pl.erase(i);
+    }
+    BOOST_TEST(pl.size() == 10);
+    BOOST_TEST(pl.capacityUnlocked() < 100u);
+    for(auto i=990;i<1000;++i)
+    {
+        BOOST_TEST(pl[i] == i);
+    }
+
+    pl.shrinkToFitUnlocked();
+    BOOST_TEST(pl.capacityUnlocked() == 10u);
+    for(auto i=0;i<10;++i)
+    {
+        pl.erase(990+i);
+    }
+    pl.shrinkToFitUnlocked();
+    BOOST_TEST(pl.capacityUnlocked() == 0u);
+    pl.upsert(::TSMap::make_pair(1, 1));
+    BOOST_TEST(pl[1] == 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_tagged_kvlist_shrinks_on_erase)
+{
+    using namespace TSMap;
+    utility::TaggedKVPairList<int, int> pl;
+    for(auto i=0;i<1000;++i)
+    {
+        pl.upsert(::TSMap::make_pair(i, i));
+    }
+    BOOST_TEST(pl.capacityUnlocked() >= 1024u);
+
+    for(auto i=0;i<990;++i)
+    {
+        pl.erase(i);
+    }
+    BOOST_TEST(pl.size() == 10);
+    BOOST_TEST(pl.capacityUnlocked() <= 128u);
+
+    pl.shrinkToFitUnlocked();
+    BOOST_TEST(pl.capacityUnlocked() == 16u);
+    for(auto i=990;i<1000;++i)
+    {
+        BOOST_TEST(pl[i] == i);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(test_integral_kvlist)
+{
+    using namespace TSMap;
+    static_assert(std::is_same<::TSMap::TSMap<uint64_t, uint64_t>::bucket_type,
+                               utility::IntegralKVPairList<uint64_t, uint64_t> >::value,
+                  "integral keys use the structure-of-arrays bucket");
+    static_assert(std::is_same<::TSMap::TSMap<std::string, int>::bucket_type,
+                               utility::KVPairList<std::string, int> >::value,
+                  "other keys use KVPairList");
+
+    utility::IntegralKVPairList<uint32_t, int> pl;
+    for(auto i=0;i<1000;++i)
+    {
+        pl.upsert(::TSMap::make_pair((uint32_t)i, i));
+    }
+    pl.upsert(::TSMap::make_pair((uint32_t)7, -7));
+    BOOST_TEST(pl.size() == 1000);
+    //erase moves the last entry into the hole
+    for(auto i=0;i<1000;i+=2)
+    {
+        pl.erase(i);
+    }
+    BOOST_TEST(pl.size() == 500);
+    for(auto i=0;i<1000;++i)
+    {
+        BOOST_REQUIRE(pl.count(i) == (size_t)(i%2));
+    }
+    BOOST_TEST(pl[7] == -7);
+    BOOST_TEST(pl[999] == 999);
+
+    for(auto i=1;i<990;i+=2)
+    {
+        pl.erase(i);
+    }
+    BOOST_TEST(pl.size() == 5);
+    BOOST_TEST(pl.capacityUnlocked() <= 20u);
+    pl.shrinkToFitUnlocked();
+    BOOST_TEST(pl.capacityUnlocked() == 5u);
+    for(auto i=991;i<1000;i+=2)
+    {
+        BOOST_TEST(pl[i] == i);
+    }
+
+    //forEachUnlocked refers to the stored values, also move-only ones
+    utility::IntegralKVPairList<int, std::unique_ptr<int> > owners;
+    for(auto i=0;i<20;++i)
+    {
+        owners.upsert(::TSMap::make_pair(i, std::unique_ptr<int>(new int(i))));
+    }
+    int sum = 0;
+    owners.forEachUnlocked([&](::TSMap::pair<const int&, std::unique_ptr<int>&> &kv)
+    {
+        sum += *kv.second;
+    });
+    BOOST_TEST(sum == 190);
+    BOOST_TEST(*owners[19] == 19);
+}
+
+BOOST_AUTO_TEST_CASE(test_simd_scan_kernels)
+{
+    using namespace TSMap::utility::simd;
+    std::vector<Level> levels = {Level::scalar};
+    if(supportedLevel() != Level::scalar) levels.push_back(Level::sse2);
+    if(supportedLevel() == Level::avx2) levels.push_back(Level::avx2);
+
+    //every length and position, at an unaligned start, against a plain loop
+    std::vector<int64_t> keys64(80);
+    std::vector<uint32_t> keys32(80);
+    for(size_t i=0;i<keys64.size();++i)
+    {
+        keys64[i] = -(int64_t)i * 0x100000001LL;
+        keys32[i] = (uint32_t)(i * 0x01010101u);
+    }
+    for(auto level : levels)
+    {
+        for(size_t n=0;n<keys64.size()-1;++n)
+        {
+            for(size_t i=0;i<=n;++i)
+            {
+                BOOST_REQUIRE(findKey(&keys64[1], n, keys64[1+i], level) == i);
+                BOOST_REQUIRE(findKey(&keys32[1], n, keys32[1+i], level) == i);
+            }
+            //only the low or the high half of a 64 bit key matches
+            BOOST_REQUIRE(findKey(&keys64[1], n, (int64_t)0x100000000LL, level) == n);
+            BOOST_REQUIRE(findKey(&keys64[1], n, (int64_t)-1, level) == n);
+        }
+    }
+    std::vector<int64_t> duplicates(40, 5);
+    BOOST_TEST(findKey(duplicates.data(), duplicates.size(), (int64_t)5) == 0u);
+
+    uint8_t bytes[byteGroupSize] = {0};
+    bytes[3] = 0x81;
+    bytes[9] = 0x81;
+    bytes[15] = 1;
+    BOOST_TEST(matchBytes(bytes, 0x81) == (1u << 3 | 1u << 9));
+    BOOST_TEST(matchBytes(bytes, 1) == 1u << 15);
+    BOOST_TEST(matchBytes(bytes, 0x82) == 0u);
+}
+
 BOOST_AUTO_TEST_CASE(TSMap_insert_test_single_thread)
 {
     using string = std::string;
@@ -174,163 +410,1516 @@ BOOST_AUTO_TEST_CASE(TSMap_erase_test_single_thread)
     BOOST_TEST(map.count("two") == 0);
 }
 
-BOOST_AUTO_TEST_CASE(TSMap_multithread_test_1)
+//alternative bucket layouts (TSMap<int, int> itself uses IntegralKVPairList)
+typedef boost::mpl::list<
+    TSMap::utility::KVPairList<int, int>,
+    TSMap::utility::TaggedKVPairList<int, int>,
+    TSMap::utility::Padded<TSMap::utility::KVPairList<int, int> >,
+    TSMap::utility::Padded<TSMap::utility::TaggedKVPairList<int, int> >
+> bucket_types;
+
+static_assert(alignof(TSMap::utility::Padded<TSMap::utility::KVPairList<int, int> >) == 64 &&
+              sizeof(TSMap::utility::Padded<TSMap::utility::KVPairList<int, int> >) % 64 == 0,
+              "padded buckets must not share cache lines");
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(TSMap_bucket_types_multithread, BucketT, bucket_types)
 {
-    using string = std::string;
-    TSMap::TSMap<int, int> map;
+    TSMap::TSMap<int, int, TSMap::hash<int>, std::equal_to<int>,
+                 std::allocator<TSMap::pair<int, int> >, BucketT> map(4);
 
-    std::thread tpool[32];
-    for(auto i=0;i<32;++i)
+    std::thread tpool[8];
+    for(auto i=0;i<8;++i)
     {
         tpool[i] = std::thread([&](const int tid){
-            int threadValue = tid;
-            for(int j=threadValue*2; j<threadValue*3;++j){
-                map.insert(j, tid);
+            for(int j=tid*1000; j<(tid+1)*1000;++j){
+                map.insert(j, j);
+            }
+            for(int j=tid*1000; j<(tid+1)*1000;j+=3){
+                map.deleteByKey(j);
             }
         }, i);
     }
 
-    std::for_each(tpool, tpool+32, [&](std::thread &t)
+    std::for_each(tpool, tpool+8, [&](std::thread &t)
     {
         t.join();
     });
 
-    //test edge value to be sure. others may be overwritten
-    BOOST_TEST(map[31*3-1]==31);
+    for(auto i=0;i<8000;++i)
+    {
+        if((i%1000)%3 == 0)
+        {
+            BOOST_TEST(map.count(i) == 0);
+        }
+        else
+        {
+            BOOST_TEST(map[i] == i);
+        }
+    }
 }
 
-//multithread write with two conflicts
-BOOST_AUTO_TEST_CASE(TSMap_multithread_test_2)
+BOOST_AUTO_TEST_CASE_TEMPLATE(TSMap_compact_during_churn, BucketT, bucket_types)
 {
-    using string = std::string;
-    TSMap::TSMap<int, int> map;
+    TSMap::TSMap<int, int, TSMap::hash<int>, std::equal_to<int>,
+                 std::allocator<TSMap::pair<int, int> >, BucketT> map(16);
+    map.setMaxLoadFactor(0);
+    std::atomic<bool> done(false);
 
-    //on default bucket = 128, will have two hash conflicts
-    std::thread tpool[256];
-    for(auto i=0;i<256;++i)
+    //compacts and shrinks while the writers insert and erase
+    std::thread compactor([&](){
+        while(!done.load())
+        {
+            map.compact();
+            map.shrinkToFit();
+        }
+    });
+    std::thread tpool[4];
+    for(auto i=0;i<4;++i)
     {
         tpool[i] = std::thread([&](const int tid){
-            map.insert(tid, tid);
+            for(int round=0;round<10;++round){
+                for(int j=tid*1000; j<(tid+1)*1000;++j){
+                    map.insert(j, j+round);
+                }
+                for(int j=tid*1000; j<(tid+1)*1000;++j){
+                    if(round == 9 && j%2 == 1) continue;
+                    map.deleteByKey(j);
+                }
+            }
         }, i);
     }
-
-    std::for_each(tpool, tpool+256, [&](std::thread &t)
+    std::for_each(tpool, tpool+4, [&](std::thread &t)
     {
         t.join();
     });
+    done = true;
+    compactor.join();
 
-    //verify:
-    for(auto i=0;i<256;++i)
+    BOOST_TEST(map.size() == 2000u);
+    for(auto i=0;i<4000;++i)
     {
-        BOOST_TEST(map[i]==i);
+        if(i%2 == 0)
+        {
+            BOOST_TEST(map.count(i) == 0);
+        }
+        else
+        {
+            BOOST_TEST(map[i] == i+9);
+        }
+    }
+
+    auto before = map.capacity();
+    for(auto i=1;i<4000;i+=2)
+    {
+        map.deleteByKey(i);
     }
+    map.shrinkToFit();
+    BOOST_TEST(map.capacity() == 0u);
+    BOOST_TEST(before > 0u);
 }
 
-//multithread write with duplicates: update
-BOOST_AUTO_TEST_CASE(TSMap_multithread_test_with_duplicates)
+BOOST_AUTO_TEST_CASE(test_arena_reuses_freed_blocks)
+{
+    TSMap::utility::Arena arena;
+    auto p = arena.allocate(100);
+    BOOST_TEST(reinterpret_cast<uintptr_t>(p) % 16 == 0u);
+    arena.deallocate(p, 100);
+    //same size class
+    BOOST_TEST(arena.allocate(112) == p);
+    auto chunks = arena.reservedBytes();
+
+    auto large = arena.allocate(1 << 20);
+    BOOST_TEST(arena.reservedBytes() == chunks + (1 << 20));
+    arena.deallocate(large, 1 << 20);
+    BOOST_TEST(arena.reservedBytes() == chunks);
+}
+
+BOOST_AUTO_TEST_CASE(test_arena_on_numa_node)
+{
+    //node 0 exists everywhere, the memory is mapped and bound instead of
+    //taken from operator new
+    TSMap::utility::Arena arena(0);
+    BOOST_TEST(arena.getNode() == 0);
+    auto p = static_cast<unsigned char*>(arena.allocate(100));
+    std::fill(p, p+100, 1);
+    arena.deallocate(p, 100);
+    BOOST_TEST(arena.allocate(112) == p);
+
+    auto large = static_cast<unsigned char*>(arena.allocate((1 << 20) + 1));
+    std::fill(large, large+(1 << 20)+1, 2);
+    BOOST_TEST(large[1 << 20] == 2);
+    arena.deallocate(large, (1 << 20) + 1);
+}
+
+BOOST_AUTO_TEST_CASE(TSMap_arena_allocator_multithread)
 {
     using string = std::string;
-    TSMap::TSMap<int, int> map;
+    typedef TSMap::utility::ArenaAllocator<TSMap::pair<int, string> > allocator;
+    TSMap::TSMap<int, string, TSMap::hash<int>, std::equal_to<int>, allocator> map(4);
+    TSMap::TSMap<int, string, TSMap::hash<int>, std::equal_to<int>, allocator,
+                 TSMap::utility::TaggedKVPairList<int, string, std::mutex, TSMap::hash<int>,
+                                                  std::equal_to<int>, allocator> > tagged(4);
+    BOOST_TEST((map.getAllocator() != tagged.getAllocator()));
 
-    std::thread tpool[256];
-    for(auto i=0;i<256;++i)
+    std::thread tpool[8];
+    for(auto i=0;i<8;++i)
     {
         tpool[i] = std::thread([&](const int tid){
-            map.insert(tid/2, tid);
-            map.insert(tid, tid);
+            for(int j=tid*1000; j<(tid+1)*1000;++j){
+                map.insert(j, std::to_string(j));
+                tagged.insert(j, std::to_string(j));
+            }
+            for(int j=tid*1000; j<(tid+1)*1000;j+=3){
+                map.deleteByKey(j);
+                tagged.deleteByKey(j);
+            }
         }, i);
     }
-
-    std::for_each(tpool, tpool+256, [&](std::thread &t)
+    std::for_each(tpool, tpool+8, [&](std::thread &t)
     {
         t.join();
     });
 
-    //verify:
-    for(auto i=0;i<128;++i)
+    for(auto i=0;i<8000;++i)
     {
-        bool value = map[i]==i || map[i]==i*2 || map[i]==i*2+1;
-        BOOST_TEST(value);
+        auto erased = (i%1000)%3 == 0;
+        BOOST_TEST(map.count(i) == (erased ? 0u : 1u));
+        BOOST_TEST(tagged.count(i) == (erased ? 0u : 1u));
+        if(!erased)
+        {
+            BOOST_TEST(map[i] == std::to_string(i));
+            BOOST_TEST(tagged[i] == std::to_string(i));
+        }
     }
+    BOOST_TEST(map.getAllocator().getArena().reservedBytes() > 0u);
 }
 
-BOOST_AUTO_TEST_CASE(TSMap_multithread_erase)
+BOOST_AUTO_TEST_CASE(TSMap_for_each_during_growth)
 {
-    using string = std::string;
-    TSMap::TSMap<int, int> map;
-
-    std::thread tpool[128];
-    for(auto i=0;i<128;++i)
+    TSMap::TSMap<int, int> map(2);
+    for(auto i=0;i<10000;++i)
     {
-        tpool[i] = std::thread([&](const int tid){
-            map.insert(tid, tid);
-        }, i);
+        map.insert(i, i);
     }
 
-    std::for_each(tpool, tpool+128, [&](std::thread &t)
+    //writers grow the table while the map is walked
+    std::thread writers[2];
+    for(auto t=0;t<2;++t)
     {
-        t.join();
+        writers[t] = std::thread([&](const int tid){
+            for(int j=10000+tid*10000; j<10000+(tid+1)*10000;++j){
+                map.insert(j, j);
+            }
+        }, t);
+    }
+    //no assertion while the writers run: a failing one would leave them unjoined
+    std::vector<int> visits(30000, 0);
+    size_t wrong = 0;
+    map.forEach([&](const int &key, const int &value)
+    {
+        if(key != value || key < 0 || key >= 30000) ++wrong;
+        else ++visits[key];
     });
+    for(auto &t : writers)
+    {
+        t.join();
+    }
 
-    for(auto i=0;i<32;++i)
+    BOOST_TEST(wrong == 0u);
+
+    for(auto i=0;i<10000;++i)
     {
-        tpool[i] = std::thread([&](const int tid){
-            map.deleteByKey(tid);
-        }, i);
+        BOOST_TEST(visits[i] == 1);
     }
-    std::for_each(tpool, tpool+32, [&](std::thread &t)
+    BOOST_TEST(*std::max_element(visits.begin(), visits.end()) == 1);
+}
+
+BOOST_AUTO_TEST_CASE(TSMap_snapshot_is_point_in_time)
+{
+    TSMap::TSMap<int, int> map(2);
+    for(auto i=0;i<5000;++i)
     {
-        t.join();
+        map.insert(i, 0);
+    }
+    auto snapshot = map.snapshot();
+
+    //overwrites, erases and growth after the snapshot
+    std::thread writer([&](){
+        for(int j=0;j<5000;++j){
+            map.insert(j, 1);
+        }
+        for(int j=5000;j<20000;++j){
+            map.insert(j, 1);
+        }
+        for(int j=0;j<20000;j+=2){
+            map.deleteByKey(j);
+        }
+    });
+    std::vector<int> visits(5000, 0);
+    size_t entries = 0, wrong = 0;
+    snapshot.forEach([&](const int &key, const int &value)
+    {
+        if(key < 0 || key >= 5000 || value != 0) ++wrong;
+        else ++visits[key];
+        ++entries;
+        //no lock held: the map can be used from fn
+        map.count(key);
     });
+    writer.join();
 
-    //verify:
-    for(auto i=32;i<128;++i)
+    BOOST_TEST(wrong == 0u);
+    BOOST_TEST(entries == 5000u);
+    BOOST_TEST(*std::min_element(visits.begin(), visits.end()) == 1);
+    BOOST_CHECK_THROW(snapshot.forEach([](const int &, const int &){}), std::logic_error*);
+
+    size_t current = 0;
+    map.snapshot().forEach([&](const int &key, const int &value)
     {
-        bool value = map[i]==i;
-        BOOST_TEST(value);
+        BOOST_REQUIRE(key%2 == 1);
+        BOOST_REQUIRE(value == 1);
+        ++current;
+    });
+    BOOST_TEST(current == map.size());
+    BOOST_TEST(current == 10000u);
+}
+
+/**
+ * a file name under $TMPDIR (or /tmp), unique to the process, removed when
+ * the test is done with it, failed or not
+ */
+struct TemporaryFile
+{
+    std::string path;
+
+    explicit TemporaryFile(const std::string &name)
+    {
+        auto directory = std::getenv("TMPDIR");
+        path = std::string(directory && *directory ? directory : "/tmp") + "/" +
+               std::to_string(getpid()) + "_" + name;
     }
 
-    for(auto i=0;i<32;++i)
+    ~TemporaryFile()
     {
-        BOOST_TEST(map.count(i) == 0);
+        std::remove(path.c_str());
     }
-}
+};
 
-BOOST_AUTO_TEST_CASE(TSMap_multithread_upsert)
+BOOST_AUTO_TEST_CASE(TSMap_save_and_load)
 {
-    using string = std::string;
-    TSMap::TSMap<int, int> map;
+    TemporaryFile file("tsmap_save_and_load.bin");
+    const auto &path = file.path;
+    {
+        TSMap::TSMap<int, int> map(4);
+        for(auto i=0;i<20000;++i)
+        {
+            map.insert(i, i*3);
+        }
+        map.save(path);
+    }
 
-    std::thread tpool[128];
-    for(auto i=0;i<128;++i)
+    TSMap::TSMap<int, int> loaded;
+    loaded.load(path);
+    BOOST_TEST(loaded.size() == 20000u);
+    for(auto i=0;i<20000;++i)
     {
-        tpool[i] = std::thread([&](const int tid){
-            map.insert(tid, tid);
-        }, i);
+        BOOST_REQUIRE(loaded.lookup(i) == i*3);
     }
+    BOOST_TEST(loaded.count(20000) == 0u);
 
-    std::for_each(tpool, tpool+128, [&](std::thread &t)
+    //writes copy the buckets out of the file, growth included
+    loaded.lookup(7) = -7;
+    loaded.insert(1, -1);
+    loaded.deleteByKey(2);
+    for(auto i=20000;i<60000;++i)
     {
-        t.join();
-    });
+        loaded.insert(i, i*3);
+    }
+    BOOST_TEST(loaded.size() == 59999u);
+    BOOST_TEST(loaded.lookup(7) == -7);
+    BOOST_TEST(loaded.lookup(1) == -1);
+    BOOST_TEST(loaded.count(2) == 0u);
+    BOOST_TEST(loaded.lookup(59999) == 59999*3);
 
-    //increment by one:
-    for(auto i=0;i<128;++i)
+    //the file itself is untouched
+    TSMap::TSMap<int, int> reloaded;
+    reloaded.load(path);
+    BOOST_TEST(reloaded.size() == 20000u);
+    BOOST_TEST(reloaded.lookup(7) == 21);
+    BOOST_TEST(reloaded.lookup(1) == 3);
+    BOOST_TEST(reloaded.lookup(2) == 6);
+
+    TSMap::TSMap<int, long> wrongType;
+    BOOST_CHECK_THROW(wrongType.load(path), std::runtime_error*);
+    BOOST_CHECK_THROW(wrongType.load("does_not_exist.bin"), std::runtime_error*);
+}
+
+BOOST_AUTO_TEST_CASE(TSMap_load_corrupt_files)
+{
+    TemporaryFile saved("tsmap_load_corrupt.bin");
+    TemporaryFile corrupt("tsmap_load_corrupt_copy.bin");
     {
-        tpool[i] = std::thread([&](const int tid){
-            map.insert(tid, map[tid]+1);
-        }, i);
+        TSMap::TSMap<int, int> map(16);
+        for(auto i=0;i<1000;++i) map.insert(i, i);
+        map.save(saved.path);
+    }
+    std::string image;
+    {
+        std::ifstream in(saved.path, std::ios::binary);
+        std::stringstream bytes;
+        bytes<<in.rdbuf();
+        image = bytes.str();
     }
+    auto write = [&](const std::string &bytes)
+    {
+        std::ofstream out(corrupt.path, std::ios::binary | std::ios::trunc);
+        out.write(bytes.data(), bytes.size());
+    };
+    //the image with one header field replaced
+    auto withField = [&](size_t offset, uint64_t value)
+    {
+        auto bytes = image;
+        std::memcpy(&bytes[offset], &value, sizeof(value));
+        return bytes;
+    };
+    typedef TSMap::utility::ImageHeader header;
 
-    std::for_each(tpool, tpool+128, [&](std::thread &t)
+    std::vector<std::string> files = {
+        //shorter than the header, and cut off in the directory or the entries
+        image.substr(0, sizeof(header)/2),
+        image.substr(0, sizeof(header)+8),
+        image.substr(0, image.size()-1),
+        //sizes whose products overflow, past the end of the file
+        withField(offsetof(header, bucketCount), (uint64_t)1 << 61),
+        withField(offsetof(header, entryCount), (uint64_t)1 << 62),
+        withField(offsetof(header, entriesOffset), ~(uint64_t)0 - 7),
+        //entries not aligned for pair<int, int>
+        withField(offsetof(header, entriesOffset), *reinterpret_cast<const uint64_t*>(
+                  &image[offsetof(header, entriesOffset)]) + 2)
+    };
+    for(auto &bytes : files)
     {
-        t.join();
+        write(bytes);
+        TSMap::TSMap<int, int> map;
+        BOOST_CHECK_THROW(map.load(corrupt.path), std::runtime_error*);
+        BOOST_TEST(map.size() == 0u);
+    }
+
+    //the intact image still loads
+    write(image);
+    TSMap::TSMap<int, int> map;
+    map.load(corrupt.path);
+    BOOST_TEST(map.size() == 1000u);
+    BOOST_TEST(map.lookup(999) == 999);
+}
+
+BOOST_AUTO_TEST_CASE(TSMap_stats)
+{
+    TSMap::TSMap<int, int> map(16);
+    for(auto i=0;i<10000;++i)
+    {
+        map.insert(i, i);
+    }
+    for(auto i=0;i<10000;i+=3)
+    {
+        map.deleteByKey(i);
+    }
+    for(auto i=0;i<20000;++i)
+    {
+        map.count(i);
+    }
+
+    auto stats = map.stats();
+    BOOST_TEST(stats.totals.size == map.size());
+    BOOST_TEST(stats.totals.capacity == map.capacity());
+    size_t buckets = 0;
+    size_t entries = 0;
+    for(size_t i=0;i<TSMap::utility::MapStats::histogramSize;++i)
+    {
+        buckets += stats.loadHistogram[i];
+        entries += i*stats.loadHistogram[i];
+    }
+    BOOST_TEST(buckets == stats.buckets);
+    BOOST_TEST(entries <= stats.totals.size);
+    BOOST_TEST(stats.maxBucketSize > 0u);
+    BOOST_TEST(stats.meanLoad() == (double)map.size()/stats.buckets);
+
+#ifdef TSMAP_ENABLE_STATS
+    BOOST_TEST(stats.growths > 0u);
+    BOOST_TEST(stats.totals.lookups >= 20000u);
+    BOOST_TEST(stats.probesPerLookup() >= 1);
+    BOOST_TEST(stats.totals.lockAcquisitions >= 30000u);
+    BOOST_TEST(stats.totals.resizes > 0u);
+
+    //a reader waits for a writer holding the bucket lock
+    std::atomic<bool> locked(false);
+    std::thread writer([&](){
+        map.update(1, [&](int &){
+            locked = true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        });
     });
+    while(!locked) std::this_thread::yield();
+    map.count(1);
+    writer.join();
+    auto after = map.stats();
+    BOOST_TEST(after.totals.contendedAcquisitions > stats.totals.contendedAcquisitions);
+    BOOST_TEST(after.totals.lockWaitNanos > stats.totals.lockWaitNanos);
+#else
+    BOOST_TEST(stats.growths == 0u);
+    BOOST_TEST(stats.totals.lockAcquisitions == 0u);
+#endif
+}
 
-    for(auto i=0;i<128;++i)
+BOOST_AUTO_TEST_CASE(TSCache_clock_eviction)
+{
+    TSMap::TSCache<int, int> cache(64, std::chrono::nanoseconds::zero(), 1);
+    BOOST_TEST(cache.capacity() == 64u);
+    for(auto i=0;i<64;++i)
     {
-        BOOST_TEST(map[i] == i+1);
+        cache.insert(i, i);
+    }
+    //the first half is used again, the second half is evicted first
+    for(auto i=0;i<32;++i)
+    {
+        BOOST_REQUIRE(*cache.find(i) == i);
+    }
+    for(auto i=64;i<96;++i)
+    {
+        cache.insert(i, i);
+    }
+    BOOST_TEST(cache.size() == 64u);
+    for(auto i=0;i<32;++i)
+    {
+        BOOST_REQUIRE(cache.find(i).has_value());
+    }
+    for(auto i=32;i<64;++i)
+    {
+        BOOST_REQUIRE(!cache.find(i).has_value());
     }
+    auto stats = cache.stats();
+    BOOST_TEST(stats.evictions == 32u);
+    BOOST_TEST(stats.insertions == 96u);
+    BOOST_TEST(stats.hits == 64u);
+    BOOST_TEST(stats.misses == 32u);
+
+    //an erased slot is reused before anything else is evicted
+    BOOST_TEST(cache.deleteByKey(70));
+    BOOST_TEST(!cache.deleteByKey(70));
+    cache.insert(100, 100);
+    BOOST_TEST(cache.stats().evictions == 32u);
+    BOOST_TEST(cache.size() == 64u);
+
+    size_t loads = 0;
+    auto load = [&](const int &key){ ++loads; return key*2; };
+    BOOST_TEST(cache.findOrLoad(200, load) == 400);
+    BOOST_TEST(cache.findOrLoad(200, load) == 400);
+    BOOST_TEST(loads == 1u);
+
+    cache.clear();
+    BOOST_TEST(cache.size() == 0u);
+    BOOST_TEST(!cache.find(0).has_value());
+}
+
+BOOST_AUTO_TEST_CASE(TSCache_ttl)
+{
+    TSMap::TSCache<int, int> cache(128, std::chrono::milliseconds(20));
+    cache.insert(1, 1);
+    cache.insert(2, 2, std::chrono::nanoseconds::zero());
+    cache.insert(3, 3, std::chrono::hours(1));
+    BOOST_TEST(cache.find(1).has_value());
+    std::this_thread::sleep_for(std::chrono::milliseconds(40));
+    BOOST_TEST(!cache.find(1).has_value());
+    BOOST_TEST(cache.find(2).has_value());
+    BOOST_TEST(cache.find(3).has_value());
+    BOOST_TEST(cache.stats().expirations == 1u);
+    BOOST_TEST(cache.size() == 2u);
+
+    //a full shard drops expired entries before evicting live ones
+    TSMap::TSCache<int, int> small(8, std::chrono::nanoseconds::zero(), 1);
+    for(auto i=0;i<4;++i)
+    {
+        small.insert(i, i, std::chrono::milliseconds(1));
+    }
+    for(auto i=4;i<8;++i)
+    {
+        small.insert(i, i);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    for(auto i=8;i<12;++i)
+    {
+        small.insert(i, i);
+    }
+    auto stats = small.stats();
+    BOOST_TEST(stats.expirations == 4u);
+    BOOST_TEST(stats.evictions == 0u);
+    for(auto i=4;i<12;++i)
+    {
+        BOOST_REQUIRE(small.find(i).has_value());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TSCache_multithread)
+{
+    TSMap::TSCache<int, int> cache(1000);
+    std::vector<std::thread> threads;
+    std::atomic<size_t> wrong(0);
+    const int finds = 50000;
+    for(auto t=0;t<4;++t)
+    {
+        threads.emplace_back([&, t](){
+            uint64_t state = t+1;
+            for(auto i=0;i<finds;++i)
+            {
+                state = state*6364136223846793005ULL + 1442695040888963407ULL;
+                //a small hot set and a large cold one
+                auto key = (int)((state>>33) % (i%4 ? 500 : 100000));
+                auto value = cache.findOrLoad(key, [](const int &key){ return -key; });
+                if(value != -key) ++wrong;
+                if(i%97 == 0) cache.deleteByKey(key);
+            }
+        });
+    }
+    for(auto &t : threads) t.join();
+
+    BOOST_TEST(wrong == 0u);
+    BOOST_TEST(cache.size() <= cache.capacity());
+    auto stats = cache.stats();
+    BOOST_TEST(stats.hits + stats.misses == 4u*finds);
+    BOOST_TEST(stats.evictions > 0u);
+    BOOST_TEST(stats.hitRatio() > 0.5);
+}
+
+//std::allocator places shards by first touch, an arena per shard binds them
+typedef boost::mpl::list<
+    std::allocator<TSMap::pair<int, int> >,
+    TSMap::utility::ArenaAllocator<TSMap::pair<int, int> >
+> shard_allocators;
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(ShardedTSMap_simulated_nodes, AllocatorT, shard_allocators)
+{
+    auto topology = TSMap::utility::NumaTopology::simulated(2);
+    BOOST_TEST(topology.nodeCount() == 2);
+    BOOST_TEST(!topology.bindsMemory());
+    BOOST_TEST(CPU_COUNT(&topology.cpusOf(0)) > 0);
+    BOOST_TEST(CPU_COUNT(&topology.cpusOf(1)) > 0);
+
+    typedef TSMap::ShardedTSMap<int, int, TSMap::hash<int>, std::equal_to<int>, AllocatorT> map_type;
+    map_type map(6, 4, topology);
+    BOOST_TEST(map.getShardCount() == 8u);
+    for(size_t i=0;i<8;++i) BOOST_TEST(map.nodeOfShard(i) == (int)(i%2));
+
+    //a worker per node, pinned to it, inserting the keys that live there
+    const int total = 20000;
+    std::atomic<int> wrong(0);
+    std::thread workers[2];
+    for(int node=0;node<2;++node)
+    {
+        workers[node] = std::thread([&, node]()
+        {
+            if(!map.getTopology().pinThread(node)) ++wrong;
+            for(int i=0;i<total;++i)
+            {
+                if(map.homeNode(i) == node) map.insert(i, i);
+            }
+            size_t entries = 0;
+            map.forEachShardOn(node, [&](typename map_type::shard_type &shard)
+            {
+                entries += shard.size();
+            });
+            if(entries == 0) ++wrong;
+        });
+    }
+    for(auto &t : workers) t.join();
+    BOOST_TEST(wrong == 0);
+
+    BOOST_TEST(map.size() == (size_t)total);
+    for(int i=0;i<total;++i)
+    {
+        BOOST_TEST(map.count(i) == 1u);
+        BOOST_TEST(map[i] == i);
+        BOOST_TEST(map.shard(map.shardOf(i)).count(i) == 1u);
+    }
+
+    //every shard grew its own table from 4 buckets
+    size_t buckets = 0;
+    for(size_t i=0;i<8;++i)
+    {
+        BOOST_TEST(map.shard(i).size() > (size_t)total/16);
+        BOOST_TEST(map.shard(i).bucketCount() > 4u);
+        buckets += map.shard(i).bucketCount();
+    }
+    auto stats = map.stats();
+    BOOST_TEST(stats.totals.size == (size_t)total);
+    BOOST_TEST(stats.buckets == buckets);
+    //the keys of a shard spread over all of its buckets
+    BOOST_TEST(stats.loadHistogram[0] < buckets/4);
+
+    for(int i=0;i<total;i+=2) map.deleteByKey(i);
+    BOOST_TEST(map.size() == (size_t)total/2);
+    BOOST_TEST(!map.find(0));
+    BOOST_TEST(*map.find(1) == 1);
+    BOOST_TEST(map.update(1, [](int &v){ v = -1; }));
+    BOOST_TEST(map[1] == -1);
+}
+
+BOOST_AUTO_TEST_CASE(TSMap_integral_forEach_with_shared_readers)
+{
+    //forEach and find share the bucket locks: forEach must not write the
+    //entries it visits, or a find sees a moved-from value
+    using bucket = TSMap::utility::IntegralKVPairList<uint64_t, std::string, std::shared_timed_mutex>;
+    TSMap::TSMap<uint64_t, std::string, TSMap::hash<uint64_t>, std::equal_to<uint64_t>,
+                 std::allocator<TSMap::pair<uint64_t, std::string> >, bucket> map(64);
+    map.setMaxLoadFactor(0);
+    const uint64_t keys = 2000;
+    for(uint64_t i=0;i<keys;++i)
+    {
+        map.insert(i, std::to_string(i) + " is stored out of line");
+    }
+
+    std::atomic<int> wrong(0);
+    std::thread tpool[8];
+    for(auto i=0;i<8;++i)
+    {
+        tpool[i] = std::thread([&](const int tid){
+            for(int round=0;round<20;++round)
+            {
+                if(tid%2)
+                {
+                    size_t visited = 0;
+                    map.forEach([&](const uint64_t &key, const std::string &value)
+                    {
+                        if(value != std::to_string(key) + " is stored out of line") ++wrong;
+                        ++visited;
+                    });
+                    if(visited != keys) ++wrong;
+                    continue;
+                }
+                for(uint64_t j=0;j<keys;++j)
+                {
+                    auto value = map.find(j);
+                    if(!value || *value != std::to_string(j) + " is stored out of line") ++wrong;
+                }
+            }
+        }, i);
+    }
+    std::for_each(tpool, tpool+8, [&](std::thread &t)
+    {
+        t.join();
+    });
+    BOOST_TEST(wrong == 0);
+    BOOST_TEST(map.size() == keys);
+}
+
+BOOST_AUTO_TEST_CASE(TSMap_shared_mutex_readers_and_writers)
+{
+    using bucket = TSMap::utility::KVPairList<int, int, std::shared_timed_mutex>;
+    TSMap::TSMap<int, int, TSMap::hash<int>, std::equal_to<int>,
+                 std::allocator<TSMap::pair<int, int> >, bucket> map(8);
+    for(auto i=0;i<1000;++i)
+    {
+        map.insert(i, i);
+    }
+
+    //readers check the stable keys while writers churn the others.
+    //boost assertions are not thread safe, count misses instead
+    std::atomic<int> misses(0);
+    std::thread tpool[8];
+    for(auto i=0;i<8;++i)
+    {
+        tpool[i] = std::thread([&](const int tid){
+            for(int round=0;round<20;++round)
+            {
+                for(int j=0;j<1000;++j)
+                {
+                    //operator[] would hand out a reference that a resize
+                    //by the writers can invalidate
+                    if(tid%2)
+                    {
+                        if(map.count(j) != 1) ++misses;
+                    }
+                    else
+                    {
+                        map.insert(1000+tid*1000+j, j);
+                        map.deleteByKey(1000+tid*1000+j);
+                    }
+                }
+            }
+        }, i);
+    }
+
+    std::for_each(tpool, tpool+8, [&](std::thread &t)
+    {
+        t.join();
+    });
+
+    BOOST_TEST(misses == 0);
+    BOOST_TEST(map.size() == 1000);
+}
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(TSMap_multithread_test_1, MapT, map_types)
+{
+    MapT map;
+
+    std::thread tpool[32];
+    for(auto i=0;i<32;++i)
+    {
+        tpool[i] = std::thread([&](const int tid){
+            int threadValue = tid;
+            for(int j=threadValue*2; j<threadValue*3;++j){
+                map.insert(j, tid);
+            }
+        }, i);
+    }
+
+    std::for_each(tpool, tpool+32, [&](std::thread &t)
+    {
+        t.join();
+    });
+
+    //test edge value to be sure. others may be overwritten
+    BOOST_TEST(map[31*3-1]==31);
+}
+
+//multithread write with two conflicts
+BOOST_AUTO_TEST_CASE_TEMPLATE(TSMap_multithread_test_2, MapT, map_types)
+{
+    MapT map;
+
+    //on default bucket = 128, will have two hash conflicts
+    std::thread tpool[256];
+    for(auto i=0;i<256;++i)
+    {
+        tpool[i] = std::thread([&](const int tid){
+            map.insert(tid, tid);
+        }, i);
+    }
+
+    std::for_each(tpool, tpool+256, [&](std::thread &t)
+    {
+        t.join();
+    });
+
+    //verify:
+    for(auto i=0;i<256;++i)
+    {
+        BOOST_TEST(map[i]==i);
+    }
+}
+
+//multithread write with duplicates: update
+BOOST_AUTO_TEST_CASE_TEMPLATE(TSMap_multithread_test_with_duplicates, MapT, map_types)
+{
+    MapT map;
+
+    std::thread tpool[256];
+    for(auto i=0;i<256;++i)
+    {
+        tpool[i] = std::thread([&](const int tid){
+            map.insert(tid/2, tid);
+            map.insert(tid, tid);
+        }, i);
+    }
+
+    std::for_each(tpool, tpool+256, [&](std::thread &t)
+    {
+        t.join();
+    });
+
+    //verify:
+    for(auto i=0;i<128;++i)
+    {
+        bool value = map[i]==i || map[i]==i*2 || map[i]==i*2+1;
+        BOOST_TEST(value);
+    }
+}
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(TSMap_multithread_erase, MapT, map_types)
+{
+    MapT map;
+
+    std::thread tpool[128];
+    for(auto i=0;i<128;++i)
+    {
+        tpool[i] = std::thread([&](const int tid){
+            map.insert(tid, tid);
+        }, i);
+    }
+
+    std::for_each(tpool, tpool+128, [&](std::thread &t)
+    {
+        t.join();
+    });
+
+    for(auto i=0;i<32;++i)
+    {
+        tpool[i] = std::thread([&](const int tid){
+            map.deleteByKey(tid);
+        }, i);
+    }
+    std::for_each(tpool, tpool+32, [&](std::thread &t)
+    {
+        t.join();
+    });
+
+    //verify:
+    for(auto i=32;i<128;++i)
+    {
+        bool value = map[i]==i;
+        BOOST_TEST(value);
+    }
+
+    for(auto i=0;i<32;++i)
+    {
+        BOOST_TEST(map.count(i) == 0);
+    }
+}
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(TSMap_multithread_upsert, MapT, map_types)
+{
+    MapT map;
+
+    std::thread tpool[128];
+    for(auto i=0;i<128;++i)
+    {
+        tpool[i] = std::thread([&](const int tid){
+            map.insert(tid, tid);
+        }, i);
+    }
+
+    std::for_each(tpool, tpool+128, [&](std::thread &t)
+    {
+        t.join();
+    });
+
+    //increment by one:
+    for(auto i=0;i<128;++i)
+    {
+        tpool[i] = std::thread([&](const int tid){
+            map.insert(tid, map[tid]+1);
+        }, i);
+    }
+
+    std::for_each(tpool, tpool+128, [&](std::thread &t)
+    {
+        t.join();
+    });
+
+    for(auto i=0;i<128;++i)
+    {
+        BOOST_TEST(map[i] == i+1);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(LockFreeTSMap_churn_with_growth)
+{
+    TSMap::LockFreeTSMap<int, int> map(2);
+    std::atomic<int> misses(0);
+
+    std::thread tpool[8];
+    for(auto i=0;i<8;++i)
+    {
+        tpool[i] = std::thread([&](const int tid){
+            for(int round=0;round<3;++round)
+            {
+                for(int j=tid*5000; j<(tid+1)*5000;++j){
+                    map.insert(j, j+round);
+                }
+                for(int j=tid*5000; j<(tid+1)*5000;j+=2){
+                    if(map[j] != j+round) ++misses;
+                    map.deleteByKey(j);
+                }
+            }
+        }, i);
+    }
+
+    std::for_each(tpool, tpool+8, [&](std::thread &t)
+    {
+        t.join();
+    });
+
+    BOOST_TEST(misses == 0);
+    BOOST_TEST(map.size() == 20000);
+    for(auto i=0;i<40000;++i)
+    {
+        BOOST_TEST(map.count(i) == (size_t)(i%2));
+    }
+    BOOST_TEST(map[39999] == 39999+2);
+}
+
+BOOST_AUTO_TEST_CASE(TSMap_find_update_single_thread)
+{
+    using string = std::string;
+    TSMap::TSMap<string, int> map;
+    map.insert("one", 1);
+
+    auto one = map.find("one");
+    BOOST_TEST(one.has_value());
+    BOOST_TEST(*one == 1);
+    BOOST_TEST(!map.find("two"));
+    BOOST_TEST(map.find("two").value_or(-1) == -1);
+
+    BOOST_TEST(map.update("one", [](int &value){ value += 10; }));
+    BOOST_TEST(!map.update("two", [](int &value){ value += 10; }));
+    BOOST_TEST(map.count("two") == 0);
+    BOOST_TEST(*map.find("one") == 11);
+
+    BOOST_TEST(map.upsertWith("two", [](int &value){ value += 2; }));
+    BOOST_TEST(!map.upsertWith("two", [](int &value){ value += 2; }));
+    BOOST_TEST(*map.find("two") == 4);
+    BOOST_TEST(map.size() == 2);
+}
+
+BOOST_AUTO_TEST_CASE(TSMap_upsertWith_counters_multithread)
+{
+    TSMap::TSMap<int, int> map(4);
+
+    //all threads increment the same 64 counters while the table grows
+    std::thread tpool[8];
+    for(auto i=0;i<8;++i)
+    {
+        tpool[i] = std::thread([&](const int tid){
+            for(int j=0;j<19200;++j){
+                map.upsertWith(j%64, [](int &count){ ++count; });
+                map.upsertWith(1000+tid*19200+j, [](int &count){ ++count; });
+            }
+        }, i);
+    }
+
+    std::for_each(tpool, tpool+8, [&](std::thread &t)
+    {
+        t.join();
+    });
+
+    for(auto i=0;i<64;++i)
+    {
+        BOOST_TEST(*map.find(i) == 8*19200/64);
+    }
+    BOOST_TEST(map.size() == 64+8*19200);
+}
+
+BOOST_AUTO_TEST_CASE(TSMap_async_writes_multithread)
+{
+    TSMap::TSMap<int, int> map(4);
+
+    //hot counters and per thread keys, while the table grows. every thread
+    //keeps a window of futures open, and its own keys are written in order:
+    //inserted, overwritten, then every other one erased
+    const int perThread = 4000;
+    std::atomic<int> wrong(0);
+    std::thread tpool[8];
+    for(auto i=0;i<8;++i)
+    {
+        tpool[i] = std::thread([&](const int tid){
+            std::vector<TSMap::future<bool> > inserts, others;
+            for(int j=0;j<perThread;++j){
+                others.push_back(map.upsertWithAsync(j%16, [](int &count){ ++count; }));
+                inserts.push_back(map.insertAsync(1000+tid*perThread+j, j));
+                others.push_back(map.insertAsync(1000+tid*perThread+j, -j));
+                if(j%2 == 0) others.push_back(map.eraseAsync(1000+tid*perThread+j));
+            }
+            for(auto &f : inserts) if(!f.get()) ++wrong;
+            for(auto &f : others) f.get();
+        }, i);
+    }
+
+    std::for_each(tpool, tpool+8, [&](std::thread &t)
+    {
+        t.join();
+    });
+
+    BOOST_TEST(wrong == 0);
+    for(auto i=0;i<16;++i)
+    {
+        BOOST_TEST(*map.find(i) == 8*perThread/16);
+    }
+    BOOST_TEST(map.size() == (size_t)(16+8*perThread/2));
+    for(auto i=0;i<8*perThread;++i)
+    {
+        auto j = i%perThread;
+        auto value = map.find(1000+i);
+        BOOST_TEST(!!value == (j%2 == 1));
+        if(value) BOOST_TEST(*value == -j);
+    }
+
+    BOOST_TEST(!map.eraseAsync(-1).get());
+    BOOST_TEST(map.eraseAsync(0).get());
+    auto failed = map.upsertWithAsync(0, [](int &){ throw new std::runtime_error("failed"); });
+    BOOST_CHECK_THROW(failed.get(), std::runtime_error*);
+    //the entry was inserted before fn threw
+    BOOST_TEST(map.count(0) == 1u);
+}
+
+//allocations through FailingAllocator throw std::bad_alloc while set
+static std::atomic<bool> failAllocations(false);
+
+template <typename T>
+struct FailingAllocator
+{
+    typedef T value_type;
+
+    FailingAllocator()
+    {}
+
+    template <typename U>
+    FailingAllocator(const FailingAllocator<U> &)
+    {}
+
+    T * allocate(size_t n)
+    {
+        if(failAllocations) throw std::bad_alloc();
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    template <typename U>
+    bool operator==(const FailingAllocator<U> &) const
+    {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const FailingAllocator<U> &) const
+    {
+        return false;
+    }
+};
+
+//keys of the failed migration tests: a string is long enough for the heap,
+//so that a moved-from one is left empty
+static uint64_t makeKey(uint64_t i, uint64_t)
+{
+    return i;
+}
+
+static std::string makeKey(uint64_t i, const std::string &)
+{
+    return "key-with-a-long-enough-prefix-" + std::to_string(i);
+}
+
+typedef boost::mpl::list<uint64_t, std::string> migration_key_types;
+
+BOOST_AUTO_TEST_CASE_TEMPLATE(TSMap_async_writes_failed_migration, KeyT, migration_key_types)
+{
+    TSMap::TSMap<KeyT, uint64_t, TSMap::hash<KeyT>, std::equal_to<KeyT>,
+                 FailingAllocator<TSMap::pair<KeyT, uint64_t> > > map(4);
+    auto key = [](uint64_t i){ return makeKey(i, KeyT()); };
+    //stops right after the table doubled: no bucket is migrated yet, and
+    //the buckets of the new table have no arrays
+    uint64_t keys = 0;
+    while(map.bucketCount() == 4) map.insert(key(keys), keys), ++keys;
+
+    //migrating the bucket of a write throws before the write is applied.
+    //every future gets a result or the exception, none is left waiting
+    failAllocations = true;
+    std::vector<TSMap::future<bool> > writes;
+    for(uint64_t i=0;i<64;++i) writes.push_back(map.insertAsync(key(1000+i), i));
+    int failed = 0;
+    for(auto &f : writes)
+    {
+        try
+        {
+            f.get();
+        }
+        catch(const std::bad_alloc &)
+        {
+            ++failed;
+        }
+    }
+    failAllocations = false;
+    BOOST_TEST(failed == 64);
+
+    //the stripes are not stuck, and the entries survived
+    writes.clear();
+    for(uint64_t i=0;i<64;++i) writes.push_back(map.insertAsync(key(1000+i), i));
+    for(auto &f : writes) BOOST_TEST(f.get());
+    BOOST_TEST(map.size() == keys+64);
+    for(uint64_t i=0;i<keys;++i) BOOST_TEST(map.find(key(i)).value_or(~(uint64_t)0) == i);
+    for(uint64_t i=0;i<64;++i) BOOST_TEST(map.find(key(1000+i)).value_or(~(uint64_t)0) == i);
+}
+
+//a failed allocation while a bucket of string entries is migrated loses
+//nothing: the old bucket keeps its entries until they all fit the new ones
+BOOST_AUTO_TEST_CASE(TSMap_failed_migration_keeps_string_entries)
+{
+    using string = std::string;
+    TSMap::TSMap<string, string, TSMap::hash<string>, std::equal_to<string>,
+                 FailingAllocator<TSMap::pair<string, string> > > map(4);
+    //long enough for the heap: a moved-from string is left empty
+    auto key = [](int i){ return "key-with-a-long-enough-prefix-" + std::to_string(i); };
+    int keys = 0;
+    while(map.bucketCount() == 4) map.insert(key(keys), key(keys)), ++keys;
+
+    //every insert migrates the old bucket of its key first, which fails
+    failAllocations = true;
+    int failed = 0;
+    for(int i=0;i<8;++i)
+    {
+        try
+        {
+            map.insert(key(1000+i), key(1000+i));
+        }
+        catch(const std::bad_alloc &)
+        {
+            ++failed;
+        }
+    }
+    failAllocations = false;
+    BOOST_TEST(failed == 8);
+
+    for(int i=0;i<8;++i) map.insert(key(1000+i), key(1000+i));
+    BOOST_TEST(map.size() == (size_t)keys+8);
+    BOOST_TEST(map.count("") == 0u);
+    for(int i=0;i<keys;++i) BOOST_TEST(map.find(key(i)).value_or("") == key(i));
+    size_t visited = 0;
+    map.forEach([&](const string &k, const string &v)
+    {
+        if(k == v && !k.empty()) ++visited;
+    });
+    BOOST_TEST(visited == map.size());
+}
+
+BOOST_AUTO_TEST_CASE(TSMap_move_only_values_with_growth)
+{
+    using string = std::string;
+    //unique_ptr cannot be copied: every step from insert through bucket
+    //resize and migration to the grown table has to move
+    TSMap::TSMap<string, std::unique_ptr<int> > map(4);
+    for(int i=0;i<1000;++i)
+    {
+        auto key = std::to_string(i);
+        if(i % 2)
+        {
+            map.insert(std::move(key), std::unique_ptr<int>(new int(i)));
+        }
+        else
+        {
+            map.emplace(key, new int(i));
+        }
+    }
+    BOOST_TEST(map.size() == 1000);
+    BOOST_TEST(map.bucketCount() > 4);
+    for(int i=0;i<1000;++i)
+    {
+        BOOST_TEST(*map[std::to_string(i)] == i);
+    }
+
+    map.emplace("0", new int(-1));
+    BOOST_TEST(*map["0"] == -1);
+    BOOST_TEST(map.size() == 1000);
+}
+
+BOOST_AUTO_TEST_CASE(TSMap_batch_operations_multithread)
+{
+    //starts small so that the batches run into growth and migration
+    TSMap::TSMap<int, int> map(4);
+    const int threadCount = 8;
+    const int perThread = 4096;
+    const int batch = 256;
+    std::atomic<int> misses(0);
+    std::vector<std::thread> threads;
+    for(int t=0;t<threadCount;++t)
+    {
+        threads.push_back(std::thread([&, t]()
+        {
+            std::vector<TSMap::pair<int, int> > entries;
+            std::vector<int> keys;
+            std::vector<TSMap::optional<int> > values(batch);
+            for(int base=0;base<perThread;base+=batch)
+            {
+                entries.clear();
+                keys.clear();
+                for(int i=base;i<base+batch;++i)
+                {
+                    entries.push_back(TSMap::make_pair(t*perThread+i, i));
+                    keys.push_back(t*perThread+i);
+                }
+                //a duplicate keeps its last value
+                entries.push_back(TSMap::make_pair(t*perThread+base, base));
+                map.insertMany(entries.begin(), entries.end());
+                if(map.lookupMany(keys.begin(), keys.end(), values.begin()) != batch)
+                {
+                    ++misses;
+                }
+                for(int i=0;i<batch;++i)
+                {
+                    if(!values[i] || *values[i] != base+i) ++misses;
+                }
+            }
+        }));
+    }
+    for(auto &t : threads) t.join();
+    BOOST_TEST(misses == 0);
+    BOOST_TEST(map.size() == (size_t)threadCount*perThread);
+    BOOST_TEST(map.bucketCount() > 4);
+
+    std::vector<int> odd;
+    for(int i=1;i<threadCount*perThread;i+=2) odd.push_back(i);
+    odd.push_back(-1);
+    BOOST_TEST(map.eraseMany(odd.begin(), odd.end()) == odd.size()-1);
+    BOOST_TEST(map.size() == (size_t)threadCount*perThread/2);
+    for(int i=0;i<threadCount*perThread;++i)
+    {
+        BOOST_TEST(map.count(i) == (i % 2 ? 0u : 1u));
+    }
+}
+
+//case-insensitive keys for the custom Hash/KeyEqual test
+struct LowerCaseHash
+{
+    size_t operator()(const std::string &key) const
+    {
+        std::string lower(key);
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        return TSMap::hash<std::string>()(lower);
+    }
+};
+
+struct CaseInsensitiveEqual
+{
+    bool operator()(const std::string &a, const std::string &b) const
+    {
+        return a.size() == b.size() &&
+               std::equal(a.begin(), a.end(), b.begin(),
+                          [](char x, char y){ return ::tolower(x) == ::tolower(y); });
+    }
+};
+
+BOOST_AUTO_TEST_CASE(TSMap_custom_hash_and_key_equal)
+{
+    using string = std::string;
+    TSMap::TSMap<string, int, LowerCaseHash, CaseInsensitiveEqual> map(2);
+    map.insert("Alpha", 1);
+    map.insert("ALPHA", 2);
+    map.insert("beta", 3);
+    BOOST_TEST(map.size() == 2);
+    BOOST_TEST(map["alpha"] == 2);
+    BOOST_TEST(map.count("BETA") == 1);
+    map.deleteByKey("Beta");
+    BOOST_TEST(map.count("beta") == 0);
+
+    TSMap::LockFreeTSMap<string, int, LowerCaseHash, CaseInsensitiveEqual> lockFree;
+    lockFree.insert("Alpha", 1);
+    lockFree.insert("ALPHA", 2);
+    BOOST_TEST(lockFree.size() == 1);
+    BOOST_TEST(lockFree["alpha"] == 2);
+
+    using bucket = TSMap::utility::TaggedKVPairList<string, int, std::mutex,
+                                                    LowerCaseHash, CaseInsensitiveEqual>;
+    TSMap::TSMap<string, int, LowerCaseHash, CaseInsensitiveEqual,
+                 std::allocator<TSMap::pair<string, int> >, bucket> tagged(2);
+    for(int i=0;i<100;++i) tagged.insert("Key" + std::to_string(i), i);
+    for(int i=0;i<100;++i) BOOST_TEST(tagged["KEY" + std::to_string(i)] == i);
+    BOOST_TEST(tagged.size() == 100);
+}
+
+BOOST_AUTO_TEST_CASE(TSMap_default_hash)
+{
+    TSMap::hash<uint64_t> intHash;
+    TSMap::hash<std::string> stringHash;
+    //sequential ids: top and bottom bits both vary
+    size_t topBits[16] = {0}, bottomBits[16] = {0};
+    for(uint64_t i=0;i<1600;++i)
+    {
+        ++topBits[intHash(i) >> 60];
+        ++bottomBits[intHash(i) & 15];
+    }
+    for(int i=0;i<16;++i)
+    {
+        BOOST_TEST(topBits[i] > 50u);
+        BOOST_TEST(bottomBits[i] > 50u);
+    }
+    //strings of every length up to and past one 16 byte step
+    std::string s;
+    for(int length=0;length<40;++length)
+    {
+        BOOST_TEST(stringHash(s) == stringHash(std::string(s)));
+        BOOST_TEST(stringHash(s) != stringHash(s + "x"));
+        BOOST_TEST(stringHash(s + "a") != stringHash(s + "b"));
+        s += (char)('a' + length % 26);
+    }
+    BOOST_TEST(TSMap::hash<int>()(42) == TSMap::hash<int>()(42));
+}
+
+BOOST_AUTO_TEST_CASE(LockFreeTSMap_find)
+{
+    TSMap::LockFreeTSMap<int, int> map;
+    map.insert(1, 10);
+    BOOST_TEST(*map.find(1) == 10);
+    BOOST_TEST(!map.find(2));
+    map.deleteByKey(1);
+    BOOST_TEST(!map.find(1));
+}
+
+BOOST_AUTO_TEST_CASE(TSMap_growth_multithread)
+{
+    TSMap::TSMap<int, int> map(2);
+    std::atomic<int> misses(0);
+
+    std::thread tpool[8];
+    for(auto i=0;i<8;++i)
+    {
+        tpool[i] = std::thread([&](const int tid){
+            for(int j=tid*10000; j<(tid+1)*10000;++j){
+                map.insert(j, j);
+                //read back keys of the same thread while the table migrates.
+                //through find, operator[] returns a reference that dies when
+                //the entry is migrated
+                if(j%7 == 0)
+                {
+                    auto value = map.find(j-j%1000);
+                    if(!value || *value != j-j%1000) ++misses;
+                }
+            }
+            for(int j=tid*10000; j<(tid+1)*10000;j+=2){
+                map.deleteByKey(j);
+            }
+        }, i);
+    }
+
+    std::for_each(tpool, tpool+8, [&](std::thread &t)
+    {
+        t.join();
+    });
+
+    BOOST_TEST(misses == 0);
+    BOOST_TEST(map.size() == 40000);
+    BOOST_TEST(map.bucketCount() > 2);
+    for(auto i=0;i<80000;++i)
+    {
+        BOOST_TEST(map.count(i) == (size_t)(i%2));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TSMap_no_growth_with_zero_load_factor)
+{
+    TSMap::TSMap<int, int> map(16);
+    map.setMaxLoadFactor(0);
+    for(auto i=0;i<10000;++i)
+    {
+        map.insert(i, i);
+    }
+    BOOST_TEST(map.bucketCount() == 16);
+    BOOST_TEST(map.size() == 10000);
+    BOOST_TEST(map[9999] == 9999);
+}
+
+//a bucket that counts how often it is sealed, i.e. migrated to a grown table
+template <typename KeyT, typename ValueT,
+          typename Allocator = std::allocator<TSMap::pair<KeyT, ValueT> > >
+struct SealCountingBucket :
+    TSMap::utility::KVPairList<KeyT, ValueT, std::mutex, std::equal_to<KeyT>, Allocator>
+{
+    typedef TSMap::utility::KVPairList<KeyT, ValueT, std::mutex, std::equal_to<KeyT>, Allocator> base_type;
+
+    static size_t seals;
+
+    using base_type::base_type;
+
+    void seal()
+    {
+        ++seals;
+        base_type::seal();
+    }
+};
+
+template <typename KeyT, typename ValueT, typename Allocator>
+size_t SealCountingBucket<KeyT, ValueT, Allocator>::seals = 0;
+
+//growth is incremental: an insert migrates at most migrationStep buckets in
+//index order plus the old bucket of its key, and every old bucket is migrated
+//exactly once. the latency this buys is measured by the growth benchmark
+BOOST_AUTO_TEST_CASE(TSMap_growth_is_incremental)
+{
+    typedef SealCountingBucket<uint64_t, uint64_t> bucket_type;
+    typedef TSMap::TSMap<uint64_t, uint64_t, TSMap::hash<uint64_t>, std::equal_to<uint64_t>,
+                         std::allocator<TSMap::pair<uint64_t, uint64_t> >, bucket_type> map_type;
+    const size_t step = map_type::migrationStep;
+    map_type map(16);
+    bucket_type::seals = 0;
+
+    size_t maxSeals = 0, growths = 0, buckets = map.bucketCount();
+    for(uint64_t i=0;i<100000;++i)
+    {
+        auto before = bucket_type::seals;
+        map.insert(i, i);
+        maxSeals = std::max(maxSeals, bucket_type::seals - before);
+        if(map.bucketCount() != buckets)
+        {
+            ++growths;
+            buckets = map.bucketCount();
+        }
+    }
+
+    BOOST_TEST(growths >= 10u);
+    BOOST_TEST(maxSeals > 0u);
+    BOOST_TEST(maxSeals <= step+1);
+
+    //stats() finishes the running migration: 16 + 32 + ... + buckets/2
+    map.stats();
+    BOOST_TEST(bucket_type::seals == map.bucketCount() - 16);
+    BOOST_TEST(map.size() == 100000u);
+    BOOST_TEST(map[99999] == 99999u);
+}
+
+//a migration step that fails is retried by the next insert, not skipped:
+//otherwise the old table would never be drained and the map never grow again
+BOOST_AUTO_TEST_CASE(TSMap_failed_migration_step_is_retried)
+{
+    using string = std::string;
+    typedef FailingAllocator<TSMap::pair<string, string> > allocator_type;
+    typedef SealCountingBucket<string, string, allocator_type> bucket_type;
+    TSMap::TSMap<string, string, TSMap::hash<string>, std::equal_to<string>,
+                 allocator_type, bucket_type> map(4);
+    auto key = [](uint64_t i){ return makeKey(i, string()); };
+    uint64_t keys = 0;
+    while(map.bucketCount() == 4) map.insert(key(keys), key(keys)), ++keys;
+    bucket_type::seals = 0;
+
+    //the old bucket of key 0 is migrated on demand, so that updating key 0
+    //only runs the migration step, which fails on the next old bucket
+    BOOST_TEST(map.count(key(0)) == 1u);
+    BOOST_TEST(bucket_type::seals == 1u);
+    failAllocations = true;
+    BOOST_CHECK_THROW(map.insert(key(0), key(0)), std::bad_alloc);
+    failAllocations = false;
+
+    //4 old buckets, one step migrates all that are left
+    map.insert(key(0), key(0));
+    BOOST_TEST(bucket_type::seals == 4u);
+    BOOST_TEST(map.size() == keys);
+    for(uint64_t i=0;i<keys;++i) BOOST_TEST(map.find(key(i)).value_or("") == key(i));
+
+    //the old table is gone: the map grows again
+    auto buckets = map.bucketCount();
+    for(uint64_t i=keys;map.bucketCount() == buckets && i<keys+1000;++i) map.insert(key(i), key(i));
+    BOOST_TEST(map.bucketCount() == 2*buckets);
+}
+
+//a batch insert reports a failed migration step like a single insert does
+BOOST_AUTO_TEST_CASE(TSMap_insert_many_reports_failed_migration)
+{
+    using string = std::string;
+    typedef TSMap::pair<string, string> entry;
+    TSMap::TSMap<string, string, TSMap::hash<string>, std::equal_to<string>,
+                 FailingAllocator<entry> > map(4);
+    auto key = [](uint64_t i){ return makeKey(i, string()); };
+    uint64_t keys = 0;
+    while(map.bucketCount() == 4) map.insert(key(keys), key(keys)), ++keys;
+
+    //as in TSMap_failed_migration_step_is_retried: only the step fails
+    BOOST_TEST(map.count(key(0)) == 1u);
+    std::vector<entry> batch(1, entry(key(0), key(0)));
+    failAllocations = true;
+    BOOST_CHECK_THROW(map.insertMany(batch.begin(), batch.end()), std::bad_alloc);
+    failAllocations = false;
+
+    map.insertMany(batch.begin(), batch.end());
+    BOOST_TEST(map.size() == keys);
+    for(uint64_t i=0;i<keys;++i) BOOST_TEST(map.find(key(i)).value_or("") == key(i));
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,10 +2,28 @@
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <atomic>
 #include <functional>
 #include <stdexcept>
 #include <condition_variable>
+#include <exception>
+#include <fstream>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <shared_mutex>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
 #include <KVPairList.hpp>
+#include <TaggedKVPairList.hpp>
+#include <IntegralKVPairList.hpp>
+#include <Hash.hpp>
+#include <Padded.hpp>
+#include <Arena.hpp>
+#include <Persist.hpp>
+#include <Future.hpp>
 
 namespace TSMap
 {
@@ -15,41 +33,416 @@ namespace TSMap
  *
  * takes a key and its corresponding value
  *
- * this map uses std::hash for hashing, but one can use own hash function if
- * desired.
+ * keys are hashed with Hash, TSMap::hash by default (see Hash.hpp), and
+ * compared with KeyEqual. a custom Hash should spread its values over all
+ * bits: the bucket index is taken from the top bits of hash * 2^64/phi.
  *
  * NOTE: thread safety is guaranteed at the bucket level. thus no thread guard
  * on the map level
  *
- * resizing is automatic as insertion is delegated to underlying KVPairList,
- * which resizes automatically.
+ * resizing is automatic: each KVPairList resizes itself, and the table of
+ * buckets doubles once the average number of entries per bucket exceeds the
+ * max load factor. the entries are moved to the new table incrementally, see
+ * Table below.
+ *
+ * the default bucket type is utility::KVPairList, or the structure-of-arrays
+ * utility::IntegralKVPairList for integral keys compared with std::equal_to
+ * (see utility::DefaultBucket). it can be swapped through BucketT, e.g.
+ * utility::TaggedKVPairList<KeyT, ValueT> for open addressing with per-slot
+ * hash tags instead of a linear scan, or
+ * utility::KVPairList<KeyT, ValueT, std::shared_timed_mutex> for read-mostly
+ * workloads, where count() and lookup() then only take the bucket lock shared.
+ * any type with the KVPairList interface (including the unsynchronized
+ * *Unlocked methods) works. the bucket does the key comparisons, so a custom
+ * BucketT should be given the same KeyEqual.
+ *
+ * insertAsync, eraseAsync and upsertWithAsync queue a write and return a
+ * future instead of waiting for the bucket lock: a thread that finds the
+ * queue of the key busy leaves the write to the thread working on it, which
+ * applies all queued writes of a bucket under one lock acquisition (flat
+ * combining). see insertAsync.
+ *
+ * Allocator allocates the bucket arrays of the tables and, passed to every
+ * bucket on construction, the entry arrays of the buckets. a stateful
+ * allocator is copied from the one given to the constructor, e.g.
+ * utility::ArenaAllocator, whose copies share one arena per map.
  *
  */
-template <typename KeyT, typename ValueT>
+template <typename KeyT, typename ValueT,
+          typename Hash = ::TSMap::hash<KeyT>,
+          typename KeyEqual = std::equal_to<KeyT>,
+          typename Allocator = std::allocator<pair<KeyT, ValueT> >,
+          typename BucketT = typename utility::DefaultBucket<KeyT, ValueT, std::mutex, KeyEqual, Allocator>::type>
 class TSMap
 {
 private:
-    //array of buckets (key-value pairs) for same hash
-    std::shared_ptr<utility::KVPairList<KeyT, ValueT> > buckets;
-    //number of buckets:
-    size_t tableSize;
-    std::hash<KeyT> hashFunc;
+    /**
+     * a bucket array of fixed size.
+     *
+     * growing the map publishes a table twice the size of the current one,
+     * which keeps a pointer to its predecessor until all buckets of the
+     * predecessor have been migrated. an old bucket is migrated under its own
+     * lock, then sealed; the entries of old bucket i can only land in new
+     * buckets 2i and 2i+1, so no operation on a new bucket can run before the
+     * old bucket feeding it has been sealed. every operation migrates the
+     * old bucket of its key on demand, and every insert additionally migrates
+     * a few buckets in index order, so the table is fully migrated well before
+     * the next growth is due and no single operation moves the whole table.
+     *
+     * tables are published through plain atomic pointers: std::atomic_load on
+     * a shared_ptr goes through a global lock pool in libstdc++ and would
+     * serialize every operation of every map. a superseded table may still be
+     * read by a thread that loaded it before the swap, so it stays owned by
+     * its successor (retired) until the map is destroyed. its buckets are
+     * empty by then, so this costs one bucket array per doubling.
+     */
+    struct Table
+    {
+        //number of buckets, a power of two
+        size_t size;
+        //64 - log2(size), at most 63
+        unsigned shift;
+        //size-1, makes a size of 1 work with shift 63
+        size_t mask;
+        //allocates storage
+        typename std::allocator_traits<Allocator>::template rebind_alloc<unsigned char> storageAllocator;
+        //memory of the bucket array, with room to align an over-aligned BucketT
+        unsigned char *storage;
+        //array of buckets (key-value pairs) for same hash, aligned as
+        //BucketT requires (operator new does not before c++17)
+        BucketT *buckets;
+        //table being migrated into this one, nullptr once done
+        std::atomic<Table*> previous;
+        //owns the table this one replaced
+        std::unique_ptr<Table> retired;
+        //next bucket to migrate in index order (only used on previous tables)
+        std::atomic<size_t> migrateCursor;
+        //number of buckets sealed so far (only used on previous tables)
+        std::atomic<size_t> migratedCount;
+        //per bucket: its entries are still only in the file mapped by load().
+        //nullptr unless the table was loaded. guarded by the bucket locks.
+        std::unique_ptr<bool[]> imageBacked;
+        //bucket directory and entries of that file
+        const uint64_t *imageOffsets;
+        pair<KeyT, ValueT> *imageEntries;
+
+        Table(size_t size, size_t bucketCapacity, const Allocator &allocator) :
+            size(size),
+            shift(size > 1 ? 64 - log2(size) : 63),
+            mask(size-1),
+            storageAllocator(allocator),
+            storage(storageAllocator.allocate(storageSize())),
+            buckets(nullptr),
+            previous(nullptr),
+            migrateCursor(0),
+            migratedCount(0),
+            imageOffsets(nullptr),
+            imageEntries(nullptr)
+        {
+            auto address = reinterpret_cast<uintptr_t>(storage);
+            address = (address + alignof(BucketT) - 1) & ~(uintptr_t)(alignof(BucketT) - 1);
+            buckets = reinterpret_cast<BucketT*>(address);
+            for(size_t i=0;i<size;++i)
+            {
+                new (&buckets[i]) BucketT(allocator);
+                if(bucketCapacity > 0) buckets[i].reserveUnlocked(bucketCapacity);
+            }
+        }
+
+        ~Table()
+        {
+            for(size_t i=0;i<size;++i)
+            {
+                buckets[i].~BucketT();
+            }
+            storageAllocator.deallocate(storage, storageSize());
+        }
+
+        /**
+         * allocators align to max_align_t. only a bucket type aligned beyond
+         * that, e.g. utility::Padded, gets room to be placed by hand
+         */
+        static const size_t alignmentSlack =
+            alignof(BucketT) > alignof(std::max_align_t) ? alignof(BucketT) : 0;
+
+        size_t storageSize() const
+        {
+            return size*sizeof(BucketT) + alignmentSlack;
+        }
+
+        /**
+         * fibonacci hashing: the top bits of hash * 2^64/phi. one
+         * multiplication and a shift instead of a division, and the index
+         * depends on all bits of the hash.
+         */
+        size_t indexOf(size_t hash) const
+        {
+            return (size_t)(((uint64_t)hash * 0x9e3779b97f4a7c15ULL) >> shift) & mask;
+        }
+
+        static unsigned log2(size_t size)
+        {
+            return 63 - __builtin_clzll(size);
+        }
+
+        BucketT & bucket(size_t hash)
+        {
+            return buckets[indexOf(hash)];
+        }
+    };
+
+    //current table, owned by the map
+    std::atomic<Table*> table;
+    //number of entries in the map
+    std::atomic<size_t> elementCount;
+    //entries per bucket that trigger growth. 0 disables growth
+    std::atomic<float> maxLoadFactor;
+    //serializes publishing new tables
+    std::mutex growMutex;
+    //tables published by grow(), guarded by growMutex
+    TSMAP_STATS(size_t growths = 0;)
+    Hash hashFunc;
+    KeyEqual keyEqual;
+    Allocator allocator;
+
+    //groups of a batch operation whose buckets are prefetched ahead
+    std::atomic<size_t> prefetchDistance;
+
+    //live snapshots, see snapshot()
+    struct SnapshotState;
+    SnapshotState *snapshots;
+    //length of snapshots, checked by every write
+    std::atomic<size_t> snapshotCount;
+    //guards snapshots
+    std::shared_timed_mutex snapshotMutex;
+    //file the table was loaded from, see load()
+    std::unique_ptr<utility::MappedFile> image;
+
+    /**
+     * a write queued by insertAsync and friends, and the state of its
+     * future. apply() runs under the lock of the key's bucket, the result is
+     * published once the lock is released.
+     */
+    struct PendingWrite : utility::FutureState<bool>
+    {
+        //next write of the queue: older while queued, newer once taken
+        PendingWrite *next;
+        size_t hash;
+        KeyT key;
+        //value of the future: inserted or erased
+        bool result;
+        //change of the number of entries: -1, 0 or 1
+        int delta;
+        std::exception_ptr error;
+
+        PendingWrite(KeyT &&key, size_t hash) :
+            utility::FutureState<bool>(2),
+            next(nullptr),
+            hash(hash),
+            key(std::move(key)),
+            result(false),
+            delta(0)
+        {}
+
+        virtual void apply(BucketT &bucket) = 0;
+    };
+
+    struct PendingInsert : PendingWrite
+    {
+        ValueT value;
+
+        PendingInsert(KeyT &&key, ValueT &&value, size_t hash) :
+            PendingWrite(std::move(key), hash),
+            value(std::move(value))
+        {}
+
+        void apply(BucketT &bucket) override
+        {
+            this->result = bucket.upsertUnlocked(
+                    pair<KeyT, ValueT>(std::move(this->key), std::move(value)), this->hash);
+            this->delta = this->result ? 1 : 0;
+        }
+    };
+
+    struct PendingErase : PendingWrite
+    {
+        PendingErase(KeyT &&key, size_t hash) :
+            PendingWrite(std::move(key), hash)
+        {}
+
+        void apply(BucketT &bucket) override
+        {
+            this->result = bucket.eraseUnlocked(this->key, this->hash);
+            this->delta = this->result ? -1 : 0;
+        }
+    };
+
+    template <typename FuncT>
+    struct PendingUpsertWith : PendingWrite
+    {
+        FuncT fn;
+
+        PendingUpsertWith(KeyT &&key, FuncT &&fn, size_t hash) :
+            PendingWrite(std::move(key), hash),
+            fn(std::move(fn))
+        {}
+
+        void apply(BucketT &bucket) override
+        {
+            auto value = bucket.findUnlocked(this->key, this->hash);
+            this->result = !value;
+            if(!value)
+            {
+                value = bucket.insertUnlocked(pair<KeyT, ValueT>(this->key, ValueT()), this->hash);
+                this->delta = 1;
+            }
+            fn(*value);
+        }
+    };
+
+    /**
+     * queue of the asynchronous writes of a stripe of keys: a lock-free
+     * stack, newest first, and the flag of the thread applying them
+     */
+    struct alignas(utility::cacheLineSize) CombiningSlot
+    {
+        std::atomic<PendingWrite*> pending;
+        std::atomic<bool> combining;
+
+        CombiningSlot() :
+            pending(nullptr),
+            combining(false)
+        {}
+    };
+
+    struct CombiningSlots
+    {
+        std::unique_ptr<unsigned char[]> storage;
+        //combiningSlotCount slots in storage, aligned to cache lines
+        CombiningSlot *slots;
+
+        CombiningSlots() :
+            storage(new unsigned char[combiningSlotCount*sizeof(CombiningSlot) + alignof(CombiningSlot)])
+        {
+            auto address = reinterpret_cast<uintptr_t>(storage.get());
+            address = (address + alignof(CombiningSlot) - 1) & ~(uintptr_t)(alignof(CombiningSlot) - 1);
+            slots = reinterpret_cast<CombiningSlot*>(address);
+            for(size_t i=0;i<combiningSlotCount;++i) new (&slots[i]) CombiningSlot();
+        }
+    };
+
+    //queues of the asynchronous writes, created by the first one
+    std::atomic<CombiningSlots*> combiningSlots;
+    //number of queues: the keys of a queue fall into a 1/256 of the buckets
+    static const size_t combiningSlotCount = 256;
+
+    //a key of a batch operation: its hash, the next key of the batch in the
+    //same bucket, and (independent of the key) the keys still to process
+    struct BatchSlot
+    {
+        size_t hash;
+        uint32_t next;
+        uint32_t pending;
+    };
+
+    //keys of a batch operation that fall into one bucket, linked through
+    //BatchSlot::next in batch order
+    struct BatchGroup
+    {
+        size_t index;
+        uint32_t head;
+        uint32_t tail;
+    };
+
+    typedef typename BucketT::mutex_type bucket_mutex;
+    typedef typename BucketT::read_lock bucket_read_lock;
+
+    //entries of one bucket as of a snapshot, taken by the first writer of
+    //the bucket or by the snapshot's reader, whichever comes first
+    struct BucketCopy
+    {
+        std::unique_ptr<pair<KeyT, ValueT>[]> entries;
+        size_t count;
+        bool taken;
+
+        BucketCopy() : count(0), taken(false)
+        {}
+
+        //caller holds the lock of bucket index of t
+        void take(Table &t, size_t index)
+        {
+            copyFrom(t, index, std::is_copy_assignable<pair<KeyT, ValueT> >());
+            taken = true;
+        }
+
+        void copyFrom(Table &t, size_t index, std::true_type)
+        {
+            auto size = entryCountUnlocked(t, index);
+            if(size == 0) return;
+            entries.reset(new pair<KeyT, ValueT>[size]);
+            forEachEntryUnlocked(t, index, [&](auto &kv)
+            {
+                entries[count].first = kv.first;
+                entries[count].second = kv.second;
+                ++count;
+            });
+        }
+
+        //move-only entries: snapshot() does not compile, nothing to copy
+        void copyFrom(Table &, size_t, std::false_type)
+        {}
+    };
+
+    //a snapshot of the buckets of one table. copies[i] is guarded by the
+    //lock of bucket i.
+    struct SnapshotState
+    {
+        Table *table;
+        std::unique_ptr<BucketCopy[]> copies;
+        SnapshotState *next;
+        bool iterated;
+
+        SnapshotState(Table *table) :
+            table(table),
+            copies(new BucketCopy[table->size]),
+            next(nullptr),
+            iterated(false)
+        {}
+    };
 
 public:
+    //the bucket type in use, see utility::DefaultBucket
+    typedef BucketT bucket_type;
+
+    //buckets of a growing map migrated in index order per insert, on top of
+    //the old bucket of the inserted key
+    static const size_t migrationStep = 4;
+
     /**
      * default constructor: set bucket size to 128
      */
     TSMap() : TSMap(128)
     {}
 
-    TSMap(size_t tableSize) :
-        buckets(new utility::KVPairList<KeyT, ValueT>[tableSize](),
-                std::default_delete<utility::KVPairList<KeyT, ValueT>[] >()),
-        tableSize(tableSize)
+    /**
+     * tableSize is rounded up to a power of two
+     */
+    TSMap(size_t tableSize, const Allocator &allocator = Allocator()) :
+        table(new Table(roundUpTableSize(tableSize), 0, allocator)),
+        elementCount(0),
+        maxLoadFactor(4.0f),
+        allocator(allocator),
+        prefetchDistance(4),
+        snapshots(nullptr),
+        snapshotCount(0),
+        combiningSlots(nullptr)
     {}
 
     ~TSMap()
-    {}
+    {
+        delete table.load();
+        delete combiningSlots.load();
+    }
 
     /**
      * delete element by key
@@ -59,8 +452,13 @@ public:
      */
     void deleteByKey(const KeyT& key)
     {
-        auto hashKey = hashFunc(key) % tableSize;
-        buckets.get()[hashKey].erase(key);
+        auto hash = hashFunc(key);
+        withBucket(hash, [&](BucketT &bucket)
+        {
+            //counted under the bucket lock so that the count never drops
+            //below zero
+            if(bucket.eraseUnlocked(key, hash)) --elementCount;
+        });
     }
 
     /**
@@ -74,7 +472,10 @@ public:
      */
     size_t count(const KeyT& key)
     {
-        return buckets.get()[hashFunc(key)%tableSize].count(key);
+        return withValueShared(key, [&](ValueT *value) -> size_t
+        {
+            return value ? 1 : 0;
+        });
     }
 
     /**
@@ -87,21 +488,61 @@ public:
      */
     void insert(const KeyT &key, const ValueT &value)
     {
-        auto hashKey = hashFunc(key) % tableSize;
+        emplace(key, value);
+    }
+
+    /**
+     * insert an entry by key to map, moving key and value into the bucket
+     *
+     * params: key and value
+     */
+    void insert(KeyT &&key, ValueT &&value)
+    {
+        emplace(std::move(key), std::move(value));
+    }
+
+    /**
+     * insert an entry constructed in place from args, which are forwarded to
+     * the constructor of pair<KeyT, ValueT>. like insert, replaces the value
+     * if the key exists.
+     *
+     * the entry is built once and then moved into the bucket, so no copy of
+     * key or value is made on the way.
+     */
+    template <typename... Args>
+    void emplace(Args&&... args)
+    {
+        pair<KeyT, ValueT> kv(std::forward<Args>(args)...);
+        auto hash = hashFunc(kv.first);
         //insert to corresponding bucket
-        buckets.get()[hashKey].upsert(make_pair(key, value));
+        auto inserted = withBucket(hash, [&](BucketT &bucket)
+        {
+            auto inserted = bucket.upsertUnlocked(std::move(kv), hash);
+            if(inserted) ++elementCount;
+            return inserted;
+        });
+        afterInsert(inserted);
     }
 
     /**
      * lookup(access) an element in map
      *
+     * the reference is only safe to use as long as no other thread writes to
+     * the map: a concurrent insert may resize or migrate the bucket and free
+     * the entry under it. prefer find() or update() with concurrent writers.
+     *
      * param: key of element to be looked up
      * returns element if exists, otherwise throw an exception.
      */
     ValueT& lookup(const KeyT &key)
     {
-        auto hashKey = hashFunc(key) % tableSize;
-        return buckets.get()[hashKey][key];
+        auto value = withValueShared(key, [&](ValueT *value)
+        {
+            return value;
+        });
+        if(value) return *value;
+        //this is why one should check for validity first using .count()
+        throw new std::invalid_argument("invalid key given in TSMap");
     }
 
     /**
@@ -116,6 +557,616 @@ public:
         return lookup(key);
     }
 
+    /**
+     * non-throwing lookup
+     *
+     * param: key of element to be looked up
+     * returns a copy of the element taken under the bucket lock, or an empty
+     * optional if the key is not in the map.
+     */
+    optional<ValueT> find(const KeyT &key)
+    {
+        return withValueShared(key, [&](ValueT *value)
+        {
+            return value ? optional<ValueT>(*value) : optional<ValueT>();
+        });
+    }
+
+    /**
+     * applies fn(ValueT&) to the element with key under the bucket lock, if it
+     * exists. fn must not access the map.
+     *
+     * params: key of element and function to apply
+     * returns true if the key was found
+     */
+    template <typename FuncT>
+    bool update(const KeyT &key, FuncT fn)
+    {
+        auto hash = hashFunc(key);
+        return withBucket(hash, [&](BucketT &bucket)
+        {
+            auto value = bucket.findUnlocked(key, hash);
+            if(!value) return false;
+            fn(*value);
+            return true;
+        });
+    }
+
+    /**
+     * applies fn(ValueT&) to the element with key under the bucket lock,
+     * inserting a default constructed element first if the key is absent.
+     * a read-modify-write in one lock acquisition, e.g. for counters:
+     *
+     *     map.upsertWith(key, [](int &count){ ++count; });
+     *
+     * fn must not access the map.
+     *
+     * params: key of element and function to apply
+     * returns true if the key was inserted
+     */
+    template <typename FuncT>
+    bool upsertWith(const KeyT &key, FuncT fn)
+    {
+        auto hash = hashFunc(key);
+        auto inserted = withBucket(hash, [&](BucketT &bucket)
+        {
+            auto value = bucket.findUnlocked(key, hash);
+            auto inserted = !value;
+            if(inserted)
+            {
+                value = bucket.insertUnlocked(pair<KeyT, ValueT>(key, ValueT()), hash);
+                ++elementCount;
+            }
+            fn(*value);
+            return inserted;
+        });
+        afterInsert(inserted);
+        return inserted;
+    }
+
+    /**
+     * batch insert: upserts every element of [first, last), which holds
+     * pair-like elements (.first key, .second value), e.g. TSMap::pair or
+     * std::pair. the keys are hashed up front and grouped by bucket, so each
+     * bucket lock is taken once per batch instead of once per key. with
+     * std::make_move_iterator keys and values are moved into the map.
+     *
+     * like a sequence of insert() calls, a key that appears twice ends up
+     * with its last value. the batch is not atomic: other threads may see
+     * some of its entries before others.
+     *
+     * params: random access iterators to the elements
+     */
+    template <typename RandomIt>
+    void insertMany(RandomIt first, RandomIt last)
+    {
+        auto count = (size_t)(last - first);
+        if(count == 0) return;
+        size_t inserted = 0;
+        forEachGroup<std::unique_lock<bucket_mutex>, true>(count,
+            [&](size_t position){ return hashFunc(first[position].first); },
+            [&](Table &t, size_t index, size_t position, size_t hash)
+            {
+                auto &bucket = t.buckets[index];
+                auto &&kv = first[position];
+                if(bucket.upsertUnlocked(pair<KeyT, ValueT>(
+                        std::forward<decltype(kv)>(kv).first,
+                        std::forward<decltype(kv)>(kv).second), hash))
+                {
+                    ++elementCount;
+                    ++inserted;
+                }
+            });
+        //same migration and growth bookkeeping as the single inserts
+        afterInsert(inserted > 0);
+        for(size_t i=1;i<inserted;++i) afterInsert(true);
+    }
+
+    /**
+     * batch lookup: out[i] is set to a copy of the value of first[i] taken
+     * under the bucket lock, or to an empty optional if the key is not in the
+     * map. keys are grouped by bucket as in insertMany.
+     *
+     * params: random access iterators to the keys, random access iterator to
+     * at least last-first writable TSMap::optional<ValueT>
+     * returns the number of keys found
+     */
+    template <typename RandomIt, typename OutputIt>
+    size_t lookupMany(RandomIt first, RandomIt last, OutputIt out)
+    {
+        auto count = (size_t)(last - first);
+        size_t found = 0;
+        forEachGroup<bucket_read_lock, false>(count,
+            [&](size_t position){ return hashFunc(first[position]); },
+            [&](Table &t, size_t index, size_t position, size_t hash)
+            {
+                auto value = findUnlocked(t, index, first[position], hash);
+                if(value)
+                {
+                    out[position] = optional<ValueT>(*value);
+                    ++found;
+                }
+                else
+                {
+                    out[position] = optional<ValueT>();
+                }
+            });
+        return found;
+    }
+
+    /**
+     * batch delete, keys are grouped by bucket as in insertMany
+     *
+     * params: random access iterators to the keys
+     * returns the number of entries removed
+     */
+    template <typename RandomIt>
+    size_t eraseMany(RandomIt first, RandomIt last)
+    {
+        auto count = (size_t)(last - first);
+        size_t erased = 0;
+        forEachGroup<std::unique_lock<bucket_mutex>, true>(count,
+            [&](size_t position){ return hashFunc(first[position]); },
+            [&](Table &t, size_t index, size_t position, size_t hash)
+            {
+                if(t.buckets[index].eraseUnlocked(first[position], hash))
+                {
+                    --elementCount;
+                    ++erased;
+                }
+            });
+        return erased;
+    }
+
+    /**
+     * asynchronous insert: queues the write and returns a future that becomes
+     * ready once it has been applied, with true if the key was new.
+     *
+     * the writes are queued in stripes of keys. the thread that queues a
+     * write into an idle stripe applies the queued writes of that stripe
+     * before it returns, all writes of a bucket under one lock acquisition,
+     * and repeats while writes keep arriving. a thread that finds a stripe
+     * busy returns right away and leaves its write to that thread. many
+     * writers of a few hot keys thus take turns at the lock instead of
+     * queueing up on it, and the lock stays with the cache of one core.
+     *
+     * asynchronous writes of the same key are applied in the order they were
+     * queued. relative to the synchronous operations a write takes effect
+     * at some point before its future becomes ready. an exception thrown
+     * while applying it is delivered through the future.
+     *
+     * params: key and value
+     */
+    future<bool> insertAsync(KeyT key, ValueT value)
+    {
+        auto hash = hashFunc(key);
+        return submit(new PendingInsert(std::move(key), std::move(value), hash));
+    }
+
+    /**
+     * asynchronous deleteByKey, see insertAsync. the future is true if the
+     * key was removed.
+     */
+    future<bool> eraseAsync(KeyT key)
+    {
+        auto hash = hashFunc(key);
+        return submit(new PendingErase(std::move(key), hash));
+    }
+
+    /**
+     * asynchronous upsertWith, see insertAsync. fn(ValueT&) runs under the
+     * bucket lock on the thread applying the write, so it must not access the
+     * map and must not refer to objects that may be gone by then. the future
+     * is true if the key was inserted.
+     */
+    template <typename FuncT>
+    future<bool> upsertWithAsync(KeyT key, FuncT fn)
+    {
+        auto hash = hashFunc(key);
+        return submit(new PendingUpsertWith<FuncT>(std::move(key), std::move(fn), hash));
+    }
+
+    /**
+     * number of entries in map
+     */
+    size_t size() const
+    {
+        return elementCount.load();
+    }
+
+    /**
+     * number of buckets in the current table
+     */
+    size_t bucketCount() const
+    {
+        return table.load()->size;
+    }
+
+    /**
+     * copy of the allocator the map was constructed with
+     */
+    Allocator getAllocator() const
+    {
+        return allocator;
+    }
+
+    /**
+     * sets the average number of entries per bucket above which the table
+     * doubles. 0 disables growth, the table then keeps its initial size.
+     */
+    void setMaxLoadFactor(float loadFactor)
+    {
+        maxLoadFactor = loadFactor;
+    }
+
+    /**
+     * sets how many bucket groups ahead the batch operations prefetch the
+     * bucket they will lock next. 0 disables prefetching.
+     */
+    void setPrefetchDistance(size_t groups)
+    {
+        prefetchDistance = groups;
+    }
+
+    /**
+     * drops the tombstones left by erasures in every bucket, keeping the
+     * bucket capacities. buckets erase lazily and only compact once
+     * tombstones dominate, this forces it, e.g. before a read-heavy phase.
+     *
+     * runs bucket by bucket, holding one bucket lock at a time, so the map
+     * stays usable meanwhile. buckets of a table that is being migrated are
+     * skipped, their entries are rebuilt by the migration anyway.
+     */
+    void compact()
+    {
+        forEachBucket<std::unique_lock<bucket_mutex> >([](BucketT &bucket)
+        {
+            bucket.compactUnlocked();
+        });
+    }
+
+    /**
+     * like compact, but also shrinks every bucket to its valid size and
+     * releases the memory of empty buckets, e.g. after a bulk erase.
+     */
+    void shrinkToFit()
+    {
+        forEachBucket<std::unique_lock<bucket_mutex> >([](BucketT &bucket)
+        {
+            bucket.shrinkToFitUnlocked();
+        });
+    }
+
+    /**
+     * number of entry slots allocated by the buckets of the current table
+     */
+    size_t capacity()
+    {
+        size_t slots = 0;
+        forEachBucket<bucket_read_lock>([&](BucketT &bucket)
+        {
+            slots += bucket.capacityUnlocked();
+        });
+        return slots;
+    }
+
+    /**
+     * how the entries are spread over the buckets of the current table (a
+     * histogram of bucket sizes, capacity and tombstones) and, with
+     * TSMAP_ENABLE_STATS, the summed lock, search and resize counters of all
+     * buckets, see utility::MapStats. e.g. a table sized from real data:
+     *
+     *     auto stats = map.stats();
+     *     std::cout<<stats;
+     *     TSMap<K, V> next(stats.totals.size/4);
+     *
+     * finishes a running table migration first, then reads one bucket at a
+     * time under its read lock. the counters include the acquisitions made
+     * by stats() itself.
+     */
+    utility::MapStats stats()
+    {
+        utility::MapStats stats;
+        std::lock_guard<std::mutex> growLock(growMutex);
+        auto current = table.load();
+        auto previous = current->previous.load();
+        if(previous)
+        {
+            for(size_t i=0;i<previous->size;++i)
+            {
+                migrateBucket(*current, *previous, i);
+            }
+        }
+        for(size_t i=0;i<current->size;++i)
+        {
+            bucket_read_lock lock(current->buckets[i].getMutex());
+            auto bucket = current->buckets[i].statsUnlocked();
+            bucket.size = entryCountUnlocked(*current, i);
+            stats.addBucket(bucket);
+        }
+        TSMAP_STATS(
+            stats.growths = growths;
+            for(auto t=current->retired.get();t;t=t->retired.get())
+            {
+                for(size_t i=0;i<t->size;++i)
+                {
+                    bucket_read_lock lock(t->buckets[i].getMutex());
+                    stats.totals.addCounters(t->buckets[i].statsUnlocked());
+                }
+            }
+        )
+        return stats;
+    }
+
+    /**
+     * calls fn(const KeyT&, const ValueT&) once for every entry, bucket by
+     * bucket under each bucket's lock, so a writer only waits while its own
+     * bucket is visited. weakly consistent: entries present during the whole
+     * call are visited exactly once, entries inserted or erased meanwhile may
+     * or may not be. use snapshot() for a point-in-time view.
+     *
+     * fn must not access the map.
+     */
+    template <typename FuncT>
+    void forEach(FuncT fn)
+    {
+        auto current = table.load();
+        for(size_t i=0;i<current->size;++i)
+        {
+            visitBucket(current, i, fn);
+        }
+    }
+
+    /**
+     * a point-in-time view of the map, see snapshot()
+     */
+    class Snapshot
+    {
+    public:
+        Snapshot(Snapshot &&rhs) :
+            map(rhs.map),
+            state(rhs.state)
+        {
+            rhs.state = nullptr;
+        }
+
+        Snapshot(const Snapshot &) = delete;
+        Snapshot & operator=(const Snapshot &) = delete;
+
+        ~Snapshot()
+        {
+            if(state) map->releaseSnapshot(state);
+        }
+
+        /**
+         * calls fn(const KeyT&, const ValueT&) for every entry the map held
+         * when the snapshot was taken. no lock of the map is held while fn
+         * runs, so fn may use the map.
+         *
+         * every bucket is dropped from the snapshot once visited, so a
+         * snapshot can only be iterated once.
+         */
+        template <typename FuncT>
+        void forEach(FuncT fn)
+        {
+            forEachCopy([&](size_t, const pair<KeyT, ValueT> *entries, size_t count)
+            {
+                for(size_t j=0;j<count;++j)
+                {
+                    fn(entries[j].first, entries[j].second);
+                }
+            });
+        }
+
+    private:
+        friend class TSMap;
+
+        /**
+         * calls fn(index, entries, count) with the entries of every bucket
+         * of the snapshot's table, in bucket order
+         */
+        template <typename FuncT>
+        void forEachCopy(FuncT fn)
+        {
+            if(state->iterated)
+            {
+                throw new std::logic_error("TSMap snapshot iterated twice");
+            }
+            state->iterated = true;
+            auto &snapshotTable = *state->table;
+            for(size_t i=0;i<snapshotTable.size;++i)
+            {
+                auto &copy = state->copies[i];
+                {
+                    bucket_read_lock lock(snapshotTable.buckets[i].getMutex());
+                    if(!copy.taken) copy.take(snapshotTable, i);
+                }
+                const pair<KeyT, ValueT> *entries = copy.entries.get();
+                fn(i, entries, copy.count);
+                copy.entries.reset();
+                copy.count = 0;
+            }
+        }
+
+        size_t bucketCount() const
+        {
+            return state->table->size;
+        }
+
+        Snapshot(TSMap &map, SnapshotState *state) :
+            map(&map),
+            state(state)
+        {}
+
+        TSMap *map;
+        SnapshotState *state;
+    };
+
+    /**
+     * takes a consistent snapshot: Snapshot::forEach visits exactly the
+     * entries the map held when snapshot() returned, however the map is
+     * written meanwhile.
+     *
+     * copy-on-write per bucket: the first write to a bucket after the
+     * snapshot copies the bucket's entries into the snapshot, and the reader
+     * copies every bucket it has not got that way when it gets there. no lock
+     * is held for the duration of an iteration, a writer waits for at most
+     * the copy of its own bucket, once per snapshot. writes cost one atomic
+     * load extra while no snapshot is alive.
+     *
+     * taking the snapshot finishes a running table migration and takes every
+     * bucket lock once, so that it waits for the writes in flight.
+     *
+     * the snapshot must not outlive the map.
+     */
+    Snapshot snapshot()
+    {
+        static_assert(std::is_copy_assignable<pair<KeyT, ValueT> >::value,
+                      "snapshots copy the entries");
+        std::unique_ptr<SnapshotState> state;
+        //no new table while the snapshot is set up
+        std::lock_guard<std::mutex> growLock(growMutex);
+        auto current = table.load();
+        auto previous = current->previous.load();
+        if(previous)
+        {
+            for(size_t i=0;i<previous->size;++i)
+            {
+                migrateBucket(*current, *previous, i);
+            }
+        }
+
+        state.reset(new SnapshotState(current));
+        {
+            std::lock_guard<std::shared_timed_mutex> lock(snapshotMutex);
+            state->next = snapshots;
+            snapshots = state.get();
+        }
+        ++snapshotCount;
+        //a write that missed snapshotCount still holds its bucket lock
+        for(size_t i=0;i<current->size;++i)
+        {
+            std::lock_guard<bucket_mutex> lock(current->buckets[i].getMutex());
+        }
+        return Snapshot(*this, state.release());
+    }
+
+    /**
+     * writes the map to path in a binary format for load(): a bucket
+     * directory and the packed entries, see utility::ImageHeader. the
+     * entries are taken from a snapshot, so writers may keep going. the file
+     * is written under a temporary name and renamed into place when complete.
+     *
+     * only for trivially copyable keys and values.
+     *
+     * throws std::runtime_error* if the file cannot be written
+     */
+    void save(const std::string &path)
+    {
+        static_assert(std::is_trivially_copyable<pair<KeyT, ValueT> >::value,
+                      "save and load copy the entries bytewise");
+        auto view = snapshot();
+        auto bucketCount = view.bucketCount();
+
+        utility::ImageHeader header;
+        std::memset(&header, 0, sizeof(header));
+        std::memcpy(header.magic, utility::imageMagic, sizeof(header.magic));
+        header.keySize = sizeof(KeyT);
+        header.valueSize = sizeof(ValueT);
+        header.entrySize = sizeof(pair<KeyT, ValueT>);
+        header.bucketCount = bucketCount;
+        header.hashCheck = hashFunc(KeyT());
+        auto directoryEnd = sizeof(header) + (bucketCount+1)*sizeof(uint64_t);
+        header.entriesOffset = (directoryEnd + 63) & ~(uint64_t)63;
+
+        auto temporary = path + ".tmp";
+        std::ofstream file(temporary, std::ios::binary | std::ios::trunc);
+        std::unique_ptr<uint64_t[]> directory(new uint64_t[bucketCount+1]);
+        file.seekp(header.entriesOffset);
+        view.forEachCopy([&](size_t index, const pair<KeyT, ValueT> *entries, size_t count)
+        {
+            directory[index] = header.entryCount;
+            file.write(reinterpret_cast<const char*>(entries), count*sizeof(*entries));
+            header.entryCount += count;
+        });
+        directory[bucketCount] = header.entryCount;
+        file.seekp(0);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file.write(reinterpret_cast<const char*>(directory.get()),
+                   (bucketCount+1)*sizeof(uint64_t));
+        file.close();
+        if(!file || std::rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            std::remove(temporary.c_str());
+            throw new std::runtime_error("cannot write TSMap file " + path);
+        }
+    }
+
+    /**
+     * replaces the contents of the map with a file written by save().
+     *
+     * the file is mapped into memory instead of read, and the table takes
+     * over its bucket directory: a lookup reads the entries of its bucket
+     * in place, so only the pages that are touched are ever read from disk.
+     * the first write to a bucket copies its entries into the bucket, and
+     * the mapping is private, so the file itself never changes. loading
+     * costs one pass over the buckets rather than one insert per entry.
+     *
+     * must not be called while other threads use the map or while snapshots
+     * of it are alive. only for trivially copyable keys and values, and the
+     * file must have been saved with the same Hash.
+     *
+     * throws std::runtime_error* if the file cannot be mapped or does not
+     * fit the map
+     */
+    void load(const std::string &path)
+    {
+        static_assert(std::is_trivially_copyable<pair<KeyT, ValueT> >::value,
+                      "save and load copy the entries bytewise");
+        std::unique_ptr<utility::MappedFile> file(new utility::MappedFile(path));
+        utility::ImageHeader header;
+        std::memset(&header, 0, sizeof(header));
+        if(file->size() >= sizeof(header)) std::memcpy(&header, file->data(), sizeof(header));
+
+        auto bucketCount = header.bucketCount;
+        auto size = (uint64_t)file->size();
+        //the sizes come from the file: compared by division, so that a
+        //corrupt one cannot overflow a product past the checks. the
+        //directory and the entries must lie within the file, the entries
+        //aligned for pair<KeyT, ValueT> (the mapping is page aligned)
+        auto incompatible = size < sizeof(header) ||
+            std::memcmp(header.magic, utility::imageMagic, sizeof(header.magic)) != 0 ||
+            header.keySize != sizeof(KeyT) ||
+            header.valueSize != sizeof(ValueT) ||
+            header.entrySize != sizeof(pair<KeyT, ValueT>) ||
+            header.hashCheck != hashFunc(KeyT()) ||
+            bucketCount == 0 || (bucketCount & (bucketCount-1)) != 0 ||
+            bucketCount >= (size - sizeof(header))/sizeof(uint64_t) ||
+            header.entriesOffset < sizeof(header) + (bucketCount+1)*sizeof(uint64_t) ||
+            header.entriesOffset > size ||
+            header.entriesOffset % alignof(pair<KeyT, ValueT>) != 0 ||
+            header.entryCount > (size - header.entriesOffset)/header.entrySize;
+        auto offsets = reinterpret_cast<const uint64_t*>(file->data() + sizeof(header));
+        if(!incompatible && offsets[bucketCount] != header.entryCount) incompatible = true;
+        for(size_t i=0;i<bucketCount && !incompatible;++i)
+        {
+            if(offsets[i] > offsets[i+1]) incompatible = true;
+        }
+        if(incompatible) throw new std::runtime_error(path + " is not a TSMap file of this type");
+
+        std::unique_ptr<Table> loaded(new Table(bucketCount, 0, allocator));
+        loaded->imageBacked.reset(new bool[bucketCount]);
+        std::fill(loaded->imageBacked.get(), loaded->imageBacked.get()+bucketCount, true);
+        loaded->imageOffsets = offsets;
+        loaded->imageEntries = reinterpret_cast<pair<KeyT, ValueT>*>(
+                file->data() + header.entriesOffset);
+
+        delete table.load();
+        table = loaded.release();
+        image = std::move(file);
+        elementCount = header.entryCount;
+    }
+
     /**
      * thread safety not guaranteed
      * for debugging purpose
@@ -124,12 +1175,648 @@ public:
      */
     friend std::ostream& operator<<(std::ostream &stream, const TSMap& rhs)
     {
+        auto table = rhs.table.load();
+        auto previous = table->previous.load();
+        auto print = [&](Table &t)
+        {
+            for(size_t i=0;i<t.size;++i){
+                if(!inImage(t, i))
+                {
+                    stream<<t.buckets[i];
+                    continue;
+                }
+                forEachEntryUnlocked(t, i, [&](auto &kv)
+                {
+                    stream<<kv.first<<":"<<kv.second<<", ";
+                });
+            }
+        };
         stream<<"{";
-        for(auto i=0;i<rhs.tableSize;++i){
-            stream<<rhs.buckets.get()[i];
-        }
+        if(previous) print(*previous);
+        print(*table);
         stream<<"}";
         return stream;
     }
+
+private:
+    /**
+     * runs fn(bucket) on the bucket of hash in the current table, under the
+     * bucket lock. the old bucket of the key is migrated first if the table is
+     * growing. retries if the bucket got sealed by a concurrent growth.
+     */
+    template <typename FuncT>
+    auto withBucket(size_t hash, FuncT fn) -> decltype(fn(std::declval<BucketT&>()))
+    {
+        auto locked = [&](Table &t, size_t index)
+        {
+            return fn(t.buckets[index]);
+        };
+        return withBucketLocked<std::unique_lock<bucket_mutex>, true>(hash, locked);
+    }
+
+    /**
+     * runs fn(ValueT*) on the value of key, nullptr if absent, under the
+     * bucket lock taken through the bucket's read_lock, i.e. shared if the
+     * bucket uses a reader-writer mutex. fn must not modify the bucket.
+     */
+    template <typename FuncT>
+    auto withValueShared(const KeyT &key, FuncT fn) -> decltype(fn(std::declval<ValueT*>()))
+    {
+        auto hash = hashFunc(key);
+        auto locked = [&](Table &t, size_t index)
+        {
+            return fn(findUnlocked(t, index, key, hash));
+        };
+        return withBucketLocked<bucket_read_lock, false>(hash, locked);
+    }
+
+    /**
+     * runs fn(table, index) for the bucket of hash, see withBucket.
+     *
+     * writes: fn modifies the bucket, which is first copied from the mapped
+     * file if it was loaded, and preserved for the active snapshots
+     */
+    template <typename LockT, bool writes, typename FuncT>
+    auto withBucketLocked(size_t hash, FuncT &fn) -> decltype(fn(std::declval<Table&>(), size_t()))
+    {
+        for(;;)
+        {
+            auto current = table.load();
+            auto previous = current->previous.load();
+            if(previous)
+            {
+                migrateBucket(*current, *previous, previous->indexOf(hash));
+            }
+            auto index = current->indexOf(hash);
+            auto &bucket = current->buckets[index];
+            LockT lock(bucket.getMutex());
+            if(bucket.isSealed()) continue;
+            if(writes)
+            {
+                materialize(*current, index);
+                preserveForSnapshots(*current, index);
+            }
+            return fn(*current, index);
+        }
+    }
+
+    /**
+     * true while the entries of bucket index of t are only in the file mapped
+     * by load(). caller holds the bucket lock.
+     */
+    static bool inImage(Table &t, size_t index)
+    {
+        return t.imageBacked && t.imageBacked[index];
+    }
+
+    static size_t entryCountUnlocked(Table &t, size_t index)
+    {
+        if(inImage(t, index)) return t.imageOffsets[index+1] - t.imageOffsets[index];
+        return t.buckets[index].sizeUnlocked();
+    }
+
+    /**
+     * calls fn(pair<KeyT, ValueT>&) on every entry of bucket index of t, in
+     * the bucket or in the mapped file. caller holds the bucket lock.
+     */
+    template <typename FuncT>
+    static void forEachEntryUnlocked(Table &t, size_t index, FuncT fn)
+    {
+        if(!inImage(t, index))
+        {
+            t.buckets[index].forEachUnlocked(fn);
+            return;
+        }
+        for(auto i=t.imageOffsets[index];i<t.imageOffsets[index+1];++i)
+        {
+            fn(t.imageEntries[i]);
+        }
+    }
+
+    /**
+     * value of key in bucket index of t, nullptr if absent. reads the mapped
+     * file in place if the bucket has not been written since load().
+     */
+    ValueT * findUnlocked(Table &t, size_t index, const KeyT &key, size_t hash)
+    {
+        if(!inImage(t, index)) return t.buckets[index].findUnlocked(key, hash);
+        for(auto i=t.imageOffsets[index];i<t.imageOffsets[index+1];++i)
+        {
+            if(keyEqual(t.imageEntries[i].first, key)) return &t.imageEntries[i].second;
+        }
+        return nullptr;
+    }
+
+    /**
+     * copies the entries of bucket index of t from the mapped file into the
+     * bucket, before the first write to it. caller holds the exclusive lock.
+     */
+    void materialize(Table &t, size_t index)
+    {
+        if(!inImage(t, index)) return;
+        auto &bucket = t.buckets[index];
+        bucket.reserveUnlocked(entryCountUnlocked(t, index));
+        //only trivially copyable entries are ever loaded: moving copies
+        for(auto i=t.imageOffsets[index];i<t.imageOffsets[index+1];++i)
+        {
+            auto &kv = t.imageEntries[i];
+            bucket.insertUnlocked(std::move(kv), hashFunc(kv.first));
+        }
+        t.imageBacked[index] = false;
+    }
+
+    /**
+     * called with the exclusive lock of bucket index of t held, before the
+     * bucket is written: copies its entries into every snapshot of t that
+     * has not got them yet
+     */
+    void preserveForSnapshots(Table &t, size_t index)
+    {
+        if(snapshotCount.load() == 0) return;
+        std::shared_lock<std::shared_timed_mutex> lock(snapshotMutex);
+        for(auto state=snapshots;state;state=state->next)
+        {
+            if(state->table != &t) continue;
+            auto &copy = state->copies[index];
+            if(!copy.taken) copy.take(t, index);
+        }
+    }
+
+    void releaseSnapshot(SnapshotState *state)
+    {
+        {
+            std::lock_guard<std::shared_timed_mutex> lock(snapshotMutex);
+            auto link = &snapshots;
+            while(*link != state) link = &(*link)->next;
+            *link = state->next;
+        }
+        --snapshotCount;
+        delete state;
+    }
+
+    /**
+     * visits bucket index of t for forEach. if the bucket has been migrated
+     * to a newer table, its entries are in buckets 2*index and 2*index+1
+     * there.
+     */
+    template <typename FuncT>
+    void visitBucket(Table *t, size_t index, FuncT &fn)
+    {
+        auto previous = t->previous.load();
+        if(previous)
+        {
+            migrateBucket(*t, *previous, index >> 1);
+        }
+        auto &bucket = t->buckets[index];
+        {
+            bucket_read_lock lock(bucket.getMutex());
+            if(!bucket.isSealed())
+            {
+                forEachEntryUnlocked(*t, index, [&](auto &kv)
+                {
+                    const KeyT &key = kv.first;
+                    const ValueT &value = kv.second;
+                    fn(key, value);
+                });
+                return;
+            }
+        }
+        //superseded tables are owned by their successor
+        auto next = table.load();
+        while(next->retired.get() != t) next = next->retired.get();
+        visitBucket(next, 2*index, fn);
+        visitBucket(next, 2*index+1, fn);
+    }
+
+    /**
+     * runs fn(bucket) on every unsealed bucket of the current table, each
+     * under its own lock
+     */
+    template <typename LockT, typename FuncT>
+    void forEachBucket(FuncT fn)
+    {
+        auto current = table.load();
+        for(size_t i=0;i<current->size;++i)
+        {
+            auto &bucket = current->buckets[i];
+            LockT lock(bucket.getMutex());
+            if(bucket.isSealed()) continue;
+            fn(bucket);
+        }
+    }
+
+    /**
+     * runs fn(table, index, position, hash) for count keys of a batch, hashed by
+     * hashAt(position), taking each bucket lock once for all keys of the
+     * batch that fall into it. same protocol as withBucketLocked: the old
+     * buckets of a group are migrated before its bucket is locked, and if the
+     * bucket turns out sealed the remaining keys are regrouped against the
+     * new table.
+     *
+     * groups are formed through a small open addressing table on the bucket
+     * index rather than by sorting: a sort costs about as much as the bucket
+     * accesses it is supposed to save. groups are processed in the order of
+     * their first key, keys within a group in batch order.
+     *
+     * writes as in withBucketLocked
+     */
+    template <typename LockT, bool writes, typename HashFuncT, typename FuncT>
+    void forEachGroup(size_t count, HashFuncT hashAt, FuncT fn)
+    {
+        if(count == 0) return;
+        size_t groupTableSize = 8;
+        while(groupTableSize < count*2) groupTableSize *= 2;
+        std::unique_ptr<BatchSlot[]> slots(new BatchSlot[count]);
+        std::unique_ptr<BatchGroup[]> groups(new BatchGroup[count]);
+        //group number + 1 per entry, 0 = empty
+        std::unique_ptr<uint32_t[]> groupTable(new uint32_t[groupTableSize]);
+        for(size_t i=0;i<count;++i)
+        {
+            slots[i].hash = hashAt(i);
+            slots[i].pending = (uint32_t)i;
+        }
+
+        size_t pendingCount = count;
+        while(pendingCount > 0)
+        {
+            auto current = table.load();
+            auto previous = current->previous.load();
+            auto groupCount = groupByBucket(*current, slots.get(), pendingCount,
+                                            groups.get(), groupTable.get(), groupTableSize);
+
+            size_t distance = prefetchDistance;
+            for(size_t g=0;g<distance && g<groupCount;++g)
+            {
+                __builtin_prefetch(&current->buckets[groups[g].index], 1);
+            }
+
+            pendingCount = 0;
+            for(size_t g=0;g<groupCount;++g)
+            {
+                if(distance > 0 && g+distance < groupCount)
+                {
+                    __builtin_prefetch(&current->buckets[groups[g+distance].index], 1);
+                }
+                if(previous)
+                {
+                    size_t migrated = (size_t)-1;
+                    for(auto p=groups[g].head;p!=endOfGroup;p=slots[p].next)
+                    {
+                        auto index = previous->indexOf(slots[p].hash);
+                        if(index == migrated) continue;
+                        migrateBucket(*current, *previous, index);
+                        migrated = index;
+                    }
+                }
+                auto &bucket = current->buckets[groups[g].index];
+                LockT lock(bucket.getMutex());
+                if(bucket.isSealed())
+                {
+                    //the table grew meanwhile: regroup the rest
+                    for(;g<groupCount;++g)
+                    {
+                        for(auto p=groups[g].head;p!=endOfGroup;p=slots[p].next)
+                        {
+                            slots[pendingCount++].pending = p;
+                        }
+                    }
+                    break;
+                }
+                if(writes)
+                {
+                    materialize(*current, groups[g].index);
+                    preserveForSnapshots(*current, groups[g].index);
+                }
+                for(auto p=groups[g].head;p!=endOfGroup;p=slots[p].next)
+                {
+                    fn(*current, groups[g].index, (size_t)p, slots[p].hash);
+                }
+            }
+        }
+    }
+
+    static const uint32_t endOfGroup = (uint32_t)-1;
+
+    /**
+     * the queue of the stripe of hash: the top bits of the bucket index, so a
+     * stripe covers a range of neighbouring buckets
+     */
+    CombiningSlot & combiningSlot(size_t hash)
+    {
+        auto slots = combiningSlots.load();
+        if(!slots)
+        {
+            std::unique_ptr<CombiningSlots> created(new CombiningSlots());
+            if(combiningSlots.compare_exchange_strong(slots, created.get()))
+            {
+                slots = created.release();
+            }
+        }
+        return slots->slots[((uint64_t)hash * 0x9e3779b97f4a7c15ULL) >> 56];
+    }
+
+    /**
+     * queues write and applies the queue of its stripe unless another
+     * thread is at it, see insertAsync
+     */
+    future<bool> submit(PendingWrite *write)
+    {
+        future<bool> result(write);
+        auto &slot = combiningSlot(write->hash);
+        auto head = slot.pending.load();
+        do
+        {
+            write->next = head;
+        }
+        while(!slot.pending.compare_exchange_weak(head, write));
+
+        if(!slot.combining.exchange(true)) combine(slot);
+        return result;
+    }
+
+    /**
+     * applies the queued writes of slot until it finds the queue empty. the
+     * caller set slot.combining. a write queued after the last look at the
+     * queue finds the flag cleared, so its thread takes over.
+     */
+    void combine(CombiningSlot &slot)
+    {
+        //clears the flag however the scope is left: a combiner that threw
+        //must not keep the stripe, or its writes would queue forever
+        struct ClearOnExit
+        {
+            std::atomic<bool> &flag;
+
+            ~ClearOnExit()
+            {
+                flag = false;
+            }
+        };
+
+        do
+        {
+            ClearOnExit clear{slot.combining};
+            while(auto newest = slot.pending.exchange(nullptr))
+            {
+                //the stack holds the newest write first
+                PendingWrite *oldest = nullptr;
+                while(newest)
+                {
+                    auto next = newest->next;
+                    newest->next = oldest;
+                    oldest = newest;
+                    newest = next;
+                }
+                applyWrites(oldest);
+            }
+        }
+        while(slot.pending.load() && !slot.combining.exchange(true));
+    }
+
+    /**
+     * applies a list of writes in order, taking each bucket lock once for a
+     * run of writes to the same bucket. publishes the results once all locks
+     * are released, then does the growth bookkeeping of the inserts.
+     */
+    void applyWrites(PendingWrite *writes)
+    {
+        auto write = writes;
+        while(write)
+        {
+            auto locked = [&](Table &t, size_t index)
+            {
+                auto &bucket = t.buckets[index];
+                auto run = write;
+                do
+                {
+                    try
+                    {
+                        run->apply(bucket);
+                        if(run->delta > 0) ++elementCount;
+                        if(run->delta < 0) --elementCount;
+                    }
+                    catch(...)
+                    {
+                        run->error = std::current_exception();
+                    }
+                    run = run->next;
+                }
+                while(run && t.indexOf(run->hash) == index);
+                return run;
+            };
+            try
+            {
+                write = withBucketLocked<std::unique_lock<bucket_mutex>, true>(write->hash, locked);
+            }
+            catch(...)
+            {
+                //migrating to the bucket or copying it from a loaded file
+                //failed before the run was applied: the remaining writes
+                //fail with it, none is left without a result
+                auto error = std::current_exception();
+                for(;write;write=write->next) write->error = error;
+            }
+        }
+
+        size_t inserted = 0;
+        while(writes)
+        {
+            auto next = writes->next;
+            if(writes->delta > 0) ++inserted;
+            if(writes->error) writes->setException(writes->error);
+            else writes->setValue(writes->result);
+            writes->release();
+            writes = next;
+        }
+        //every result is out, there is no caller to report a failed
+        //migration step or growth to. neither is lost: the step hands its
+        //bucket back to the cursor and the table is not replaced, so the
+        //next insert retries both
+        try
+        {
+            afterInsert(inserted > 0);
+            for(size_t i=1;i<inserted;++i) afterInsert(true);
+        }
+        catch(...)
+        {}
+    }
+
+    static size_t roundUpTableSize(size_t tableSize)
+    {
+        size_t size = 1;
+        while(size < tableSize) size *= 2;
+        return size;
+    }
+
+    /**
+     * links the pending keys of a batch into groups by their bucket in
+     * current
+     *
+     * returns the number of groups
+     */
+    static size_t groupByBucket(Table &current, BatchSlot *slots, size_t pendingCount,
+                                BatchGroup *groups, uint32_t *groupTable,
+                                size_t groupTableSize)
+    {
+        std::fill(groupTable, groupTable+groupTableSize, 0);
+        auto mask = groupTableSize-1;
+        size_t groupCount = 0;
+        for(size_t i=0;i<pendingCount;++i)
+        {
+            auto position = slots[i].pending;
+            auto index = current.indexOf(slots[position].hash);
+            auto t = (size_t)(((uint64_t)index * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+            while(groupTable[t] && groups[groupTable[t]-1].index != index)
+            {
+                t = (t+1) & mask;
+            }
+            slots[position].next = endOfGroup;
+            if(groupTable[t])
+            {
+                auto &group = groups[groupTable[t]-1];
+                slots[group.tail].next = position;
+                group.tail = position;
+            }
+            else
+            {
+                groups[groupCount].index = index;
+                groups[groupCount].head = position;
+                groups[groupCount].tail = position;
+                groupTable[t] = (uint32_t)++groupCount;
+            }
+        }
+        return groupCount;
+    }
+
+    /**
+     * entries are moved to the new table if that cannot throw (or they cannot
+     * be copied), as std::move_if_noexcept decides
+     */
+    typedef std::integral_constant<bool,
+        (std::is_nothrow_move_constructible<pair<KeyT, ValueT> >::value &&
+         std::is_nothrow_move_assignable<pair<KeyT, ValueT> >::value) ||
+        !std::is_copy_constructible<pair<KeyT, ValueT> >::value> move_on_migration;
+
+    template <typename PairT>
+    static pair<KeyT, ValueT> migratedEntry(PairT &kv, std::true_type)
+    {
+        return pair<KeyT, ValueT>(std::move(kv.first), std::move(kv.second));
+    }
+
+    template <typename PairT>
+    static pair<KeyT, ValueT> migratedEntry(PairT &kv, std::false_type)
+    {
+        return pair<KeyT, ValueT>(kv.first, kv.second);
+    }
+
+    /**
+     * moves all entries of bucket index of the previous table into the current
+     * table and seals it. no-op if it is sealed already.
+     *
+     * the entries land in buckets 2*index and 2*index+1, which get room for
+     * all of them before the first one is taken out of old: past that point
+     * nothing allocates, and a move cannot throw. if the step fails before
+     * (or a copy fails), old is left as it was and the migration can be
+     * retried; entries already copied are overwritten by the retry.
+     */
+    void migrateBucket(Table &current, Table &previous, size_t index)
+    {
+        auto &old = previous.buckets[index];
+        std::lock_guard<bucket_mutex> lock(old.getMutex());
+        if(old.isSealed()) return;
+        materialize(previous, index);
+        preserveForSnapshots(previous, index);
+
+        size_t counts[2] = {0, 0};
+        old.forEachUnlocked([&](auto &kv)
+        {
+            ++counts[current.indexOf(hashFunc(kv.first)) & 1];
+        });
+        for(size_t i=0;i<2;++i)
+        {
+            auto &target = current.buckets[2*index+i];
+            std::lock_guard<bucket_mutex> targetLock(target.getMutex());
+            target.reserveMoreUnlocked(counts[i]);
+        }
+
+        //old is cleared right after and its lock is held exclusively, so the
+        //entries can be moved out. a bucket without stored pairs hands out
+        //references, whose key is copied
+        old.forEachUnlocked([&](auto &kv)
+        {
+            auto hash = hashFunc(kv.first);
+            auto &target = current.bucket(hash);
+            std::lock_guard<bucket_mutex> targetLock(target.getMutex());
+            target.upsertUnlocked(migratedEntry(kv, move_on_migration()), hash);
+        });
+        old.clearUnlocked();
+        old.seal();
+
+        //last bucket: drop the previous table
+        if(previous.migratedCount.fetch_add(1)+1 == previous.size)
+        {
+            current.previous = nullptr;
+        }
+    }
+
+    /**
+     * bookkeeping after an insert: migrates a few buckets if the table is
+     * growing, otherwise starts growing if the load factor is exceeded.
+     */
+    void afterInsert(bool inserted)
+    {
+        auto current = table.load();
+        auto previous = current->previous.load();
+        if(previous)
+        {
+            for(size_t i=0;i<migrationStep;++i)
+            {
+                auto index = previous->migrateCursor.fetch_add(1);
+                if(index >= previous->size) break;
+                try
+                {
+                    migrateBucket(*current, *previous, index);
+                }
+                catch(...)
+                {
+                    //hand the bucket back to the cursor, so that the next
+                    //insert retries it. buckets migrated meanwhile by others
+                    //are sealed and skipped
+                    auto cursor = previous->migrateCursor.load();
+                    while(cursor > index &&
+                          !previous->migrateCursor.compare_exchange_weak(cursor, index))
+                    {}
+                    throw;
+                }
+            }
+            return;
+        }
+
+        float loadFactor = maxLoadFactor;
+        if(inserted && loadFactor > 0 &&
+           elementCount.load() > loadFactor*current->size)
+        {
+            grow(current);
+        }
+    }
+
+    /**
+     * publishes a table twice the size of current. only allocates the new
+     * buckets, the entries are moved over by subsequent operations.
+     */
+    void grow(Table *current)
+    {
+        std::lock_guard<std::mutex> lock(growMutex);
+        //someone else grew the table already
+        if(table.load() != current) return;
+
+        //new buckets get about twice their expected load up front
+        float loadFactor = maxLoadFactor;
+        auto next = new Table(current->size*2, (size_t)(loadFactor*2)+1, allocator);
+        next->retired.reset(current);
+        next->previous = current;
+        table = next;
+        TSMAP_STATS(++growths;)
+    }
 };
 }//end namespace TSMap
@@ -0,0 +1,1215 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <new>
+#include <cstdlib>
+#include <mutex>
+#include <shared_mutex>
+#include <TSMap.hpp>
+#include <LockFreeTSMap.hpp>
+#include <TSCache.hpp>
+#include <ShardedTSMap.hpp>
+#include <recursion.hpp>
+#include <Bench.hpp>
+
+/**
+ * benchmarks for TSMap
+ *
+ * usage: ./bench [name filter...]
+ */
+
+static const size_t threadCounts[] = {1, 2, 4, 8, 16, 32, 64};
+
+/**
+ * number of heap allocations made by the process. the whole replaceable
+ * operator new/delete family is replaced below on top of malloc/free, so that
+ * no form pairs with the library's own. they are kept out of line: inlined
+ * into a caller, gcc would see free() on a pointer from a new expression.
+ */
+static std::atomic<size_t> allocationCount(0);
+
+static void * countedAllocation(size_t size) noexcept
+{
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+__attribute__((noinline)) void * operator new(size_t size)
+{
+    if(auto p = countedAllocation(size)) return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void * operator new[](size_t size)
+{
+    if(auto p = countedAllocation(size)) return p;
+    throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void * operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return countedAllocation(size);
+}
+
+__attribute__((noinline)) void * operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return countedAllocation(size);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+    std::free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+    std::free(p);
+}
+
+/**
+ * read throughput with 1..64 threads on a small table, where readers of the
+ * same bucket would serialize behind a plain mutex. writePercent of the
+ * operations are upserts.
+ */
+template <typename MutexT>
+void readScaling(const std::string &name, size_t writePercent)
+{
+    using bucket = TSMap::utility::KVPairList<uint64_t, uint64_t, MutexT>;
+    const size_t keys = 4096;
+    const size_t opsPerThread = 200000;
+
+    for(auto threads : threadCounts)
+    {
+        TSMap::TSMap<uint64_t, uint64_t, TSMap::hash<uint64_t>, std::equal_to<uint64_t>,
+                     std::allocator<TSMap::pair<uint64_t, uint64_t> >, bucket> map(256);
+        map.setMaxLoadFactor(0);
+        for(size_t i=0;i<keys;++i) map.insert(i, i);
+
+        std::atomic<uint64_t> sink(0);
+        auto seconds = bench::runThreads(threads, [&](size_t tid)
+        {
+            bench::Random random(tid+1);
+            uint64_t sum = 0;
+            for(size_t i=0;i<opsPerThread;++i)
+            {
+                auto r = random.next();
+                auto key = r % keys;
+                if((r>>32)%100 < writePercent)
+                {
+                    map.insert(key, i);
+                }
+                else if(map.count(key))
+                {
+                    sum += map[key];
+                }
+            }
+            sink += sum;
+        });
+        bench::report(name, threads, threads*opsPerThread, seconds);
+    }
+}
+
+/**
+ * insert then lookup throughput with 1..64 threads, every thread on its own
+ * key range. shows how MapT scales when the threads do not share keys.
+ */
+template <typename MapT>
+void insertLookupScaling(const std::string &name)
+{
+    const size_t opsPerThread = 100000;
+
+    for(auto threads : threadCounts)
+    {
+        MapT map;
+        auto seconds = bench::runThreads(threads, [&](size_t tid)
+        {
+            auto base = tid*opsPerThread;
+            for(size_t i=0;i<opsPerThread;++i) map.insert(base+i, i);
+        });
+        bench::report(name+"/insert", threads, threads*opsPerThread, seconds);
+
+        std::atomic<uint64_t> sink(0);
+        seconds = bench::runThreads(threads, [&](size_t tid)
+        {
+            bench::Random random(tid+1);
+            uint64_t sum = 0;
+            for(size_t i=0;i<opsPerThread;++i)
+            {
+                sum += map.count(random.next() % (threads*opsPerThread));
+            }
+            sink += sum;
+        });
+        bench::report(name+"/lookup", threads, threads*opsPerThread, seconds);
+    }
+}
+
+/**
+ * read-modify-write counters: count()+lookup()+insert() (three lock
+ * acquisitions, racy) against upsertWith (one). half of the keys miss.
+ */
+void counters()
+{
+    const size_t keys = 1 << 16;
+    const size_t ops = 2000000;
+
+    TSMap::TSMap<uint64_t, uint64_t> map;
+    for(size_t i=0;i<keys;i+=2) map.insert(i, 0);
+    bench::Random random(1);
+    auto start = bench::clock::now();
+    for(size_t i=0;i<ops;++i)
+    {
+        auto key = random.next() % keys;
+        map.insert(key, map.count(key) ? map.lookup(key)+1 : 1);
+    }
+    bench::report("counters/count_lookup_insert", 1, ops,
+            std::chrono::duration<double>(bench::clock::now()-start).count());
+
+    TSMap::TSMap<uint64_t, uint64_t> map2;
+    for(size_t i=0;i<keys;i+=2) map2.insert(i, 0);
+    start = bench::clock::now();
+    for(size_t i=0;i<ops;++i)
+    {
+        map2.upsertWith(random.next() % keys, [](uint64_t &count){ ++count; });
+    }
+    bench::report("counters/upsertWith", 1, ops,
+            std::chrono::duration<double>(bench::clock::now()-start).count());
+}
+
+/**
+ * latency of single inserts while a map grows from 1K buckets to 4M: 10M keys,
+ * reported per decade of the key count. entries are migrated incrementally,
+ * so the p99 of the late decades should stay in the range of the early ones
+ * although the table doubles 12 times, where a stop-the-world rehash would
+ * show up as orders of magnitude in p999.
+ */
+void growthLatency()
+{
+    const size_t total = 10000000;
+    TSMap::TSMap<uint64_t, uint64_t> map(1024);
+    bench::Latencies latencies;
+    latencies.samples.reserve(total);
+
+    for(size_t i=0;i<total;++i)
+    {
+        auto start = bench::clock::now();
+        map.insert(i, i);
+        latencies.add(start, bench::clock::now());
+    }
+
+    for(size_t begin=1000;begin<total;begin*=10)
+    {
+        bench::Latencies decade;
+        decade.samples.assign(latencies.samples.begin()+begin,
+                              latencies.samples.begin()+begin*10);
+        double seconds = 0;
+        for(auto ns : decade.samples) seconds += ns*1e-9;
+        bench::report("growth/insert/" + std::to_string(begin) + ".." + std::to_string(begin*10),
+                      1, decade.samples.size(), seconds, decade);
+    }
+}
+
+/**
+ * heap allocations and throughput of inserting string keys and values that do
+ * not fit the small string buffer: copying insert, moving insert and emplace.
+ * bucket growth is included, table growth is not (the table is presized).
+ */
+void insertAllocations()
+{
+    const size_t keys = 1 << 18;
+
+    //mode 0: insert(const&, const&), 1: insert(&&, &&), 2: emplace
+    const char *names[] = {"copy", "move", "emplace"};
+    for(int mode=0;mode<3;++mode)
+    {
+        std::vector<std::string> k, v;
+        k.reserve(keys);
+        v.reserve(keys);
+        for(size_t i=0;i<keys;++i)
+        {
+            k.push_back("key-with-a-long-enough-prefix-" + std::to_string(i));
+            v.push_back(std::string(200, 'a' + i % 26));
+        }
+        TSMap::TSMap<std::string, std::string> map(keys/4);
+        map.setMaxLoadFactor(0);
+
+        auto before = allocationCount.load();
+        auto start = bench::clock::now();
+        for(size_t i=0;i<keys;++i)
+        {
+            if(mode == 0) map.insert(k[i], v[i]);
+            else if(mode == 1) map.insert(std::move(k[i]), std::move(v[i]));
+            else map.emplace(std::move(k[i]), std::move(v[i]));
+        }
+        auto seconds = std::chrono::duration<double>(bench::clock::now()-start).count();
+        auto allocations = allocationCount.load() - before;
+
+        auto name = std::string("insert_allocations/") + names[mode];
+        bench::report(name, 1, keys, seconds);
+        std::cout<<std::left<<std::setw(48)<<name
+                 <<std::right<<std::setw(23)<<std::fixed<<std::setprecision(2)
+                 <<(double)allocations/keys<<" allocs/insert"<<std::endl;
+    }
+}
+
+/**
+ * memory of a map of 10M uint64_t entries, growing from the default size,
+ * with AllocatorT for the bucket arrays: heap allocations (operator new calls,
+ * arena chunks included), growth of the resident set and insert throughput,
+ * then the resident set after erasing 90% of the keys and shrinkToFit. each
+ * variant runs in its own process.
+ */
+template <typename AllocatorT>
+void arenaMemory(const std::string &name)
+{
+    const size_t keys = 10000000;
+    bench::inChildProcess([&]()
+    {
+        auto rssBefore = bench::residentBytes();
+        auto allocationsBefore = allocationCount.load();
+        {
+            TSMap::TSMap<uint64_t, uint64_t, TSMap::hash<uint64_t>,
+                         std::equal_to<uint64_t>, AllocatorT> map;
+            auto start = bench::clock::now();
+            for(size_t i=0;i<keys;++i) map.insert(i, i);
+            auto seconds = std::chrono::duration<double>(bench::clock::now()-start).count();
+            auto allocations = allocationCount.load() - allocationsBefore;
+            auto rss = bench::residentBytes() - rssBefore;
+
+            bench::report(name + "/insert", 1, keys, seconds);
+            std::cout<<std::left<<std::setw(48)<<name + "/insert"
+                     <<std::right<<std::setw(23)<<allocations<<" allocs"
+                     <<std::setw(10)<<std::fixed<<std::setprecision(1)
+                     <<rss/1048576.0<<" MB rss"<<std::endl;
+
+            for(size_t i=0;i<keys;++i)
+            {
+                if(i%10 != 0) map.deleteByKey(i);
+            }
+            map.shrinkToFit();
+            rss = bench::residentBytes() - rssBefore;
+            std::cout<<std::left<<std::setw(48)<<name + "/erase_90_shrink"
+                     <<std::right<<std::setw(40)<<std::fixed<<std::setprecision(1)
+                     <<rss/1048576.0<<" MB rss"<<std::endl;
+        }
+    });
+}
+
+/**
+ * restart of a map of 10M uint64_t entries: inserting them again against
+ * load() of a file written by save(), then 1M random lookups on the loaded
+ * map, which fault in the pages they touch. the page cache is warm, so the
+ * load numbers are for a recently written file.
+ */
+void restart()
+{
+    const size_t keys = 10000000;
+    const size_t lookups = 1000000;
+    const std::string path = "bench_restart.bin";
+    {
+        TSMap::TSMap<uint64_t, uint64_t> map;
+        auto start = bench::clock::now();
+        for(size_t i=0;i<keys;++i) map.insert(i, i);
+        bench::report("restart/insert", 1, keys,
+                std::chrono::duration<double>(bench::clock::now()-start).count());
+        start = bench::clock::now();
+        map.save(path);
+        bench::report("restart/save", 1, keys,
+                std::chrono::duration<double>(bench::clock::now()-start).count());
+    }
+    bench::inChildProcess([&]()
+    {
+        TSMap::TSMap<uint64_t, uint64_t> map;
+        auto start = bench::clock::now();
+        map.load(path);
+        bench::report("restart/load", 1, keys,
+                std::chrono::duration<double>(bench::clock::now()-start).count());
+        bench::Random random(7);
+        uint64_t sum = 0;
+        start = bench::clock::now();
+        for(size_t i=0;i<lookups;++i) sum += map.lookup(random.next() % keys);
+        bench::report("restart/first_lookups", 1, lookups,
+                std::chrono::duration<double>(bench::clock::now()-start).count());
+        if(sum == 0) std::cout<<"";
+    });
+    std::remove(path.c_str());
+}
+
+/**
+ * counter increments with 90% of the writes on 1% of 10000 keys, 1..64
+ * threads: upsertWith, which waits for the bucket lock, against
+ * upsertWithAsync, whose threads keep up to 64 futures open and leave their
+ * writes to whichever thread is applying the queue of the key.
+ */
+void hotKeyWrites()
+{
+    const size_t keys = 10000;
+    const size_t hotKeys = keys/100;
+    const size_t opsPerThread = 200000;
+    const size_t window = 64;
+    auto keyOf = [&](bench::Random &random)
+    {
+        auto r = random.next();
+        return (r >> 32)%100 < 90 ? r % hotKeys : r % keys;
+    };
+
+    for(auto threads : threadCounts)
+    {
+        {
+            TSMap::TSMap<uint64_t, uint64_t> map(keys/4);
+            auto seconds = bench::runThreads(threads, [&](size_t tid)
+            {
+                bench::Random random(tid+1);
+                for(size_t i=0;i<opsPerThread;++i)
+                {
+                    map.upsertWith(keyOf(random), [](uint64_t &count){ ++count; });
+                }
+            });
+            bench::report("combining/sync", threads, threads*opsPerThread, seconds);
+        }
+        {
+            TSMap::TSMap<uint64_t, uint64_t> map(keys/4);
+            auto seconds = bench::runThreads(threads, [&](size_t tid)
+            {
+                bench::Random random(tid+1);
+                std::vector<TSMap::future<bool> > pending(window);
+                for(size_t i=0;i<opsPerThread;++i)
+                {
+                    auto &future = pending[i%window];
+                    if(future.valid()) future.get();
+                    future = map.upsertWithAsync(keyOf(random), [](uint64_t &count){ ++count; });
+                }
+                for(auto &future : pending) if(future.valid()) future.get();
+            });
+            bench::report("combining/async", threads, threads*opsPerThread, seconds);
+        }
+    }
+}
+
+/**
+ * inserts then lookups of 1M keys on a map spread over the numa nodes, with
+ * 2..64 threads pinned round robin to the nodes:
+ *
+ *  - tsmap: one TSMap, every thread takes every threads-th key
+ *  - unrouted: a ShardedTSMap, same keys per thread, so most operations go
+ *    to a shard on another node
+ *  - routed: a ShardedTSMap, every thread takes the keys living on its node
+ *
+ * all maps allocate from arenas, so the difference is sharding and placement.
+ * the lookups start once the tables are fully migrated.
+ * runs on the layout of the machine if it has two nodes or more, otherwise
+ * on a simulated 2 node layout (as numactl --cpunodebind would give), where
+ * memory is not bound and only the cost of sharding and routing shows.
+ */
+void numaSharding()
+{
+    typedef TSMap::utility::ArenaAllocator<TSMap::pair<uint64_t, uint64_t> > allocator;
+    typedef TSMap::ShardedTSMap<uint64_t, uint64_t, TSMap::hash<uint64_t>,
+                                std::equal_to<uint64_t>, allocator> sharded;
+    const size_t keys = 1 << 20;
+
+    auto topology = TSMap::utility::NumaTopology::system();
+    std::string layout = "system";
+    if(topology.nodeCount() < 2)
+    {
+        topology = TSMap::utility::NumaTopology::simulated(2);
+        layout = "simulated";
+    }
+    auto nodes = (size_t)topology.nodeCount();
+    std::cout<<"sharded: "<<nodes<<" nodes, "<<layout<<" layout"<<std::endl;
+
+    //keys per thread: every threads-th key, or the keys of the thread's node
+    //split among the threads of that node
+    auto strided = [&](size_t threads)
+    {
+        std::vector<std::vector<uint64_t> > perThread(threads);
+        for(uint64_t k=0;k<keys;++k) perThread[k % threads].push_back(k);
+        return perThread;
+    };
+    auto routed = [&](sharded &map, size_t threads)
+    {
+        std::vector<std::vector<uint64_t> > perThread(threads);
+        std::vector<size_t> next(nodes, 0);
+        for(uint64_t k=0;k<keys;++k)
+        {
+            auto node = (size_t)map.homeNode(k);
+            perThread[node + (next[node]++ % (threads/nodes))*nodes].push_back(k);
+        }
+        return perThread;
+    };
+
+    auto run = [&](const std::string &name, size_t threads,
+                   const std::vector<std::vector<uint64_t> > &perThread, auto &map)
+    {
+        auto seconds = bench::runThreads(threads, [&](size_t tid)
+        {
+            topology.pinThread((int)(tid % nodes));
+            for(auto k : perThread[tid]) map.insert(k, k);
+        });
+        bench::report(name+"/insert", threads, keys, seconds);
+        //finishes the table migrations the last inserts started
+        map.stats();
+
+        std::atomic<uint64_t> sink(0);
+        seconds = bench::runThreads(threads, [&](size_t tid)
+        {
+            topology.pinThread((int)(tid % nodes));
+            bench::Random random(tid+1);
+            auto &mine = perThread[tid];
+            uint64_t found = 0;
+            for(size_t i=0;i<mine.size();++i) found += map.count(mine[random.next() % mine.size()]);
+            sink += found;
+        });
+        bench::report(name+"/lookup", threads, keys, seconds);
+    };
+
+    for(auto threads : threadCounts)
+    {
+        if(threads < nodes || threads % nodes) continue;
+        {
+            TSMap::TSMap<uint64_t, uint64_t, TSMap::hash<uint64_t>, std::equal_to<uint64_t>,
+                         allocator> map;
+            run("sharded/tsmap", threads, strided(threads), map);
+        }
+        {
+            sharded map(0, 128, topology);
+            run("sharded/unrouted", threads, strided(threads), map);
+        }
+        {
+            sharded map(0, 128, topology);
+            run("sharded/routed", threads, routed(map, threads), map);
+        }
+    }
+}
+
+/**
+ * a Zipfian trace (theta 0.99) over 1M keys replayed against TSCache at 1%
+ * and 10% of the keys and against an unbounded TSMap, with 1, 4 and 16
+ * threads: hit ratio, throughput, and the entries held at the end. a miss
+ * loads the value from a "store" that costs nothing, so throughput is that
+ * of the cache itself.
+ */
+void cacheHitRatio()
+{
+    const size_t keys = 1000000;
+    const size_t ops = 1 << 22;
+    const size_t threadCountsCache[] = {1, 4, 16};
+
+    bench::Zipf zipf(keys, 0.99);
+    bench::Random random(42);
+    std::vector<uint64_t> trace(ops);
+    for(auto &key : trace) key = zipf.next(random);
+
+    auto row = [](const std::string &name, size_t threads, double seconds,
+                  double hitRatio, size_t entries)
+    {
+        bench::report(name, threads, ops, seconds);
+        std::cout<<std::left<<std::setw(48)<<name + "/hit_ratio"
+                 <<std::right<<std::setw(22)<<std::fixed<<std::setprecision(4)
+                 <<hitRatio<<std::setw(12)<<entries<<" entries"<<std::endl;
+    };
+    auto load = [](const uint64_t &key){ return key; };
+
+    for(auto threads : threadCountsCache)
+    {
+        auto perThread = ops/threads;
+        for(auto percent : {1, 10})
+        {
+            TSMap::TSCache<uint64_t, uint64_t> cache(keys*percent/100);
+            std::atomic<uint64_t> sink(0);
+            auto seconds = bench::runThreads(threads, [&](size_t tid)
+            {
+                uint64_t sum = 0;
+                for(size_t i=tid*perThread;i<(tid+1)*perThread;++i)
+                {
+                    sum += cache.findOrLoad(trace[i], load);
+                }
+                sink += sum;
+            });
+            row("cache/tscache_" + std::to_string(percent) + "pct", threads, seconds,
+                cache.stats().hitRatio(), cache.size());
+        }
+
+        TSMap::TSMap<uint64_t, uint64_t> map;
+        std::atomic<uint64_t> hits(0);
+        auto seconds = bench::runThreads(threads, [&](size_t tid)
+        {
+            uint64_t localHits = 0;
+            for(size_t i=tid*perThread;i<(tid+1)*perThread;++i)
+            {
+                auto cached = map.find(trace[i]);
+                if(cached) ++localHits;
+                else map.insert(trace[i], load(trace[i]));
+            }
+            hits += localHits;
+        });
+        row("cache/unbounded_tsmap", threads, seconds, (double)hits/(perThread*threads), map.size());
+    }
+}
+
+/**
+ * the key scan kernels of SimdScan.hpp on 8..1024 uint64_t and uint32_t
+ * keys, the fill levels of long bucket chains: scalar, SSE2 and (if the cpu
+ * has it) AVX2. hits are at a random position, misses scan all keys.
+ */
+template <typename KeyT>
+void simdScan(const std::string &name)
+{
+    using namespace TSMap::utility::simd;
+    const size_t ops = 1 << 20;
+    std::vector<std::pair<Level, std::string> > levels = {{Level::scalar, "scalar"}};
+    if(supportedLevel() != Level::scalar) levels.push_back({Level::sse2, "sse2"});
+    if(supportedLevel() == Level::avx2) levels.push_back({Level::avx2, "avx2"});
+
+    for(size_t n=8;n<=1024;n*=2)
+    {
+        std::vector<KeyT> keys(n);
+        bench::Random random(n);
+        for(auto &key : keys) key = (KeyT)(random.next() | 1);
+        std::vector<KeyT> probes(ops);
+        for(auto &probe : probes) probe = keys[random.next() % n];
+
+        for(auto &level : levels)
+        {
+            size_t sum = 0;
+            auto start = bench::clock::now();
+            for(size_t i=0;i<ops;++i) sum += findKey(keys.data(), n, probes[i], level.first);
+            bench::report(name + "/hit/" + level.second + "/" + std::to_string(n), 1, ops,
+                    std::chrono::duration<double>(bench::clock::now()-start).count());
+
+            start = bench::clock::now();
+            for(size_t i=0;i<ops;++i) sum += findKey(keys.data(), n, (KeyT)(i << 1), level.first);
+            bench::report(name + "/miss/" + level.second + "/" + std::to_string(n), 1, ops,
+                    std::chrono::duration<double>(bench::clock::now()-start).count());
+            if(sum == 0) std::cout<<"";
+        }
+    }
+}
+
+/**
+ * RecursionEngine in both modes: random 64 bit numbers, which rarely share
+ * factors beyond the lowest levels, and numbers below 2^16 drawn again and
+ * again, which the memo answers in one lookup once warm
+ */
+void recursionModes()
+{
+    const size_t ops = 1 << 20;
+    typedef RecursionEngine::Mode Mode;
+    const std::pair<Mode, std::string> modes[] = {{Mode::memo, "memo"}, {Mode::bitWalk, "bit_walk"}};
+    const std::pair<uint64_t, std::string> ranges[] = {{UINT64_MAX, "u64"}, {(1 << 16) - 1, "u16"}};
+
+    for(auto &range : ranges)
+    {
+        std::vector<uint64_t> numbers(ops);
+        bench::Random random(range.first);
+        for(auto &n : numbers) n = random.next() & range.first;
+
+        for(auto &mode : modes)
+        {
+            RecursionEngine engine((size_t)1 << 16, 0, mode.first);
+            uint64_t sum = 0;
+            //warms the memo
+            for(size_t i=0;i<ops;++i) sum += engine.evaluate(numbers[i]);
+            auto start = bench::clock::now();
+            for(size_t i=0;i<ops;++i) sum += engine.evaluate(numbers[i]);
+            bench::reportPerCall("recursion/" + mode.second + "/" + range.second, 1, ops,
+                    std::chrono::duration<double>(bench::clock::now()-start).count());
+            if(sum == 0) std::cout<<"";
+        }
+    }
+}
+
+/**
+ * the batch kernels of evaluateBitWalk at every level the cpu supports,
+ * against the scalar walk one call at a time, on random 64 bit numbers and
+ * on numbers below 2^16. a row is Mvalues/s.
+ */
+void recursionBatch()
+{
+    const size_t ops = 1 << 20;
+    std::vector<std::pair<bitwalk::Level, std::string> > levels = {{bitwalk::Level::scalar, "scalar"}};
+    if(bitwalk::supportedLevel() != bitwalk::Level::scalar) levels.push_back({bitwalk::Level::avx2, "avx2"});
+    if(bitwalk::supportedLevel() == bitwalk::Level::avx512) levels.push_back({bitwalk::Level::avx512, "avx512"});
+    const std::pair<uint64_t, std::string> ranges[] = {{UINT64_MAX, "u64"}, {(1 << 16) - 1, "u16"}};
+
+    for(auto &range : ranges)
+    {
+        std::vector<uint64_t> numbers(ops), values(ops);
+        bench::Random random(range.first);
+        for(auto &n : numbers) n = random.next() & range.first;
+
+        uint64_t sum = 0;
+        auto start = bench::clock::now();
+        for(size_t i=0;i<ops;++i) sum += evaluateBitWalk(numbers[i]);
+        bench::report("recursion/batch/" + range.second + "/per_call", 1, ops,
+                std::chrono::duration<double>(bench::clock::now()-start).count());
+
+        for(auto &level : levels)
+        {
+            start = bench::clock::now();
+            bitwalk::evaluate(numbers.data(), values.data(), ops, level.first);
+            bench::report("recursion/batch/" + range.second + "/" + level.second, 1, ops,
+                    std::chrono::duration<double>(bench::clock::now()-start).count());
+            sum += values[ops/2];
+        }
+        if(sum == 0) std::cout<<"";
+    }
+}
+
+/**
+ * 2^26 consecutive values from 2^40 on: one evaluateBitWalk call per value,
+ * the batch kernels on the indices, and the incremental sequence, into a
+ * buffer and in blocks to a callback, on the calling thread and on pools of
+ * 1..8 threads
+ */
+void recursionRange()
+{
+    const uint64_t first = (uint64_t)1 << 40, count = (uint64_t)1 << 26;
+    std::vector<uint64_t> values(count);
+    auto seconds = [](bench::clock::time_point start)
+    {
+        return std::chrono::duration<double>(bench::clock::now()-start).count();
+    };
+
+    auto start = bench::clock::now();
+    for(uint64_t i=0;i<count;++i) values[i] = evaluateBitWalk(first+i);
+    bench::report("recursion/range/per_call", 1, count, seconds(start));
+
+    for(uint64_t i=0;i<count;++i) values[i] = first+i;
+    start = bench::clock::now();
+    evaluateBitWalk(values.data(), values.data(), count);
+    bench::report("recursion/range/batch", 1, count, seconds(start));
+
+    start = bench::clock::now();
+    evaluateRange(first, first+count, values.data());
+    bench::report("recursion/range/sequence", 1, count, seconds(start));
+
+    std::atomic<uint64_t> sum(0);
+    auto consume = [&](uint64_t, const uint64_t *block, size_t n)
+    {
+        sum += block[n-1];
+    };
+    start = bench::clock::now();
+    evaluateRange(first, first+count, consume);
+    bench::report("recursion/range/callback", 1, count, seconds(start));
+
+    for(size_t threads=2;threads<=8;threads*=2)
+    {
+        TSMap::utility::WorkStealingPool pool(threads-1);
+        start = bench::clock::now();
+        evaluateRange(first, first+count, values.data(), pool);
+        bench::report("recursion/range/sequence_pool", threads, count, seconds(start));
+
+        start = bench::clock::now();
+        evaluateRange(first, first+count, consume, pool);
+        bench::report("recursion/range/callback_pool", threads, count, seconds(start));
+    }
+}
+
+/**
+ * evaluateBitWalk on inputs of 16 to 4096 bits, in every type that holds
+ * them: uint64_t, unsigned __int128 and BigUnsigned. a row is the time per
+ * input bit.
+ */
+void recursionWide()
+{
+    typedef unsigned __int128 u128;
+    for(size_t bits=16;bits<=4096;bits*=2)
+    {
+        const size_t ops = std::max<size_t>((1 << 22)/bits, 64);
+        bench::Random random(bits);
+        std::vector<BigUnsigned> numbers(ops);
+        for(auto &n : numbers)
+        {
+            //exactly bits bits, the highest set
+            for(size_t i=0;i+64<=bits;i+=64)
+            {
+                BigUnsigned limb(random.next());
+                for(size_t j=0;j<64;++j) n += n;
+                n += limb;
+            }
+            auto rest = bits%64;
+            for(size_t j=0;j<rest;++j) n += n;
+            if(rest) n += BigUnsigned(random.next() >> (64-rest));
+            if(n.bitLength() < bits)
+            {
+                BigUnsigned top(1);
+                for(size_t j=1;j<bits;++j) top += top;
+                n += top;
+            }
+        }
+        auto seconds = [](bench::clock::time_point start)
+        {
+            return std::chrono::duration<double>(bench::clock::now()-start).count();
+        };
+        auto suffix = "/" + std::to_string(bits);
+        uint64_t sum = 0;
+
+        if(bits <= 64)
+        {
+            std::vector<uint64_t> narrow(ops);
+            for(size_t i=0;i<ops;++i) narrow[i] = numbers[i].getLimbs()[0];
+            auto start = bench::clock::now();
+            for(size_t i=0;i<ops;++i) sum += evaluateBitWalk(narrow[i]);
+            bench::reportPerCall("recursion/wide/u64" + suffix, 1, ops*bits, seconds(start), "bit");
+        }
+        if(bits <= 128)
+        {
+            std::vector<u128> wide(ops);
+            for(size_t i=0;i<ops;++i)
+            {
+                auto &limbs = numbers[i].getLimbs();
+                wide[i] = limbs.size() > 1 ? (u128)limbs[1] << 64 | limbs[0] : limbs[0];
+            }
+            auto start = bench::clock::now();
+            for(size_t i=0;i<ops;++i) sum += (uint64_t)evaluateBitWalk(wide[i]);
+            bench::reportPerCall("recursion/wide/u128" + suffix, 1, ops*bits, seconds(start), "bit");
+        }
+        auto start = bench::clock::now();
+        for(size_t i=0;i<ops;++i) sum += evaluateBitWalk(numbers[i]).getLimbs()[0];
+        bench::reportPerCall("recursion/wide/big" + suffix, 1, ops*bits, seconds(start), "bit");
+        if(sum == 0) std::cout<<"";
+    }
+}
+
+/**
+ * batch operations against per-key calls for batch sizes 16..4096 on one
+ * keyspace. half of the lookups miss.
+ */
+void batchOperations(const std::string &name, size_t keys, size_t tableSize)
+{
+    const size_t ops = 1 << 21;
+    const size_t batchSizes[] = {16, 64, 256, 1024, 4096};
+
+    TSMap::TSMap<uint64_t, uint64_t> map(tableSize);
+    map.setMaxLoadFactor(0);
+    for(size_t i=0;i<keys;i+=2) map.insert(i, i);
+
+    for(auto batch : batchSizes)
+    {
+        bench::Random random(batch);
+        std::vector<uint64_t> batchKeys(batch);
+        std::vector<TSMap::pair<uint64_t, uint64_t> > entries(batch);
+        std::vector<TSMap::optional<uint64_t> > values(batch);
+        auto suffix = "/" + std::to_string(batch);
+
+        auto start = bench::clock::now();
+        for(size_t done=0;done<ops;done+=batch)
+        {
+            for(auto &key : batchKeys) key = random.next() % keys;
+            for(size_t i=0;i<batch;++i) values[i] = map.find(batchKeys[i]);
+        }
+        bench::report(name + "/lookup/per_key" + suffix, 1, ops,
+                std::chrono::duration<double>(bench::clock::now()-start).count());
+
+        for(size_t distance : {(size_t)0, (size_t)4})
+        {
+            map.setPrefetchDistance(distance);
+            start = bench::clock::now();
+            for(size_t done=0;done<ops;done+=batch)
+            {
+                for(auto &key : batchKeys) key = random.next() % keys;
+                map.lookupMany(batchKeys.begin(), batchKeys.end(), values.begin());
+            }
+            bench::report(name + (distance ? "/lookup/many" : "/lookup/many_no_prefetch") + suffix,
+                    1, ops, std::chrono::duration<double>(bench::clock::now()-start).count());
+        }
+
+        start = bench::clock::now();
+        for(size_t done=0;done<ops;done+=batch)
+        {
+            for(auto &kv : entries) kv = TSMap::make_pair(random.next() % keys, done);
+            for(auto &kv : entries) map.insert(kv.first, kv.second);
+        }
+        bench::report(name + "/insert/per_key" + suffix, 1, ops,
+                std::chrono::duration<double>(bench::clock::now()-start).count());
+
+        start = bench::clock::now();
+        for(size_t done=0;done<ops;done+=batch)
+        {
+            for(auto &kv : entries) kv = TSMap::make_pair(random.next() % keys, done);
+            map.insertMany(entries.begin(), entries.end());
+        }
+        bench::report(name + "/insert/many" + suffix, 1, ops,
+                std::chrono::duration<double>(bench::clock::now()-start).count());
+    }
+}
+
+/**
+ * insert then lookup of n keys with hash function HashT, single threaded
+ */
+template <typename KeyT, typename HashT>
+void hashInsertLookup(const std::string &name, const std::vector<KeyT> &keys)
+{
+    TSMap::TSMap<KeyT, uint64_t, HashT> map;
+    auto start = bench::clock::now();
+    for(size_t i=0;i<keys.size();++i) map.insert(keys[i], i);
+    uint64_t sum = 0;
+    for(auto &key : keys) sum += map.lookup(key);
+    auto seconds = std::chrono::duration<double>(bench::clock::now()-start).count();
+    bench::report(name, 1, keys.size()*2, seconds);
+    if(sum == 0) std::cout<<"";
+}
+
+/**
+ * std::hash against TSMap::hash on sequential ids, strided ids and strings
+ */
+void hashFunctions()
+{
+    const size_t keys = 1 << 20;
+    std::vector<uint64_t> sequential, strided;
+    std::vector<std::string> strings;
+    for(size_t i=0;i<keys;++i)
+    {
+        sequential.push_back(i);
+        strided.push_back(i << 16);
+        strings.push_back("user:" + std::to_string(i) + ":session");
+    }
+    hashInsertLookup<uint64_t, std::hash<uint64_t> >("hash/sequential/std_hash", sequential);
+    hashInsertLookup<uint64_t, TSMap::hash<uint64_t> >("hash/sequential/tsmap_hash", sequential);
+    hashInsertLookup<uint64_t, std::hash<uint64_t> >("hash/strided/std_hash", strided);
+    hashInsertLookup<uint64_t, TSMap::hash<uint64_t> >("hash/strided/tsmap_hash", strided);
+    hashInsertLookup<std::string, std::hash<std::string> >("hash/string/std_hash", strings);
+    hashInsertLookup<std::string, TSMap::hash<std::string> >("hash/string/tsmap_hash", strings);
+}
+
+/**
+ * a key that TSMap<uint64_t, ..., std::hash<uint64_t>> puts into bucket index
+ * of a table of 2^bits buckets. relies on the fibonacci indexing of TSMap:
+ * the index is the top bits of hash * phi, and std::hash is the identity, so
+ * multiplying the wanted top bits with the inverse of phi gives the key.
+ */
+uint64_t keyForBucket(size_t index, unsigned bits, uint64_t salt)
+{
+    const uint64_t phi = 0x9e3779b97f4a7c15ULL;
+    //newton iteration for the inverse modulo 2^64, each step doubles the
+    //number of correct bits
+    uint64_t inverse = phi;
+    for(int i=0;i<5;++i) inverse *= 2 - phi*inverse;
+    return (((uint64_t)index << (64-bits)) | salt) * inverse;
+}
+
+/**
+ * every thread updates a counter in its own bucket, the buckets of threads t
+ * and t+1 being neighbours in the bucket array. nothing is shared logically,
+ * so any slowdown with more threads comes from neighbouring buckets sharing
+ * cache lines, unless the buckets are padded.
+ */
+template <typename BucketT>
+void falseSharing(const std::string &name)
+{
+    const unsigned bits = 6;
+    const size_t opsPerThread = 1000000;
+    for(auto threads : threadCounts)
+    {
+        TSMap::TSMap<uint64_t, uint64_t, std::hash<uint64_t>,
+                     std::equal_to<uint64_t>, std::allocator<TSMap::pair<uint64_t, uint64_t> >,
+                     BucketT> map((size_t)1 << bits);
+        map.setMaxLoadFactor(0);
+        bench::PerfCounter misses(PERF_COUNT_HW_CACHE_MISSES);
+        auto before = misses.read();
+        auto seconds = bench::runThreads(threads, [&](size_t t)
+        {
+            auto key = keyForBucket(t % ((size_t)1 << bits), bits, t / ((size_t)1 << bits));
+            for(size_t i=0;i<opsPerThread;++i)
+            {
+                map.upsertWith(key, [](uint64_t &count){ ++count; });
+            }
+        });
+        auto ops = threads*opsPerThread;
+        bench::report(name, threads, ops, seconds);
+        if(misses.available())
+        {
+            std::cout<<std::left<<std::setw(48)<<name
+                     <<std::right<<std::setw(4)<<threads<<" threads "
+                     <<std::setw(10)<<std::fixed<<std::setprecision(2)
+                     <<(double)(misses.read()-before)/ops<<" cache misses/op"<<std::endl;
+        }
+    }
+}
+
+/**
+ * std::unordered_map behind one global mutex: the baseline TSMap has to beat
+ */
+template <typename KeyT, typename ValueT>
+class LockedUnorderedMap
+{
+    std::mutex mutex;
+    std::unordered_map<KeyT, ValueT> map;
+
+public:
+    void insert(const KeyT &key, const ValueT &value)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        map[key] = value;
+    }
+
+    TSMap::optional<ValueT> find(const KeyT &key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = map.find(key);
+        return it == map.end() ? TSMap::optional<ValueT>() : TSMap::optional<ValueT>(it->second);
+    }
+
+    void deleteByKey(const KeyT &key)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        map.erase(key);
+    }
+};
+
+enum class Workload { insert, lookup, erase, mixed };
+
+/**
+ * one run of the suite: threads threads do totalOps operations of workload
+ * on keys drawn uniformly, or from zipf if given, out of keys. every
+ * operation is timed for the latency percentiles.
+ *
+ * insert starts from an empty map, the others from a map holding all keys.
+ * mixed is 90% lookups, 5% inserts, 5% erases.
+ */
+template <typename MapT, typename KeyT>
+void suiteRun(const std::string &name, Workload workload, const std::vector<KeyT> &keys,
+              const bench::Zipf *zipf, size_t threads, size_t totalOps)
+{
+    MapT map;
+    if(workload != Workload::insert)
+    {
+        for(size_t i=0;i<keys.size();++i) map.insert(keys[i], i);
+    }
+    auto opsPerThread = totalOps/threads;
+    auto mask = keys.size()-1;
+    std::vector<bench::Latencies> latencies(threads);
+    std::atomic<size_t> hits(0);
+    auto seconds = bench::runThreads(threads, [&](size_t t)
+    {
+        bench::Random random(t+1);
+        auto &samples = latencies[t];
+        samples.samples.reserve(opsPerThread);
+        size_t localHits = 0;
+        for(size_t i=0;i<opsPerThread;++i)
+        {
+            //zipf ranks are scrambled so that hot keys are not neighbours
+            auto index = zipf ? (zipf->next(random)*0x9e3779b97f4a7c15ULL) & mask
+                              : random.next() & mask;
+            auto &key = keys[index];
+            auto op = workload;
+            if(op == Workload::mixed)
+            {
+                auto dice = random.next() % 100;
+                op = dice < 90 ? Workload::lookup : dice < 95 ? Workload::insert : Workload::erase;
+            }
+            auto start = bench::clock::now();
+            switch(op)
+            {
+            case Workload::insert:
+                map.insert(key, i);
+                break;
+            case Workload::lookup:
+                if(map.find(key)) ++localHits;
+                break;
+            default:
+                map.deleteByKey(key);
+                break;
+            }
+            samples.add(start, bench::clock::now());
+        }
+        hits += localHits;
+    });
+    for(size_t t=1;t<threads;++t) latencies[0].merge(latencies[t]);
+    bench::report(name, threads, opsPerThread*threads, seconds, latencies[0]);
+}
+
+template <typename KeyT>
+void suiteMaps(const std::string &name, Workload workload, const std::vector<KeyT> &keys,
+               const bench::Zipf *zipf, int argc, char **argv)
+{
+    const size_t totalOps = 1 << 18;
+    if(!bench::selected(name, argc, argv)) return;
+    for(auto threads : threadCounts)
+    {
+        suiteRun<TSMap::TSMap<KeyT, uint64_t> >(name + "/tsmap", workload, keys,
+                                                 zipf, threads, totalOps);
+        suiteRun<TSMap::LockFreeTSMap<KeyT, uint64_t> >(name + "/lockfree", workload, keys,
+                                                         zipf, threads, totalOps);
+        suiteRun<LockedUnorderedMap<KeyT, uint64_t> >(name + "/unordered_map_mutex", workload,
+                                                      keys, zipf, threads, totalOps);
+    }
+}
+
+/**
+ * the full suite: insert/lookup/erase/mixed x uniform/zipfian x integer/string
+ * keys x 1..64 threads, TSMap and LockFreeTSMap against std::unordered_map
+ * with a global mutex. reports throughput and p50/p99/p999 latency.
+ * filters narrow it down, e.g. ./bench suite/mixed/zipf
+ */
+void suite(int argc, char **argv)
+{
+    const size_t keyCount = 1 << 18;
+    std::vector<uint64_t> intKeys;
+    std::vector<std::string> stringKeys;
+    for(size_t i=0;i<keyCount;++i)
+    {
+        intKeys.push_back(i * 0x9e3779b97f4a7c15ULL);
+        stringKeys.push_back("user:" + std::to_string(i) + ":profile");
+    }
+    bench::Zipf zipf(keyCount, 0.99);
+
+    const std::pair<Workload, const char *> workloads[] = {
+        {Workload::insert, "insert"}, {Workload::lookup, "lookup"},
+        {Workload::erase, "erase"}, {Workload::mixed, "mixed"}};
+    for(auto &workload : workloads)
+    {
+        auto name = std::string("suite/") + workload.second;
+        suiteMaps(name + "/uniform/int", workload.first, intKeys, nullptr, argc, argv);
+        suiteMaps(name + "/zipf/int", workload.first, intKeys, &zipf, argc, argv);
+        suiteMaps(name + "/uniform/string", workload.first, stringKeys, nullptr, argc, argv);
+        suiteMaps(name + "/zipf/string", workload.first, stringKeys, &zipf, argc, argv);
+    }
+}
+
+/**
+ * a single bucket: count() hits and misses and updates of existing keys, for
+ * bucket sizes 8..128, KVPairList against TaggedKVPairList and
+ * IntegralKVPairList
+ */
+template <typename BucketT>
+void bucketOperations(const std::string &name)
+{
+    const size_t ops = 1 << 22;
+    for(size_t entries : {(size_t)8, (size_t)32, (size_t)128})
+    {
+        BucketT bucket;
+        for(size_t i=0;i<entries;++i) bucket.upsert(TSMap::make_pair((uint64_t)i, (uint64_t)i));
+        auto suffix = "/" + std::to_string(entries);
+        bench::Random random(entries);
+        size_t found = 0;
+
+        auto start = bench::clock::now();
+        for(size_t i=0;i<ops;++i) found += bucket.count(random.next() % entries);
+        bench::report(name + "/count_hit" + suffix, 1, ops,
+                std::chrono::duration<double>(bench::clock::now()-start).count());
+
+        start = bench::clock::now();
+        for(size_t i=0;i<ops;++i) found += bucket.count(entries + random.next() % entries);
+        bench::report(name + "/count_miss" + suffix, 1, ops,
+                std::chrono::duration<double>(bench::clock::now()-start).count());
+
+        start = bench::clock::now();
+        for(size_t i=0;i<ops;++i) bucket.upsert(TSMap::make_pair(random.next() % entries, (uint64_t)i));
+        bench::report(name + "/upsert_existing" + suffix, 1, ops,
+                std::chrono::duration<double>(bench::clock::now()-start).count());
+        if(found == 0) std::cout<<"";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if(bench::selected("read_scaling", argc, argv))
+    {
+        readScaling<std::mutex>("read_scaling/mutex/reads", 0);
+        readScaling<std::shared_timed_mutex>("read_scaling/shared_mutex/reads", 0);
+        readScaling<std::mutex>("read_scaling/mutex/95_reads", 5);
+        readScaling<std::shared_timed_mutex>("read_scaling/shared_mutex/95_reads", 5);
+    }
+    if(bench::selected("insert_lookup", argc, argv))
+    {
+        insertLookupScaling<TSMap::TSMap<uint64_t, uint64_t> >("insert_lookup/tsmap");
+        insertLookupScaling<TSMap::LockFreeTSMap<uint64_t, uint64_t> >("insert_lookup/lockfree");
+    }
+    if(bench::selected("counters", argc, argv))
+    {
+        counters();
+    }
+    if(bench::selected("bucket", argc, argv))
+    {
+        bucketOperations<TSMap::utility::KVPairList<uint64_t, uint64_t> >("bucket/kvpairlist");
+        bucketOperations<TSMap::utility::TaggedKVPairList<uint64_t, uint64_t> >("bucket/tagged");
+        bucketOperations<TSMap::utility::IntegralKVPairList<uint64_t, uint64_t> >("bucket/integral");
+    }
+    if(bench::selected("false_sharing", argc, argv))
+    {
+        using bucket = TSMap::utility::KVPairList<uint64_t, uint64_t>;
+        falseSharing<bucket>("false_sharing/packed");
+        falseSharing<TSMap::utility::Padded<bucket> >("false_sharing/padded");
+    }
+    if(bench::selected("hash", argc, argv))
+    {
+        hashFunctions();
+    }
+    if(bench::selected("batch", argc, argv))
+    {
+        //1M keys at load factor 4: a batch rarely has two keys in a bucket
+        batchOperations("batch/sparse", 1 << 20, 1 << 18);
+        //4096 keys in 1024 buckets: large batches share bucket locks
+        batchOperations("batch/dense", 1 << 12, 1 << 10);
+    }
+    if(bench::selected("growth", argc, argv))
+    {
+        growthLatency();
+    }
+    if(bench::selected("insert_allocations", argc, argv))
+    {
+        insertAllocations();
+    }
+    if(bench::selected("arena", argc, argv))
+    {
+        typedef TSMap::pair<uint64_t, uint64_t> entry;
+        arenaMemory<std::allocator<entry> >("arena/new");
+        arenaMemory<TSMap::utility::ArenaAllocator<entry> >("arena/arena");
+    }
+    if(bench::selected("restart", argc, argv))
+    {
+        restart();
+    }
+    if(bench::selected("cache", argc, argv))
+    {
+        cacheHitRatio();
+    }
+    if(bench::selected("combining", argc, argv))
+    {
+        hotKeyWrites();
+    }
+    if(bench::selected("sharded", argc, argv))
+    {
+        numaSharding();
+    }
+    if(bench::selected("simd", argc, argv))
+    {
+        simdScan<uint64_t>("simd/u64");
+        simdScan<uint32_t>("simd/u32");
+    }
+    if(bench::selected("recursion", argc, argv))
+    {
+        recursionModes();
+        recursionBatch();
+        recursionRange();
+        recursionWide();
+    }
+    if(bench::selected("suite", argc, argv))
+    {
+        suite(argc, argv);
+    }
+    return 0;
+}
@@ -0,0 +1,547 @@
+#pragma once
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <stdexcept>
+#include <algorithm>
+#include <cstdint>
+#include <KVPairList.hpp>
+#include <Hash.hpp>
+#include <SimdScan.hpp>
+
+
+namespace TSMap
+{
+
+namespace utility
+{
+
+/**
+ * an open-addressing "bucket", drop-in replacement for KVPairList
+ *
+ * underlying datastructure: three dynamically allocated arrays of the same
+ * power-of-two capacity:
+ *  - tags: one byte per slot. 0 = empty, 1 = deleted (tombstone), otherwise
+ *    0x80 | 7 bits of the key's hash (fingerprint)
+ *  - list: key-value pairs
+ *  - hashes: full hash of each occupied slot, only read when rehashing
+ *
+ * a lookup starts at the slot picked by the key's hash and walks the tag array
+ * linearly until an empty slot is found, 16 tags per SSE2 compare (see
+ * SimdScan.hpp). keys are only compared when the tag matches, so a probe
+ * sequence mostly stays in one or two cache lines of tags no matter how many
+ * entries the bucket holds.
+ *
+ * the table is rehashed when live entries plus tombstones exceed 7/8 of the
+ * capacity. it doubles if more than half of the slots hold live entries,
+ * otherwise it is rebuilt at the same size to purge the tombstones. erase
+ * rebuilds it as well, at a quarter of the size once less than 1/8 of the
+ * slots are live, or at the same size once half of them are tombstones.
+ *
+ * MutexT is the bucket lock and Allocator allocates the arrays, see
+ * KVPairList. probes, and the probe counters of TSMAP_ENABLE_STATS, count tag
+ * slots rather than compared keys.
+ *
+ * Hash is only used by the locked public interface: TSMap passes its own
+ * hashes to the *Unlocked methods.
+ */
+template <typename KeyT, typename ValueT, typename MutexT = std::mutex,
+          typename Hash = ::TSMap::hash<KeyT>,
+          typename KeyEqual = std::equal_to<KeyT>,
+          typename Allocator = std::allocator<pair<KeyT, ValueT> > >
+class TaggedKVPairList
+{
+public:
+    typedef typename BucketMutex<MutexT>::type mutex_type;
+    typedef typename ReadLock<mutex_type>::type read_lock;
+    typedef Allocator allocator_type;
+
+private:
+    //tag values:
+    static const uint8_t emptyTag = 0;
+    static const uint8_t deletedTag = 1;
+
+    /*
+     * the members a lookup reads (lock, tags, pairs, capacity) come first:
+     * with std::mutex they fill exactly one cache line, see utility::Padded.
+     */
+
+    //bucket-specific lock
+    mutex_type mutex;
+    //fingerprint array
+    uint8_t *tags;
+    //key-value pair array
+    pair<KeyT, ValueT> *list;
+    //allocated bucket size, always a power of two
+    size_t capacity;
+    //full hashes for rehashing
+    size_t *hashes;
+    //number of non-empty slots (live entries and tombstones)
+    size_t usedSlots;
+    //number of ``actual'' or valid entries
+    size_t validSize;
+    //set once the entries have been migrated to another table by TSMap
+    bool sealed;
+    Hash hashFunc;
+    KeyEqual keyEqual;
+    Allocator allocator;
+    TSMAP_STATS(BucketCounters counters;)
+
+public:
+    TaggedKVPairList(size_t capacity, const Allocator &allocator = Allocator()) :
+        tags(nullptr),
+        list(nullptr),
+        capacity(roundUpCapacity(capacity)),
+        hashes(nullptr),
+        usedSlots(0),
+        validSize(0),
+        sealed(false),
+        allocator(allocator)
+    {}
+
+    /**
+     * default constructor: bucket size = 32
+     */
+    TaggedKVPairList() :
+        TaggedKVPairList(32)
+    {}
+
+    explicit TaggedKVPairList(const Allocator &allocator) :
+        TaggedKVPairList(32, allocator)
+    {}
+
+    ~TaggedKVPairList()
+    {
+        clearUnlocked();
+    }
+
+    /**
+     * size()
+     * returns ``valid size'', or number of elements in list that's valid
+     */
+    size_t size()
+    {
+        read_lock lock(mutex);
+        auto retVal = validSize;
+        return retVal;
+    }
+
+    /**
+     * insert key-value pair if key didnt exist in list
+     * otherwise update preexisting key's value
+     *
+     * param: const pair of key-value
+     */
+    void upsert(const pair<KeyT, ValueT> &kv)
+    {
+        std::lock_guard<mutex_type> lock(mutex);
+        upsertUnlocked(kv, hashFunc(kv.first));
+    }
+
+    /**
+     * upsert moving key and value into the list
+     *
+     * param: pair of key-value
+     */
+    void upsert(pair<KeyT, ValueT> &&kv)
+    {
+        std::lock_guard<mutex_type> lock(mutex);
+        auto hash = hashFunc(kv.first);
+        upsertUnlocked(std::move(kv), hash);
+    }
+
+    /**
+     * outputs a string that represents the array of key-value pairs
+     *
+     * thread safety is not guaranteed
+     *
+     * for debugging purposes mostly.
+     */
+    friend std::ostream& operator<<(std::ostream &stream, const TaggedKVPairList& rhs)
+    {
+        if(!rhs.tags) return stream;
+        for(size_t i=0;i<rhs.capacity;++i){
+            if(rhs.tags[i] & 0x80)
+            stream<<rhs.list[i].first<<":"<<rhs.list[i].second<<", ";
+        }
+        return stream;
+    }
+
+    /**
+     * removes an element by key
+     *
+     * the slot is turned into a tombstone so that probe sequences running
+     * through it stay intact. tombstones are purged at rehash.
+     *
+     * if element not found in list, it is considered to be ``removed''
+     * param: key of object to be removed
+     */
+    void erase(const KeyT &key)
+    {
+        std::lock_guard<mutex_type> lock(mutex);
+        eraseUnlocked(key, hashFunc(key));
+    }
+
+    /**
+     * return 1 if key exists in list
+     * 0 otherwise
+     *
+     * param: key of element
+     */
+    size_t count(const KeyT &key)
+    {
+        read_lock lock(mutex);
+        auto count = findUnlocked(key, hashFunc(key)) ? 1 : 0;
+        return count;
+    }
+
+    /**
+     * get object with given key
+     *
+     * param: key of element
+     */
+    ValueT & operator[](const KeyT & key)
+    {
+        read_lock lock(mutex);
+        auto value = findUnlocked(key, hashFunc(key));
+        if(value)
+        {
+            return *value;
+        }
+        //this is why one should check for validity first using .count()
+        throw new std::invalid_argument("invalid key given in TaggedKVList");
+    }
+
+    /*
+     * unsynchronized interface, see KVPairList.
+     *
+     * the hash parameter must come from the same hash function for every call
+     * on a given bucket; it is remixed here to pick home slot and tag.
+     */
+
+    mutex_type & getMutex()
+    {
+        return mutex;
+    }
+
+    bool isSealed() const
+    {
+        return sealed;
+    }
+
+    void seal()
+    {
+        sealed = true;
+    }
+
+    size_t sizeUnlocked() const
+    {
+        return validSize;
+    }
+
+    size_t capacityUnlocked() const
+    {
+        return tags ? capacity : 0;
+    }
+
+    BucketStats statsUnlocked() const
+    {
+        BucketStats stats;
+        stats.size = validSize;
+        stats.capacity = capacityUnlocked();
+        stats.tombstones = usedSlots-validSize;
+        TSMAP_STATS(stats.setCounters(mutex, &counters);)
+        return stats;
+    }
+
+    void reserveUnlocked(size_t initialCapacity)
+    {
+        if(!tags && initialCapacity > 0) capacity = roundUpCapacity(initialCapacity);
+    }
+
+    /**
+     * makes room for count more entries without rehashing, see KVPairList
+     */
+    void reserveMoreUnlocked(size_t count)
+    {
+        if(count == 0) return;
+        auto fit = roundUpCapacity(((validSize+count)*8+6)/7);
+        if(!tags)
+        {
+            fit = std::max(fit, capacity);
+            allocate(fit);
+            capacity = fit;
+        }
+        else if((usedSlots+count)*8 > capacity*7)
+        {
+            rehash(std::max(fit, capacity));
+        }
+    }
+
+    ValueT * findUnlocked(const KeyT &key, size_t hash)
+    {
+        auto i = indexOf(key, mix(hash));
+        return i == npos ? nullptr : &list[i].second;
+    }
+
+    template <typename PairT>
+    bool upsertUnlocked(PairT &&kv, size_t hash)
+    {
+        auto value = findUnlocked(kv.first, hash);
+        if(value)
+        {
+            *value = std::forward<PairT>(kv).second;
+            return false;
+        }
+        insertUnlocked(std::forward<PairT>(kv), hash);
+        return true;
+    }
+
+    template <typename PairT>
+    ValueT * insertUnlocked(PairT &&kv, size_t hash)
+    {
+        hash = mix(hash);
+        if(!tags)
+        {
+            allocate(capacity);
+        }
+        //rehash before the insert would push the load over 7/8
+        else if((usedSlots+1)*8 > capacity*7)
+        {
+            rehash((validSize+1)*2 > capacity ? capacity*2 : capacity);
+        }
+        auto slot = insertSlot(hash);
+        if(tags[slot] == emptyTag) ++usedSlots;
+        tags[slot] = tagOf(hash);
+        list[slot] = std::forward<PairT>(kv);
+        hashes[slot] = hash;
+        ++validSize;
+        return &list[slot].second;
+    }
+
+    bool eraseUnlocked(const KeyT &key, size_t hash)
+    {
+        auto i = indexOf(key, mix(hash));
+        if(i == npos) return false;
+        tags[i] = deletedTag;
+        list[i] = pair<KeyT, ValueT>();
+        --validSize;
+
+        if(validSize*8 < capacity && capacity > minShrinkCapacity)
+        {
+            rehash(std::max(capacity/4, (size_t)minShrinkCapacity));
+        }
+        else if((usedSlots-validSize)*2 > capacity)
+        {
+            rehash(capacity);
+        }
+        return true;
+    }
+
+    void compactUnlocked()
+    {
+        if(usedSlots > validSize) rehash(capacity);
+    }
+
+    /**
+     * rebuilds the table at the smallest capacity that takes one more insert
+     * without rehashing; releases the arrays if the bucket is empty
+     */
+    void shrinkToFitUnlocked()
+    {
+        if(!tags) return;
+        if(validSize == 0)
+        {
+            clearUnlocked();
+            capacity = minShrinkCapacity;
+            return;
+        }
+        auto fit = roundUpCapacity(((validSize+1)*8+6)/7);
+        if(fit < capacity || usedSlots > validSize) rehash(fit);
+    }
+
+    template <typename FuncT>
+    void forEachUnlocked(FuncT fn)
+    {
+        if(!tags) return;
+        for(size_t i=0;i<capacity;++i)
+        {
+            if(tags[i] & 0x80) fn(list[i]);
+        }
+    }
+
+    void clearUnlocked()
+    {
+        release(tags, list, hashes, capacity);
+        tags = nullptr;
+        list = nullptr;
+        hashes = nullptr;
+        usedSlots = 0;
+        validSize = 0;
+    }
+
+private:
+    static const size_t npos = (size_t)-1;
+    //capacity below which erase does not shrink the table
+    static const size_t minShrinkCapacity = 32;
+
+    static size_t roundUpCapacity(size_t capacity)
+    {
+        size_t rounded = 8;
+        while(rounded < capacity) rounded *= 2;
+        return rounded;
+    }
+
+    /**
+     * TSMap picks the bucket from the top bits of the hash, so they are
+     * identical for every key in a bucket; the hash is remixed before
+     * picking the home slot and the tag.
+     */
+    static size_t mix(size_t hash)
+    {
+        return (size_t)mix64(hash);
+    }
+
+    static uint8_t tagOf(size_t hash)
+    {
+        return (uint8_t)(0x80 | (hash >> (sizeof(size_t)*8 - 7)));
+    }
+
+    /**
+     * allocates the three arrays at the given capacity, all tags empty.
+     * the previous arrays must have been handed to release.
+     */
+    void allocate(size_t capacity)
+    {
+        tags = nullptr;
+        list = nullptr;
+        hashes = nullptr;
+        try
+        {
+            tags = allocateArray<uint8_t>(allocator, capacity);
+            list = allocateArray<pair<KeyT, ValueT> >(allocator, capacity);
+            hashes = allocateArray<size_t>(allocator, capacity);
+        }
+        catch(...)
+        {
+            release(tags, list, hashes, capacity);
+            tags = nullptr;
+            list = nullptr;
+            throw;
+        }
+    }
+
+    void release(uint8_t *tags, pair<KeyT, ValueT> *list, size_t *hashes, size_t capacity)
+    {
+        deallocateArray(allocator, tags, capacity);
+        deallocateArray(allocator, list, capacity);
+        deallocateArray(allocator, hashes, capacity);
+    }
+
+    /**
+     * return slot of key if key exists in list
+     * npos otherwise
+     *
+     * not thread safe, should always be called by own class methods
+     *
+     * params: key of element and its mixed hash
+     */
+    size_t indexOf(const KeyT &key, size_t hash)
+    {
+        TSMAP_STATS(counters.lookups.fetch_add(1, std::memory_order_relaxed);)
+        if(!tags) return npos;
+        auto mask = capacity-1;
+        auto tag = tagOf(hash);
+        auto slot = hash & mask;
+        for(size_t probe=0;probe<capacity;)
+        {
+            //a whole group of tags at once, unless it would wrap around
+            if(slot + simd::byteGroupSize <= capacity)
+            {
+                auto matches = simd::matchBytes(tags+slot, tag);
+                auto empties = simd::matchBytes(tags+slot, emptyTag);
+                //the probe sequence ends at the first empty slot
+                if(empties) matches &= (empties & (0u-empties)) - 1;
+                TSMAP_STATS(counters.probes.fetch_add(
+                        empties ? __builtin_ctz(empties)+1 : simd::byteGroupSize,
+                        std::memory_order_relaxed);)
+                while(matches)
+                {
+                    auto i = slot + __builtin_ctz(matches);
+                    if(keyEqual(list[i].first, key)) return i;
+                    matches &= matches-1;
+                }
+                if(empties) break;
+                slot = (slot + simd::byteGroupSize) & mask;
+                probe += simd::byteGroupSize;
+                continue;
+            }
+            TSMAP_STATS(counters.probes.fetch_add(1, std::memory_order_relaxed);)
+            auto t = tags[slot];
+            if(t == emptyTag) break;
+            if(t == tag && keyEqual(list[slot].first, key)) return slot;
+            slot = (slot+1) & mask;
+            ++probe;
+        }
+        return npos;
+    }
+
+    /**
+     * first empty or deleted slot on the probe sequence of hash.
+     * there is always one since the load is kept below 7/8.
+     */
+    size_t insertSlot(size_t hash)
+    {
+        auto mask = capacity-1;
+        auto slot = hash & mask;
+        while(tags[slot] & 0x80)
+        {
+            slot = (slot+1) & mask;
+        }
+        return slot;
+    }
+
+    /**
+     * rebuilds the table at the given capacity, dropping the tombstones
+     *
+     * param: new capacity, a power of two large enough for all live entries
+     */
+    void rehash(size_t newCapacity)
+    {
+        auto oldTags = tags;
+        auto oldList = list;
+        auto oldHashes = hashes;
+        auto oldCapacity = capacity;
+
+        try
+        {
+            allocate(newCapacity);
+        }
+        catch(...)
+        {
+            tags = oldTags;
+            list = oldList;
+            hashes = oldHashes;
+            throw;
+        }
+        capacity = newCapacity;
+        usedSlots = 0;
+        TSMAP_STATS(counters.resizes.fetch_add(1, std::memory_order_relaxed);)
+        for(size_t i=0;i<oldCapacity;++i)
+        {
+            if(!(oldTags[i] & 0x80)) continue;
+            auto hash = oldHashes[i];
+            auto slot = insertSlot(hash);
+            tags[slot] = oldTags[i];
+            list[slot] = std::move(oldList[i]);
+            hashes[slot] = hash;
+            ++usedSlots;
+        }
+        release(oldTags, oldList, oldHashes, oldCapacity);
+    }
+};
+
+}//end utility namespace
+
+}//end tsmap ns
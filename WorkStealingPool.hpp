@@ -0,0 +1,244 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <exception>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+
+
+namespace TSMap
+{
+
+namespace utility
+{
+
+/**
+ * a fixed set of threads that run loops over chunks of [0, count), with the
+ * calling thread taking part.
+ *
+ * the chunks of a loop are dealt out evenly to the participants up front, as
+ * one range of chunk indices each. a participant takes chunks from the front
+ * of its own range, and once it runs dry steals the back half of the range
+ * of another one. a participant that got chunks slower than the others, or
+ * ran on a busy cpu, hands its remaining work to the idle ones instead of
+ * holding up the loop. ranges are locked once per chunk, so chunks should be
+ * well above a microsecond of work.
+ *
+ * one loop runs at a time: concurrent callers of forChunks wait for each
+ * other.
+ */
+class WorkStealingPool
+{
+public:
+    /**
+     * param: number of threads besides the calling one, 0 for one per cpu
+     * less the caller
+     */
+    explicit WorkStealingPool(size_t threads = 0) :
+        threadCount(threads > 0 ? threads :
+                    std::max(std::thread::hardware_concurrency(), 1u) - 1),
+        threads(new std::thread[threadCount]),
+        queues(new Queue[threadCount+1]),
+        job(nullptr),
+        generation(0),
+        finished(0),
+        stopping(false)
+    {
+        for(size_t i=0;i<threadCount;++i)
+        {
+            this->threads[i] = std::thread([this](size_t self){ work(self); }, i+1);
+        }
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool & operator=(const WorkStealingPool &) = delete;
+
+    ~WorkStealingPool()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(size_t i=0;i<threadCount;++i) threads[i].join();
+    }
+
+    /**
+     * threads taking part in a loop, the caller included
+     */
+    size_t participants() const
+    {
+        return threadCount + 1;
+    }
+
+    /**
+     * calls fn(begin, end) for the chunks [begin, end) of [0, count), chunk
+     * items each but the last, on all participants, and returns once every
+     * chunk is done. the first exception thrown by fn is rethrown here, after
+     * the remaining chunks ran.
+     */
+    template <typename FuncT>
+    void forChunks(uint64_t count, uint64_t chunk, FuncT fn)
+    {
+        if(count == 0) return;
+        chunk = std::max(chunk, (uint64_t)1);
+        std::lock_guard<std::mutex> serial(jobLock);
+
+        Job current;
+        current.count = count;
+        current.chunk = chunk;
+        current.context = &fn;
+        current.call = [](void *context, uint64_t begin, uint64_t end)
+        {
+            (*static_cast<FuncT*>(context))(begin, end);
+        };
+        uint64_t chunks = (count-1)/chunk + 1;
+        uint64_t share = chunks/participants(), rest = chunks%participants(), next = 0;
+        for(size_t i=0;i<participants();++i)
+        {
+            queues[i].begin = next;
+            next += share + (i < rest ? 1 : 0);
+            queues[i].end = next;
+        }
+
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            job = &current;
+            finished = 0;
+            ++generation;
+        }
+        wake.notify_all();
+        run(current, 0);
+
+        //current lives on this stack: every thread must be done with it
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [&]{ return finished == threadCount; });
+        job = nullptr;
+        if(current.error) std::rethrow_exception(current.error);
+    }
+
+private:
+    struct Job
+    {
+        uint64_t count;
+        uint64_t chunk;
+        void *context;
+        void (*call)(void *, uint64_t, uint64_t);
+        std::mutex errorLock;
+        std::exception_ptr error;
+    };
+
+    /**
+     * the chunk indices [begin, end) a participant has not started yet
+     */
+    struct Queue
+    {
+        std::mutex lock;
+        uint64_t begin = 0;
+        uint64_t end = 0;
+    };
+
+    size_t threadCount;
+    std::unique_ptr<std::thread[]> threads;
+    std::unique_ptr<Queue[]> queues;
+
+    //serializes loops
+    std::mutex jobLock;
+    //guards job, generation, finished and stopping
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    Job *job;
+    uint64_t generation;
+    size_t finished;
+    bool stopping;
+
+    void work(size_t self)
+    {
+        uint64_t seen = 0;
+        while(true)
+        {
+            Job *current;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [&]{ return stopping || generation != seen; });
+                if(stopping) return;
+                seen = generation;
+                current = job;
+            }
+            run(*current, self);
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                ++finished;
+            }
+            done.notify_one();
+        }
+    }
+
+    /**
+     * takes chunks from the queue of self, then from the others, until none
+     * is left unstarted
+     */
+    void run(Job &current, size_t self)
+    {
+        uint64_t index;
+        while(take(self, index) || steal(self, index))
+        {
+            auto begin = index*current.chunk;
+            auto end = std::min(begin + current.chunk, current.count);
+            try
+            {
+                current.call(current.context, begin, end);
+            }
+            catch(...)
+            {
+                std::lock_guard<std::mutex> guard(current.errorLock);
+                if(!current.error) current.error = std::current_exception();
+            }
+        }
+    }
+
+    bool take(size_t self, uint64_t &index)
+    {
+        auto &queue = queues[self];
+        std::lock_guard<std::mutex> guard(queue.lock);
+        if(queue.begin == queue.end) return false;
+        index = queue.begin++;
+        return true;
+    }
+
+    /**
+     * moves the back half of the first non-empty queue after self to self,
+     * and takes its first chunk
+     */
+    bool steal(size_t self, uint64_t &index)
+    {
+        for(size_t i=1;i<participants();++i)
+        {
+            auto &victim = queues[(self+i) % participants()];
+            uint64_t begin, end;
+            {
+                std::lock_guard<std::mutex> guard(victim.lock);
+                if(victim.begin == victim.end) continue;
+                end = victim.end;
+                begin = end - (end - victim.begin + 1)/2;
+                victim.end = begin;
+            }
+            auto &queue = queues[self];
+            std::lock_guard<std::mutex> guard(queue.lock);
+            index = begin;
+            queue.begin = begin+1;
+            queue.end = end;
+            return true;
+        }
+        return false;
+    }
+};
+
+}//end utility namespace
+
+}//end tsmap ns
@@ -0,0 +1,731 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <functional>
+#include <type_traits>
+#include <TSCache.hpp>
+#include <SimdScan.hpp>
+#include <WorkStealingPool.hpp>
+#include <BigUnsigned.hpp>
+
+
+/**
+ * returns true if num is a power of 2
+ * otherwise false
+ */
+template <typename T>
+inline bool isPowerOfTwo(const T &num)
+{
+    T number = num;
+    return ((number & (number-1)) == 0);
+}
+
+/**
+ * returns the greatest factor of num
+ * that is odd
+ */
+template <typename T>
+inline T divideByTwoIfEven(const T &num)
+{
+    T number = num;
+    while(number%2==0 && number > 0) {number/=2;}
+    return number;
+}
+
+/**
+ * returns the odd factor for the decomposition relationship
+ * f(2n+1) = f(n) + f(n-1)
+ */
+template <typename T>
+inline T getOddFactor(const T &num)
+{
+    T number = num;
+    return ((number / 2) % 2 ? number/2 : (number/2)-1);
+}
+
+/**
+ * returns the even factor for the decomposition relationship
+ * f(2n+1) = f(n) + f(n-1)
+ */
+template <typename T>
+inline T getEvenFactor(const T &num)
+{
+    T number = num;
+    return ((number/2) % 2 ? (number/2)-1 : number/2);
+}
+
+/**
+ * evaluates f(n) of the recursion relationship below in one pass over the
+ * bits of n, from the lowest: no table, no allocation, O(log n) steps.
+ *
+ * f(n) = a*f(m) + b*f(m-1) + c*f(m-2) holds from m = n, (a, b, c) = (1, 0, 0)
+ * down to m = 0, with m = 2k halved to k as
+ *     (a, b, c) -> (a, b+c, b)
+ * since f(2k) = f(k), f(2k-1) = f(k-1) + f(k-2), f(2k-2) = f(k-1), and
+ * m = 2k+1 halved to k as
+ *     (a, b, c) -> (a+b, a+c, c)
+ * since f(2k+1) = f(k) + f(k-1), f(2k) = f(k), f(2k-1) = f(k-1) + f(k-2).
+ * with f(-1) = f(-2) = 0 both hold down to k = 0, where f(n) = a*f(0) = a.
+ * a does not change on m = 0 any more, so a fixed number of steps of at least
+ * the bit length of n gives f(n) too: the batch kernels below run the same
+ * steps for every lane. the bit picks the update with masks instead of a
+ * branch.
+ */
+inline uint64_t evaluateBitWalk(uint64_t num)
+{
+    uint64_t a = 1, b = 0, c = 0;
+    for(auto m=num;m;m>>=1)
+    {
+        //all ones for an odd m
+        uint64_t odd = 0 - (m & 1);
+        uint64_t nextA = a + (b & odd);
+        uint64_t nextB = ((a & odd) | (b & ~odd)) + c;
+        c = (c & odd) | (b & ~odd);
+        a = nextA;
+        b = nextB;
+    }
+    return a;
+}
+
+namespace bitwalk
+{
+
+/**
+ * one step of the walk on the coefficients, for the lowest bit of word
+ */
+template <typename T>
+inline void step(T &a, T &b, T &c, uint64_t word)
+{
+    T odd = T(0) - T(word & 1);
+    T nextA = a + (b & odd);
+    T nextB = ((a & odd) | (b & ~odd)) + c;
+    c = (c & odd) | (b & ~odd);
+    a = nextA;
+    b = nextB;
+}
+
+/**
+ * the coefficients grow by at most a factor of 2 a step, a+b+c <= 2^j after
+ * j steps: the first 63 steps of any input run on 64 bit words, the next 64
+ * on 128 bit words
+ */
+static const unsigned narrowSteps = 63;
+
+}//end bitwalk namespace
+
+/**
+ * f(n) for other unsigned integer types, unsigned __int128 in particular.
+ * types of at most 64 bits take the uint64_t walk, so that one stays as it
+ * is. wider ones walk their lowest 63 bits on 64 bit words, then the rest in
+ * T, at the cost of T additions only where the coefficients need them.
+ */
+template <typename T>
+typename std::enable_if<!std::is_signed<T>::value, T>::type evaluateBitWalk(const T &num)
+{
+    if(sizeof(T) <= sizeof(uint64_t)) return (T)evaluateBitWalk((uint64_t)num);
+    uint64_t a = 1, b = 0, c = 0;
+    T m = num;
+    for(unsigned i=0;i<bitwalk::narrowSteps && m!=T(0);++i,m=m>>1) bitwalk::step(a, b, c, (uint64_t)m);
+
+    T wideA = a, wideB = b, wideC = c;
+    for(;m!=T(0);m=m>>1) bitwalk::step(wideA, wideB, wideC, (uint64_t)m);
+    return wideA;
+}
+
+/**
+ * f(n) for a BigUnsigned n, of any size: the first 63 steps on 64 bit words,
+ * the next 64 on 128 bit words, the rest on BigUnsigned coefficients. those
+ * are updated in place with additions and swaps,
+ *     odd:  b += a, swap(a, b), b += c    -> (a+b, a+c, c)
+ *     even: c += b, swap(b, c)            -> (a, b+c, b)
+ * so a step costs one or two additions over the limbs of the coefficients,
+ * which grow by about a bit a step: O(bits^2 / 64) for the walk.
+ */
+inline BigUnsigned evaluateBitWalk(const BigUnsigned &num)
+{
+    auto bits = num.bitLength();
+    uint64_t a = 1, b = 0, c = 0;
+    size_t i = 0;
+    for(;i<bitwalk::narrowSteps && i<bits;++i) bitwalk::step(a, b, c, num.bit(i));
+    if(i == bits) return BigUnsigned(a);
+
+    unsigned __int128 wideA = a, wideB = b, wideC = c;
+    for(;i<2*bitwalk::narrowSteps+1 && i<bits;++i) bitwalk::step(wideA, wideB, wideC, num.bit(i));
+    BigUnsigned bigA(wideA), bigB(wideB), bigC(wideC);
+    for(;i<bits;++i)
+    {
+        if(num.bit(i))
+        {
+            bigB += bigA;
+            swap(bigA, bigB);
+            bigB += bigC;
+        }
+        else
+        {
+            bigC += bigB;
+            swap(bigB, bigC);
+        }
+    }
+    return bigA;
+}
+
+/**
+ * evaluateBitWalk over arrays, several inputs per instruction.
+ *
+ * the inputs are taken in groups, and every step of the walk runs on all
+ * lanes of a group, as many times as the longest input of the group has bits.
+ * AVX-512 walks 16 inputs at a time in two vectors, AVX2 8 in two vectors,
+ * two independent chains of dependent adds so that one runs while the other
+ * waits. the widest level the cpu supports is picked once at runtime, so the
+ * same binary runs on cpus without them; elsewhere, or with TSMAP_NO_SIMD
+ * defined, the scalar walk.
+ */
+namespace bitwalk
+{
+
+enum class Level
+{
+    scalar,
+    avx2,
+    avx512
+};
+
+inline void evaluateScalar(const uint64_t *in, uint64_t *out, size_t count)
+{
+    for(size_t i=0;i<count;++i) out[i] = evaluateBitWalk(in[i]);
+}
+
+/**
+ * steps for a group of inputs: the bit length of the longest one
+ */
+inline unsigned stepsFor(const uint64_t *in, size_t count)
+{
+    uint64_t bits = 0;
+    for(size_t i=0;i<count;++i) bits |= in[i];
+    return bits ? 64 - __builtin_clzll(bits) : 0;
+}
+
+#ifdef TSMAP_SIMD_X86
+
+__attribute__((target("avx2")))
+inline void evaluateAvx2(const uint64_t *in, uint64_t *out, size_t count)
+{
+    const auto one = _mm256_set1_epi64x(1);
+    const auto zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for(;i+8<=count;i+=8)
+    {
+        __m256i m[2], a[2], b[2], c[2];
+        for(int j=0;j<2;++j)
+        {
+            m[j] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in+i+4*j));
+            a[j] = one;
+            b[j] = zero;
+            c[j] = zero;
+        }
+        for(auto step=stepsFor(in+i, 8);step>0;--step)
+        {
+            for(int j=0;j<2;++j)
+            {
+                auto odd = _mm256_cmpeq_epi64(_mm256_and_si256(m[j], one), one);
+                auto nextA = _mm256_add_epi64(a[j], _mm256_and_si256(b[j], odd));
+                auto nextB = _mm256_add_epi64(_mm256_blendv_epi8(b[j], a[j], odd), c[j]);
+                c[j] = _mm256_blendv_epi8(b[j], c[j], odd);
+                a[j] = nextA;
+                b[j] = nextB;
+                m[j] = _mm256_srli_epi64(m[j], 1);
+            }
+        }
+        for(int j=0;j<2;++j) _mm256_storeu_si256(reinterpret_cast<__m256i*>(out+i+4*j), a[j]);
+    }
+    evaluateScalar(in+i, out+i, count-i);
+}
+
+__attribute__((target("avx512f")))
+inline void evaluateAvx512(const uint64_t *in, uint64_t *out, size_t count)
+{
+    const auto one = _mm512_set1_epi64(1);
+    const auto zero = _mm512_setzero_si512();
+    size_t i = 0;
+    for(;i+16<=count;i+=16)
+    {
+        __m512i m[2], a[2], b[2], c[2];
+        for(int j=0;j<2;++j)
+        {
+            m[j] = _mm512_loadu_si512(in+i+8*j);
+            a[j] = one;
+            b[j] = zero;
+            c[j] = zero;
+        }
+        for(auto step=stepsFor(in+i, 16);step>0;--step)
+        {
+            for(int j=0;j<2;++j)
+            {
+                auto odd = _mm512_test_epi64_mask(m[j], one);
+                auto nextA = _mm512_mask_add_epi64(a[j], odd, a[j], b[j]);
+                auto nextB = _mm512_add_epi64(_mm512_mask_blend_epi64(odd, b[j], a[j]), c[j]);
+                c[j] = _mm512_mask_blend_epi64(odd, b[j], c[j]);
+                a[j] = nextA;
+                b[j] = nextB;
+                m[j] = _mm512_srli_epi64(m[j], 1);
+            }
+        }
+        for(int j=0;j<2;++j) _mm512_storeu_si512(out+i+8*j, a[j]);
+    }
+    evaluateAvx2(in+i, out+i, count-i);
+}
+
+#endif
+
+/**
+ * the widest level the cpu supports, determined once
+ */
+inline Level supportedLevel()
+{
+#ifdef TSMAP_SIMD_X86
+    static const Level level = __builtin_cpu_supports("avx512f") ? Level::avx512 :
+                               __builtin_cpu_supports("avx2") ? Level::avx2 : Level::scalar;
+    return level;
+#else
+    return Level::scalar;
+#endif
+}
+
+/**
+ * the kernel of the given level, which must be supported. for tests and
+ * benchmarks, callers use evaluateBitWalk without a level.
+ */
+inline void evaluate(const uint64_t *in, uint64_t *out, size_t count, Level level)
+{
+#ifdef TSMAP_SIMD_X86
+    if(level == Level::avx512) return evaluateAvx512(in, out, count);
+    if(level == Level::avx2) return evaluateAvx2(in, out, count);
+#endif
+    (void)level;
+    evaluateScalar(in, out, count);
+}
+
+}//end bitwalk namespace
+
+/**
+ * out[i] = f(in[i]) for count inputs, on the widest kernel the cpu supports.
+ * in and out may be the same array.
+ */
+inline void evaluateBitWalk(const uint64_t *in, uint64_t *out, size_t count)
+{
+    bitwalk::evaluate(in, out, count, bitwalk::supportedLevel());
+}
+
+/**
+ * the values f(n), f(n+1), f(n+2), ... one after another, each from the
+ * previous one in amortized O(1).
+ *
+ * the walk of evaluateBitWalk also works from the highest bit down: with
+ * v(k) = (f(k), f(k-1), f(k-2)) and v(0) = (1, 0, 0),
+ *     v(2k)   = (f(k), f(k-1) + f(k-2), f(k-1))
+ *     v(2k+1) = (f(k) + f(k-1), f(k), f(k-1) + f(k-2))
+ * the sequence keeps v(n >> j) for every level j. n+1 differs from n in the
+ * trailing ones of n and the zero above them, t+1 bits for t trailing ones,
+ * so advancing redoes the lowest t+1 levels only: one level for an even n,
+ * two on average.
+ */
+class RecursionSequence
+{
+public:
+    explicit RecursionSequence(uint64_t first = 0) :
+        n(first)
+    {
+        levels[64] = Level{1, 0, 0};
+        rebuild(64);
+    }
+
+    /**
+     * n
+     */
+    uint64_t index() const
+    {
+        return n;
+    }
+
+    /**
+     * f(n)
+     */
+    uint64_t value() const
+    {
+        return levels[0].value;
+    }
+
+    /**
+     * moves to n+1, from UINT64_MAX to 0
+     */
+    void advance()
+    {
+        unsigned changed = ~n ? __builtin_ctzll(~n) + 1 : 64;
+        ++n;
+        rebuild(changed);
+    }
+
+    /**
+     * f(n) and moves to n+1
+     */
+    uint64_t next()
+    {
+        auto result = value();
+        advance();
+        return result;
+    }
+
+    /**
+     * out[i] = f(n+i) for count values, and moves to n+count.
+     *
+     * from a multiple of 4 on, four values at a time from v(k), k = n/4:
+     * f(4k) = f(k), f(4k+1) = f(k) + f(k-1) + f(k-2),
+     * f(4k+2) = f(k) + f(k-1), f(4k+3) = 2f(k) + f(k-1)
+     * and only the levels from 2 up follow k.
+     */
+    void fill(uint64_t *out, size_t count)
+    {
+        size_t i = 0;
+        for(;i<count && (n & 3);++i) out[i] = next();
+        //n/4 has at most 62 bits, so ~(n >> 2) has a set bit below bit 62.
+        //the last four numbers wrap around to 0 through next()
+        for(;i+4<=count && n+4 != 0;i+=4)
+        {
+            const auto &v = levels[2];
+            out[i] = v.value;
+            out[i+1] = v.value + v.previous + v.beforePrevious;
+            out[i+2] = v.value + v.previous;
+            out[i+3] = 2*v.value + v.previous;
+            unsigned changed = __builtin_ctzll(~(n >> 2)) + 1;
+            n += 4;
+            rebuild(changed+2, 2);
+        }
+        rebuild(2);
+        for(;i<count;++i) out[i] = next();
+    }
+
+private:
+    struct Level
+    {
+        //f(k), f(k-1), f(k-2)
+        uint64_t value;
+        uint64_t previous;
+        uint64_t beforePrevious;
+    };
+
+    //levels[j] for k = n >> j, levels[64] for k = 0
+    Level levels[65];
+    uint64_t n;
+
+    /**
+     * levels top-1 down to bottom from n, top and the ones above it being
+     * those of n
+     */
+    void rebuild(unsigned top, unsigned bottom = 0)
+    {
+        for(auto j=top;j>bottom;--j)
+        {
+            auto &up = levels[j];
+            auto &down = levels[j-1];
+            if((n >> (j-1)) & 1)
+            {
+                down = Level{up.value + up.previous, up.value, up.previous + up.beforePrevious};
+            }
+            else
+            {
+                down = Level{up.value, up.previous + up.beforePrevious, up.previous};
+            }
+        }
+    }
+};
+
+/**
+ * out[i] = f(first+i) for n in [first, last), in order, on the calling thread
+ */
+inline void evaluateRange(uint64_t first, uint64_t last, uint64_t *out)
+{
+    if(last <= first) return;
+    RecursionSequence sequence(first);
+    sequence.fill(out, last-first);
+}
+
+namespace range
+{
+
+//values of a range generated, or passed to a callback, at once
+static const size_t blockSize = 4096;
+//values per chunk of a parallel range: a few hundred microseconds of work
+static const uint64_t chunkSize = (uint64_t)1 << 16;
+
+}//end range namespace
+
+/**
+ * calls fn(uint64_t n, const uint64_t *values, size_t count) with
+ * values[i] = f(n+i) for consecutive blocks of [first, last), in order, on
+ * the calling thread. a block is at most range::blockSize values, and only
+ * valid during the call.
+ */
+template <typename FuncT>
+void evaluateRange(uint64_t first, uint64_t last, FuncT fn)
+{
+    if(last <= first) return;
+    RecursionSequence sequence(first);
+    uint64_t block[range::blockSize];
+    while(sequence.index() != last)
+    {
+        auto n = sequence.index();
+        auto count = (size_t)std::min<uint64_t>(last-n, range::blockSize);
+        sequence.fill(block, count);
+        fn(n, (const uint64_t*)block, count);
+    }
+}
+
+/**
+ * out[i] = f(first+i) for n in [first, last), split into chunks of
+ * range::chunkSize over the threads of pool. every chunk starts a sequence
+ * of its own, at O(log n), and writes its part of out.
+ */
+inline void evaluateRange(uint64_t first, uint64_t last, uint64_t *out,
+                          TSMap::utility::WorkStealingPool &pool)
+{
+    if(last <= first) return;
+    pool.forChunks(last-first, range::chunkSize, [=](uint64_t begin, uint64_t end)
+    {
+        evaluateRange(first+begin, first+end, out+begin);
+    });
+}
+
+/**
+ * the blocks of evaluateRange(first, last, fn) on the threads of pool: fn is
+ * called concurrently, out of order, and blocks never cross a chunk of
+ * range::chunkSize values.
+ */
+template <typename FuncT>
+void evaluateRange(uint64_t first, uint64_t last, FuncT fn,
+                   TSMap::utility::WorkStealingPool &pool)
+{
+    if(last <= first) return;
+    pool.forChunks(last-first, range::chunkSize, [&](uint64_t begin, uint64_t end)
+    {
+        evaluateRange(first+begin, first+end, std::ref(fn));
+    });
+}
+
+/**
+ * evaluates f(n) defined by the following recursion relationship:
+ *
+ * f(0) = 1
+ * f(1) = 1
+ * f(2n) = f(n)
+ * f(2n+1) = f(n) + f(n-1)
+ *
+ * with dynamic programming on a memo shared by all threads that use the
+ * engine. f(2n) = f(n), so only odd numbers are memoized: an odd number is
+ * decomposed into the odd and the even factor above, the even one reduced
+ * to its greatest odd factor, down to numbers whose value is known.
+ *
+ * the memo is a TSMap::TSCache: sharded by key with a lock per shard, and
+ * bounded, evicting the least recently used values (CLOCK) once full. many
+ * threads can evaluate concurrently and share the values of common factors,
+ * and a long running process does not grow the memo without bound. a value
+ * evicted halfway through an evaluation is recomputed: every evaluation also
+ * keeps the factors it computed in a small table of its own.
+ *
+ * Mode::bitWalk evaluates with evaluateBitWalk instead and leaves the memo
+ * alone: constant memory and no locks, at O(log n) steps for every call
+ * where the memo answers numbers it has seen in one lookup.
+ */
+class RecursionEngine
+{
+public:
+    enum class Mode
+    {
+        //dynamic programming on the shared memo
+        memo,
+        //evaluateBitWalk, no memo
+        bitWalk
+    };
+
+    /**
+     * params: number of odd values the memo holds at most, number of memo
+     * shards (0 picks one from the capacity, see TSCache), mode of evaluate(n)
+     */
+    explicit RecursionEngine(size_t memoCapacity = (size_t)1 << 16, size_t memoShards = 0,
+                             Mode mode = Mode::memo) :
+        memo(memoCapacity, TSMap::TSCache<uint64_t, uint64_t>::clock::duration::zero(), memoShards),
+        mode(mode)
+    {}
+
+    RecursionEngine(const RecursionEngine &) = delete;
+    RecursionEngine & operator=(const RecursionEngine &) = delete;
+
+    /**
+     * param: n
+     * returns: f(n)
+     *
+     * f(n) is at most n, so there is no overflow for any uint64_t n
+     */
+    uint64_t evaluate(uint64_t num)
+    {
+        return evaluate(num, mode);
+    }
+
+    /**
+     * f(n) in the given mode rather than that of the engine
+     */
+    uint64_t evaluate(uint64_t num, Mode with)
+    {
+        if(with == Mode::bitWalk) return evaluateBitWalk(num);
+        if(isPowerOfTwo(num)) return 1;
+        Scratch scratch;
+        return evaluateOdd(divideByTwoIfEven(num), scratch);
+    }
+
+    /**
+     * out[i] = f(in[i]) for count inputs. Mode::bitWalk evaluates them with
+     * the batch kernels of evaluateBitWalk, Mode::memo one at a time on the
+     * memo. in and out may be the same array.
+     */
+    void evaluate(const uint64_t *in, uint64_t *out, size_t count)
+    {
+        if(mode == Mode::bitWalk) return evaluateBitWalk(in, out, count);
+        for(size_t i=0;i<count;++i) out[i] = evaluate(in[i], Mode::memo);
+    }
+
+    Mode getMode() const
+    {
+        return mode;
+    }
+
+    /**
+     * hits, misses and evictions of the memo
+     */
+    TSMap::CacheStats memoStats()
+    {
+        return memo.stats();
+    }
+
+    size_t memoSize()
+    {
+        return memo.size();
+    }
+
+    size_t memoCapacity()
+    {
+        return memo.capacity();
+    }
+
+    void clearMemo()
+    {
+        memo.clear();
+    }
+
+private:
+    /**
+     * the odd factors computed by one evaluation, open addressing on the
+     * key. the factors a level down are the halves of those of the level
+     * above, minus at most one: about two odd factors per bit, at most 128
+     * for a 64 bit number, so the table stays at most half full.
+     */
+    struct Scratch
+    {
+        static const size_t size = 256;
+        //0 for an empty slot, factors are odd
+        uint64_t keys[size];
+        uint64_t values[size];
+
+        Scratch()
+        {
+            for(size_t i=0;i<size;++i) keys[i] = 0;
+        }
+
+        static size_t slotOf(uint64_t key)
+        {
+            return (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 56);
+        }
+
+        bool find(uint64_t key, uint64_t &value) const
+        {
+            for(auto i=slotOf(key);keys[i];i=(i+1)%size)
+            {
+                if(keys[i] != key) continue;
+                value = values[i];
+                return true;
+            }
+            return false;
+        }
+
+        void add(uint64_t key, uint64_t value)
+        {
+            auto i = slotOf(key);
+            while(keys[i]) i = (i+1)%size;
+            keys[i] = key;
+            values[i] = value;
+        }
+    };
+
+    TSMap::TSCache<uint64_t, uint64_t> memo;
+    const Mode mode;
+
+    /**
+     * f(num) for an odd num > 1, from the scratch table, the memo, or the
+     * decomposition f(num) = f(odd factor) + f(even factor)
+     */
+    uint64_t evaluateOdd(uint64_t num, Scratch &scratch)
+    {
+        uint64_t value;
+        if(scratch.find(num, value)) return value;
+        auto cached = memo.find(num);
+        if(cached)
+        {
+            value = *cached;
+        }
+        else
+        {
+            value = evaluateFactor(getOddFactor(num), scratch) +
+                    evaluateFactor(getEvenFactor(num), scratch);
+            memo.insert(num, value);
+        }
+        scratch.add(num, value);
+        return value;
+    }
+
+    uint64_t evaluateFactor(uint64_t factor, Scratch &scratch)
+    {
+        //covers 0 as well, f(0) = 1
+        if(isPowerOfTwo(factor)) return 1;
+        return evaluateOdd(divideByTwoIfEven(factor), scratch);
+    }
+};
+
+/**
+ * calculates f(n), see RecursionEngine, on an engine shared by the whole
+ * process
+ *
+ * param: n
+ * returns: f(n)
+ *
+ * please use a valid number in the uint64_t range. note that with the given
+ * relationship f(n) will always be smaller than n. there will be a wrap around
+ * if integer overflow were to occur, and will still give a valid value
+ * (UINT64_MAX+1 = 0). numbers beyond take the overload below, with an
+ * unsigned __int128 or a BigUnsigned.
+ */
+inline uint64_t calculateRecursionValue(uint64_t num)
+{
+    static RecursionEngine engine;
+    return engine.evaluate(num);
+}
+
+/**
+ * calculates f(n) for inputs wider than 64 bits, unsigned __int128 or
+ * BigUnsigned, with evaluateBitWalk: the memo of the engine holds 64 bit
+ * values only. there is no wrap around, f(n) <= n fits the type of n.
+ */
+template <typename T>
+typename std::enable_if<(sizeof(T) > sizeof(uint64_t)) && !std::is_signed<T>::value, T>::type
+calculateRecursionValue(const T &num)
+{
+    return evaluateBitWalk(num);
+}
@@ -0,0 +1,283 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <recursion.hpp>
+
+#define BOOST_TEST_MAIN
+#include <boost/test/included/unit_test.hpp>
+
+#define BOOST_TEST_MODULE recursion_test
+
+BOOST_AUTO_TEST_SUITE(recursion_test)
+
+/**
+ * f(0..count-1) straight from the definition, bottom-up
+ */
+static std::vector<uint64_t> referenceValues(size_t count)
+{
+    std::vector<uint64_t> f(std::max(count, (size_t)2));
+    f[0] = 1;
+    f[1] = 1;
+    for(size_t n=2;n<count;++n)
+    {
+        f[n] = n%2 ? f[n/2] + f[n/2-1] : f[n/2];
+    }
+    return f;
+}
+
+/**
+ * xorshift64*, the same generator as the benchmarks
+ */
+static uint64_t nextRandom(uint64_t &state)
+{
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+}
+
+BOOST_AUTO_TEST_CASE(engine_matches_definition)
+{
+    const size_t count = 1 << 20;
+    auto f = referenceValues(count);
+    RecursionEngine engine;
+    for(size_t n=0;n<count;++n)
+    {
+        BOOST_REQUIRE(engine.evaluate(n) == f[n]);
+    }
+    BOOST_TEST(engine.memoSize() <= engine.memoCapacity());
+
+    //the values printed by the exercise
+    BOOST_TEST(calculateRecursionValue(123456789012345678ULL) == 4296299699ULL);
+    BOOST_TEST(calculateRecursionValue(UINT64_MAX) == 17167680177565ULL);
+}
+
+BOOST_AUTO_TEST_CASE(bit_walk_matches_memo)
+{
+    const size_t count = 10000000;
+    auto f = referenceValues(count);
+    for(size_t n=0;n<count;++n)
+    {
+        BOOST_REQUIRE(evaluateBitWalk(n) == f[n]);
+    }
+
+    RecursionEngine memo;
+    RecursionEngine bitWalk(16, 0, RecursionEngine::Mode::bitWalk);
+    BOOST_TEST((bitWalk.getMode() == RecursionEngine::Mode::bitWalk));
+    uint64_t state = 7;
+    for(size_t i=0;i<100000;++i)
+    {
+        auto n = nextRandom(state);
+        BOOST_REQUIRE(bitWalk.evaluate(n) == memo.evaluate(n));
+    }
+    BOOST_TEST(bitWalk.memoSize() == 0u);
+    BOOST_TEST(evaluateBitWalk(123456789012345678ULL) == 4296299699ULL);
+    BOOST_TEST(evaluateBitWalk(UINT64_MAX) == 17167680177565ULL);
+    BOOST_TEST(memo.evaluate(UINT64_MAX, RecursionEngine::Mode::bitWalk) == 17167680177565ULL);
+}
+
+BOOST_AUTO_TEST_CASE(bit_walk_batch_levels)
+{
+    std::vector<bitwalk::Level> levels = {bitwalk::Level::scalar};
+    if(bitwalk::supportedLevel() != bitwalk::Level::scalar) levels.push_back(bitwalk::Level::avx2);
+    if(bitwalk::supportedLevel() == bitwalk::Level::avx512) levels.push_back(bitwalk::Level::avx512);
+
+    //groups mixing short and long inputs, and counts leaving every tail size
+    const size_t count = 1000;
+    std::vector<uint64_t> in(count), expected(count), out(count);
+    uint64_t state = 3;
+    for(size_t i=0;i<count;++i)
+    {
+        auto n = nextRandom(state);
+        in[i] = i%3 == 0 ? n : i%3 == 1 ? n >> (n%64) : i%7;
+        expected[i] = evaluateBitWalk(in[i]);
+    }
+    in[5] = UINT64_MAX;
+    expected[5] = 17167680177565ULL;
+
+    for(auto level : levels)
+    {
+        for(size_t n=0;n<=40;++n)
+        {
+            std::fill(out.begin(), out.end(), 0);
+            bitwalk::evaluate(in.data(), out.data(), n, level);
+            BOOST_REQUIRE(std::equal(out.begin(), out.begin()+n, expected.begin()));
+            BOOST_REQUIRE(out[n] == 0u);
+        }
+        bitwalk::evaluate(in.data(), out.data(), count, level);
+        BOOST_REQUIRE(out == expected);
+    }
+
+    //in place, and the engine in both modes
+    auto values = in;
+    evaluateBitWalk(values.data(), values.data(), count);
+    BOOST_TEST((values == expected));
+    RecursionEngine memo;
+    RecursionEngine bitWalk(16, 0, RecursionEngine::Mode::bitWalk);
+    memo.evaluate(in.data(), out.data(), count);
+    BOOST_TEST((out == expected));
+    bitWalk.evaluate(in.data(), out.data(), count);
+    BOOST_TEST((out == expected));
+}
+
+BOOST_AUTO_TEST_CASE(sequence_and_ranges)
+{
+    const size_t count = 1 << 20;
+    auto f = referenceValues(count);
+    RecursionSequence sequence;
+    for(size_t n=0;n<count;++n)
+    {
+        BOOST_REQUIRE(sequence.index() == n);
+        BOOST_REQUIRE(sequence.next() == f[n]);
+    }
+
+    //anywhere in the 64 bit range, and across the wrap around to 0
+    uint64_t state = 11;
+    for(size_t i=0;i<100;++i)
+    {
+        auto first = i ? nextRandom(state) : UINT64_MAX - 500;
+        RecursionSequence from(first);
+        for(uint64_t n=first;n!=first+1000;++n) BOOST_REQUIRE(from.next() == evaluateBitWalk(n));
+
+        //fill, four at a time, from any offset
+        uint64_t block[1003];
+        RecursionSequence filled(first + i%4);
+        filled.fill(block, 1003);
+        for(uint64_t j=0;j<1003;++j) BOOST_REQUIRE(block[j] == evaluateBitWalk(first + i%4 + j));
+        BOOST_REQUIRE(filled.next() == evaluateBitWalk(first + i%4 + 1003));
+    }
+
+    //ranges in a buffer and in blocks, on the calling thread and on a pool
+    TSMap::utility::WorkStealingPool pool(3);
+    BOOST_TEST(pool.participants() == 4u);
+    const uint64_t first = (uint64_t)1 << 40, last = first + 3*range::chunkSize + 1234;
+    std::vector<uint64_t> expected(last-first), out(last-first);
+    for(uint64_t n=first;n<last;++n) expected[n-first] = evaluateBitWalk(n);
+
+    evaluateRange(first, last, out.data());
+    BOOST_TEST((out == expected));
+    std::fill(out.begin(), out.end(), 0);
+    evaluateRange(first, last, out.data(), pool);
+    BOOST_TEST((out == expected));
+
+    for(int parallel=0;parallel<2;++parallel)
+    {
+        std::atomic<uint64_t> values(0), wrong(0);
+        auto check = [&](uint64_t n, const uint64_t *block, size_t blockCount)
+        {
+            if(blockCount > range::blockSize) ++wrong;
+            for(size_t i=0;i<blockCount;++i)
+            {
+                if(block[i] != expected[n+i-first]) ++wrong;
+            }
+            values += blockCount;
+        };
+        if(parallel) evaluateRange(first, last, check, pool);
+        else evaluateRange(first, last, check);
+        BOOST_TEST(values == last-first);
+        BOOST_TEST(wrong == 0u);
+    }
+
+    //empty ranges, and an exception thrown from a chunk
+    evaluateRange(5, 5, out.data(), pool);
+    evaluateRange(6, 5, out.data());
+    BOOST_CHECK_THROW(pool.forChunks(100, 1, [](uint64_t begin, uint64_t){
+        if(begin == 42) throw std::runtime_error("chunk 42");
+    }), std::runtime_error);
+    std::atomic<uint64_t> covered(0);
+    pool.forChunks(1000, 7, [&](uint64_t begin, uint64_t end){ covered += end-begin; });
+    BOOST_TEST(covered == 1000u);
+}
+
+BOOST_AUTO_TEST_CASE(wide_inputs)
+{
+    typedef unsigned __int128 u128;
+    //below 2^64 all types agree with the 64 bit walk
+    uint64_t state = 5;
+    for(size_t i=0;i<10000;++i)
+    {
+        auto n = nextRandom(state) >> (i%64);
+        auto expected = evaluateBitWalk(n);
+        BOOST_REQUIRE(evaluateBitWalk((u128)n) == expected);
+        BOOST_REQUIRE(evaluateBitWalk(BigUnsigned(n)) == BigUnsigned(expected));
+        BOOST_REQUIRE(evaluateBitWalk((uint32_t)n) == (uint32_t)evaluateBitWalk((uint64_t)(uint32_t)n));
+    }
+
+    //beyond, the definition for 128 bit numbers and numbers of up to 4096
+    //bits: f(2m+2) = f(m+1), f(2m+3) = f(m+1) + f(m)
+    for(size_t i=0;i<2000;++i)
+    {
+        auto m = (u128)nextRandom(state) << 62 | nextRandom(state);
+        BOOST_REQUIRE(evaluateBitWalk(2*m+2) == evaluateBitWalk(m+1));
+        BOOST_REQUIRE(evaluateBitWalk(2*m+3) == evaluateBitWalk(m+1) + evaluateBitWalk(m));
+        BOOST_REQUIRE(evaluateBitWalk(BigUnsigned(m)) == BigUnsigned(evaluateBitWalk(m)));
+    }
+    for(size_t bits=64;bits<=4096;bits*=2)
+    {
+        BigUnsigned m(nextRandom(state) | 1);
+        while(m.bitLength() < bits)
+        {
+            m += m;
+            if(nextRandom(state) & 1) m += BigUnsigned(1);
+        }
+        auto next = m + BigUnsigned(1);
+        BOOST_REQUIRE(evaluateBitWalk(next + next) == evaluateBitWalk(next));
+        BOOST_REQUIRE(evaluateBitWalk(next + next + BigUnsigned(1)) == evaluateBitWalk(next) + evaluateBitWalk(m));
+    }
+
+    //2^128 - 1 through both types, and decimal conversion
+    auto max128 = ~(u128)0;
+    auto big = BigUnsigned::fromString("340282366920938463463374607431768211455");
+    BOOST_TEST((big == BigUnsigned(max128)));
+    BOOST_TEST(big.bitLength() == 128u);
+    BOOST_TEST((calculateRecursionValue(big) == BigUnsigned(calculateRecursionValue(max128))));
+    BOOST_TEST(calculateRecursionValue(BigUnsigned(UINT64_MAX)).toString() == "17167680177565");
+    BOOST_TEST(calculateRecursionValue(BigUnsigned()).toString() == "1");
+    BOOST_TEST(BigUnsigned::fromString("0").toString() == "0");
+    auto digits = std::string("1") + std::string(100, '0') + "7";
+    BOOST_TEST(BigUnsigned::fromString(digits).toString() == digits);
+    BOOST_CHECK_THROW(BigUnsigned::fromString("12a"), std::invalid_argument*);
+    BOOST_CHECK_THROW(BigUnsigned::fromString(""), std::invalid_argument*);
+}
+
+BOOST_AUTO_TEST_CASE(engine_multithread_with_eviction)
+{
+    //a memo far too small for the factors of 64 bit numbers: values are
+    //evicted while other threads are halfway through evaluations using them
+    RecursionEngine reference(1 << 20);
+    RecursionEngine engine(64, 4);
+    const size_t perThread = 5000;
+
+    std::atomic<size_t> wrong(0);
+    std::thread tpool[8];
+    for(auto i=0;i<8;++i)
+    {
+        tpool[i] = std::thread([&](const int tid){
+            //half of the threads share their numbers, so they share factors
+            uint64_t state = tid%2 ? 1 : tid+1;
+            RecursionEngine local(1 << 12);
+            for(size_t j=0;j<perThread;++j){
+                auto n = nextRandom(state);
+                if(engine.evaluate(n) != local.evaluate(n)) ++wrong;
+            }
+        }, i);
+    }
+    std::for_each(tpool, tpool+8, [&](std::thread &t)
+    {
+        t.join();
+    });
+
+    BOOST_TEST(wrong == 0u);
+    BOOST_TEST(engine.memoSize() <= engine.memoCapacity());
+    auto stats = engine.memoStats();
+    BOOST_TEST(stats.hits > 0u);
+    BOOST_TEST(stats.evictions > 0u);
+
+    engine.clearMemo();
+    BOOST_TEST(engine.memoSize() == 0u);
+    BOOST_TEST(engine.evaluate(UINT64_MAX) == reference.evaluate(UINT64_MAX));
+}
+
+BOOST_AUTO_TEST_SUITE_END()